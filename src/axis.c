@@ -7,16 +7,20 @@
 #include "axis.h"
 #include "toml.h"
 #include <ctype.h>
+#include <float.h>
 #include <math.h>
-#include <pthread.h>
-#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/param.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #define NAME_LENGTH 3
 #define BUFLEN 1024
+// Round to nearest (even) by adding and removing 1.5 * 2^52, which drops
+// the fraction of any |x| < 2^51: unlike round(), it is no library call
+// and vectorizes
+#define ROUND(x) (((x) + 6755399441055744.0) - 6755399441055744.0)
 
 typedef struct axis {
   char name[NAME_LENGTH]; // like "X1\0"
@@ -30,18 +34,42 @@ typedef struct axis {
   data_t torque, max_torque;
   data_t pitch;              // conversion from torque to thrust
   data_t gravity;            // acceleration (vertical axes)
+  data_t tau;                // current loop time constant (0: ideal drive)
+  data_t torque_act;         // actual torque, lagging the commanded one
+  data_t encoder;            // encoder resolution (0: ideal encoder)
+  data_t backlash;           // transmission backlash (0: none)
+  data_t motor_position;     // motor side position (position is load side)
+  data_t measured;           // position as seen by the encoder
+  // gains, from the parameters above (see axis_gains())
+  data_t thrust, weight;     // force per unit torque, gravity force
+  data_t inv_mass, damping;  // 1 / effective mass, friction / effective mass
+  data_t inv_tau;            // 1 / tau (DBL_MAX: ideal drive)
+  data_t enc_step, enc_inv;  // encoder resolution and its inverse (1: none)
+  data_t enc_on;             // 1 with a real encoder, 0 with an ideal one
   data_t p, i, d;            // PID parameters
   data_t err_i, err_d;
   data_t prev_error;         // PID error at previous step
   data_t prev_ierror;        // PID previous integral error
   data_t prev_time;          // time at previous step
   struct axis *linked;       // another axis connected to this one
-  pthread_t thread;          // Euler integration thread
-  int stop, running;         // stop request for thread and thread status
   time_t t0;                 // time at axis creation (for delta)
   useconds_t integration_dt; // time step in Euler integration loop
 } axis_t;
 
+// Up to AXIS_LANES axes integrated together, as a structure of arrays (see
+// axis_advance_batch())
+typedef struct {
+  data_t torque[AXIS_LANES], torque_act[AXIS_LANES], inv_tau[AXIS_LANES];
+  data_t thrust[AXIS_LANES], weight[AXIS_LANES], length[AXIS_LANES];
+  data_t inv_mass[AXIS_LANES], damping[AXIS_LANES];
+  data_t motor[AXIS_LANES], speed[AXIS_LANES], position[AXIS_LANES];
+  data_t half_gap[AXIS_LANES], measured[AXIS_LANES], hit[AXIS_LANES];
+  data_t enc_step[AXIS_LANES], enc_inv[AXIS_LANES], enc_on[AXIS_LANES];
+} lanes_t;
+
+static void axis_gains(axis_t *a);
+static void lanes_step(lanes_t *l, data_t dt);
+
 //   _     _  __                      _
 //  | |   (_)/ _| ___  ___ _   _  ___| | ___
 //  | |   | | |_ / _ \/ __| | | |/ __| |/ _ \
@@ -60,7 +88,7 @@ axis_t *axis_new(char const *ini_path, char const *name) {
 
   // set defaults
   memset(axis, 0, sizeof(axis_t));
-  strncpy(axis->name, name, NAME_LENGTH);
+  snprintf(axis->name, NAME_LENGTH, "%s", name);
   axis->length = 1;
   axis->mass = 1000;
   axis->effective_mass = axis->mass;
@@ -99,6 +127,10 @@ axis_t *axis_new(char const *ini_path, char const *name) {
             axis->key);                                                        \
   else                                                                         \
     axis->key = d.u.i;
+#define T_READ_OPT(d, axis, tab, key)                                          \
+  d = toml_double_in(tab, #key);                                               \
+  if (d.ok)                                                                    \
+    axis->key = d.u.d;
 
   // 3. extract values from the C-CNC section
   // Sections must exist; missing keys only give a warning and use the default
@@ -119,7 +151,12 @@ axis_t *axis_new(char const *ini_path, char const *name) {
     T_READ_D(d, axis, tab, i);
     T_READ_D(d, axis, tab, d);
     T_READ_I(d, axis, tab, integration_dt);
+    // optional model stages: disabled (0) when missing
+    T_READ_OPT(d, axis, tab, tau);
+    T_READ_OPT(d, axis, tab, encoder);
+    T_READ_OPT(d, axis, tab, backlash);
   }
+  axis_gains(axis);
 
   toml_free(conf);
   return axis;
@@ -141,6 +178,7 @@ void axis_free(axis_t *axis) {
 void axis_link(axis_t *master, axis_t *slave) {
   master->linked = slave;
   master->effective_mass = master->mass + slave->effective_mass;
+  axis_gains(master);
 }
 
 //      _
@@ -171,7 +209,6 @@ axis_getter(data_t, length);
 axis_getter(data_t, torque);
 axis_getter(data_t, max_torque);
 axis_getter(axis_t *, linked);
-axis_getter(int, running);
 
 // Setters
 axis_setter(data_t, torque);
@@ -189,15 +226,18 @@ void axis_reset(axis_t *axis, data_t position) {
   struct timeval tv;
   gettimeofday(&tv, NULL);
   axis->position = position;
+  axis->motor_position = position;
+  axis->measured = position;
   axis->t0 = tv.tv_sec;
   axis->prev_time = axis->time;
-  axis->prev_error = axis->setpoint - axis->position;
+  axis->prev_error = axis->setpoint - axis->measured;
   axis->speed = 0.0;
+  axis->torque_act = axis->torque;
 }
 
 void axis_pid(axis_t *axis) {
   data_t out, err, dt;
-  err = axis->setpoint - axis->position;
+  err = axis->setpoint - axis->measured;
   dt = axis->time - axis->prev_time;
   if (axis->i)
     axis->err_i += (err + axis->prev_error) * dt / 2.0;
@@ -212,10 +252,176 @@ void axis_pid(axis_t *axis) {
     axis->torque = fmax(out, -axis->max_torque);
 }
 
+// All the model stages are evaluated in the same step, without branches
+// that depend on which stages are enabled: the gains of a disabled stage
+// (parameter equal to 0, see axis_gains()) make it an identity, so that the
+// added fidelity has a fixed and small cost
 void axis_forward_integrate(axis_t *a, data_t t) {
   data_t dt = t - a->time;
-  data_t m = a->effective_mass;
+  data_t half_gap = a->backlash / 2.0;
+  data_t f, q;
+  int hit;
+  // current loop: first order lag of the actual torque (1 if tau <= dt)
+  a->torque_act += (a->torque - a->torque_act) * MIN(dt * a->inv_tau, 1.0);
   // F = (2pi T)/(pitch)
+  f = a->torque_act * a->thrust - a->weight;
+  a->time = t;
+  a->motor_position = a->motor_position + a->speed * dt;
+  a->speed = a->speed * (1 - a->damping * dt) + f * dt * a->inv_mass;
+  // end of travel: the axis stops there
+  hit = (a->motor_position < 0) | (a->motor_position > a->length);
+  a->motor_position = MIN(MAX(a->motor_position, 0), a->length);
+  a->speed *= !hit;
+  a->err_d *= !hit;
+  a->err_i *= !hit;
+  // backlash: the load only follows the motor outside of the gap
+  a->position = MIN(MAX(a->position, a->motor_position - half_gap),
+                    a->motor_position + half_gap);
+  // encoder quantization (on the motor side)
+  q = ROUND(a->motor_position * a->enc_inv) * a->enc_step;
+  a->measured = a->motor_position + (q - a->motor_position) * a->enc_on;
+}
+
+// Integrate up to time in steps of integration_dt; the caller (usually the
+// step function of a simulation thread, see simloop.h) provides the timing
+void axis_advance(axis_t *a, data_t t) {
+  data_t h = a->integration_dt / 1E6;
+  if (t <= a->time)
+    return;
+  if (h <= 0)
+    h = t - a->time;
+  while (a->time + h < t)
+    axis_forward_integrate(a, a->time + h);
+  axis_forward_integrate(a, t);
+}
+
+// Axes with the same time and integration step are gathered into lanes and
+// integrated together, AXIS_LANES at a time, with the same results as
+// axis_advance() on each one; the others fall back to axis_advance()
+void axis_advance_batch(axis_t *const *axes, size_t n, data_t t) {
+  assert(axes);
+  lanes_t l;
+  axis_t *a;
+  data_t h, time;
+  size_t i, j, k, w;
+  for (i = 0; i < n; i += w) {
+    w = MIN(n - i, AXIS_LANES);
+    for (j = 1; j < w; j++) {
+      if (axes[i + j]->time != axes[i]->time ||
+          axes[i + j]->integration_dt != axes[i]->integration_dt)
+        break;
+    }
+    if (j < w || t <= axes[i]->time) {
+      for (j = 0; j < w; j++)
+        axis_advance(axes[i + j], t);
+      continue;
+    }
+    // gather; the unused lanes repeat the first axis
+    for (k = 0; k < AXIS_LANES; k++) {
+      a = axes[i + (k < w ? k : 0)];
+      l.torque[k] = a->torque;
+      l.torque_act[k] = a->torque_act;
+      l.inv_tau[k] = a->inv_tau;
+      l.thrust[k] = a->thrust;
+      l.weight[k] = a->weight;
+      l.inv_mass[k] = a->inv_mass;
+      l.damping[k] = a->damping;
+      l.length[k] = a->length;
+      l.motor[k] = a->motor_position;
+      l.speed[k] = a->speed;
+      l.position[k] = a->position;
+      l.half_gap[k] = a->backlash / 2.0;
+      l.measured[k] = a->measured;
+      l.hit[k] = 0;
+      l.enc_step[k] = a->enc_step;
+      l.enc_inv[k] = a->enc_inv;
+      l.enc_on[k] = a->enc_on;
+    }
+    // the same time steps as axis_advance()
+    time = axes[i]->time;
+    h = axes[i]->integration_dt / 1E6;
+    if (h <= 0)
+      h = t - time;
+    while (time + h < t) {
+      lanes_step(&l, (time + h) - time);
+      time = time + h;
+    }
+    lanes_step(&l, t - time);
+    // scatter
+    for (k = 0; k < w; k++) {
+      a = axes[i + k];
+      a->time = t;
+      a->torque_act = l.torque_act[k];
+      a->motor_position = l.motor[k];
+      a->speed = l.speed[k];
+      a->position = l.position[k];
+      a->measured = l.measured[k];
+      a->err_d *= l.hit[k] == 0;
+      a->err_i *= l.hit[k] == 0;
+    }
+  }
+}
+
+//   ____  _        _   _         __                  _   _
+//  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
+//  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//   ___) | || (_| | |_| | (__  |  _| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Gains of the mechanics and of the optional stages, from their parameters
+static void axis_gains(axis_t *a) {
+  a->thrust = M_PI / a->pitch;
+  a->weight = a->gravity * a->mass * a->pitch;
+  a->inv_mass = 1.0 / a->effective_mass;
+  a->damping = a->friction / a->effective_mass;
+  a->inv_tau = a->tau > 0 ? 1.0 / a->tau : DBL_MAX;
+  a->enc_on = a->encoder > 0;
+  a->enc_step = a->encoder > 0 ? a->encoder : 1.0;
+  a->enc_inv = 1.0 / a->enc_step;
+}
+
+// One integration step of all the lanes: the same operations as
+// axis_forward_integrate(), with no branches at all
+static void lanes_step(lanes_t *l, data_t dt) {
+  data_t f, q, out;
+  size_t k;
+  for (k = 0; k < AXIS_LANES; k++) {
+    l->torque_act[k] += (l->torque[k] - l->torque_act[k]) *
+                        MIN(dt * l->inv_tau[k], 1.0);
+    f = l->torque_act[k] * l->thrust[k] - l->weight[k];
+    l->motor[k] = l->motor[k] + l->speed[k] * dt;
+    l->speed[k] = l->speed[k] * (1 - l->damping[k] * dt) +
+                  f * dt * l->inv_mass[k];
+    out = (l->motor[k] < 0) | (l->motor[k] > l->length[k]);
+    l->hit[k] = MAX(l->hit[k], out);
+    l->motor[k] = MIN(MAX(l->motor[k], 0), l->length[k]);
+    l->speed[k] *= 1 - out;
+    l->position[k] = MIN(MAX(l->position[k], l->motor[k] - l->half_gap[k]),
+                         l->motor[k] + l->half_gap[k]);
+    q = ROUND(l->motor[k] * l->enc_inv[k]) * l->enc_step[k];
+    l->measured[k] = l->motor[k] + (q - l->motor[k]) * l->enc_on[k];
+  }
+}
+
+//   __  __       _
+//  |  \/  | __ _(_)_ __
+//  | |\/| |/ _` | | '_ \ 
+//  | |  | | (_| | | | | |
+//  |_|  |_|\__,_|_|_| |_|
+
+#ifdef AXIS_MAIN
+#include "simloop.h"
+#include <time.h>
+#include <unistd.h>
+
+// Period of the simulation thread in tuning mode (s)
+#define TUNING_PERIOD 0.001
+
+// Reference: the mechanics-only model, as it was before the drive, encoder
+// and backlash stages were added
+static void forward_integrate_mech(axis_t *a, data_t t) {
+  data_t dt = t - a->time;
+  data_t m = a->effective_mass;
   data_t f = M_PI * a->torque / a->pitch - a->gravity * a->mass * a->pitch;
   a->time = t;
   a->position = a->position + a->speed * dt;
@@ -227,56 +433,141 @@ void axis_forward_integrate(axis_t *a, data_t t) {
   }
 }
 
-static void *integrate(void *ud) {
-  axis_t *axis = (axis_t *)ud;
-  struct timeval tv;
-  data_t time;
-  while (axis->stop == 0) {
-    gettimeofday(&tv, NULL);
-    time = (tv.tv_sec - axis->t0) + ((data_t)tv.tv_usec) / 1E6;
-    axis_forward_integrate(axis, time);
-    usleep(axis->integration_dt);
+// Time n integration steps with a PID update every 1000 steps (5 ms)
+static data_t bench(axis_t *a, void (*step)(axis_t *, data_t), size_t n) {
+  struct timespec t0, t1;
+  data_t h = 5E-6;
+  size_t k;
+  a->time = 0;
+  axis_reset(a, 0);
+  axis_set_setpoint(a, 0.1);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (k = 1; k <= n; k++) {
+    if (k % 1000 == 0)
+      axis_pid(a);
+    step(a, k * h);
   }
-  fprintf(stderr, "Stopping integrator for axis %s\n", axis->name);
-  axis->stop = 0;
-  return NULL;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return ((t1.tv_sec - t0.tv_sec) * 1E9 + (t1.tv_nsec - t0.tv_nsec)) / n;
 }
 
-void axis_run(axis_t *axis) {
-  pthread_attr_t attr;
-  if (axis->running) {
-    return;
+// Same, for the three axes integrated together, with a PID update and an
+// axis_advance_batch() every 1000 steps; time per axis and step
+static data_t bench_batch(axis_t **axes, size_t n) {
+  struct timespec t0, t1;
+  data_t h = 5E-6;
+  size_t k, j;
+  for (j = 0; j < 3; j++) {
+    axes[j]->time = 0;
+    axes[j]->integration_dt = 5;
+    axis_reset(axes[j], 0);
+    axis_set_setpoint(axes[j], 0.1);
   }
-  axis->err_d = axis->err_i = 0.0;
-  pthread_attr_init(&attr);
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
-  pthread_create(&axis->thread, &attr, integrate, (void *)axis);
-  axis->running = 1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (k = 1000; k <= n; k += 1000) {
+    for (j = 0; j < 3; j++)
+      axis_pid(axes[j]);
+    axis_advance_batch(axes, 3, k * h);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return ((t1.tv_sec - t0.tv_sec) * 1E9 + (t1.tv_nsec - t0.tv_nsec)) / n / 3;
 }
 
-void axis_stop(axis_t *axis) {
-  axis->stop = 1;
-  axis->running = 0;
+// Enable all the stages (with the configured parameters, if any)
+static void stages_on(axis_t *a) {
+  a->tau = a->tau > 0 ? a->tau : 0.001;
+  a->encoder = a->encoder > 0 ? a->encoder : 1E-6;
+  a->backlash = a->backlash > 0 ? a->backlash : 1E-5;
+  axis_gains(a);
 }
 
-//   __  __       _
-//  |  \/  | __ _(_)_ __
-//  | |\/| |/ _` | | '_ \ 
-//  | |  | | (_| | | | | |
-//  |_|  |_|\__,_|_|_| |_|
+// Benchmark, then check that the batched step gives the same trajectories
+// as the scalar one, and that the full model in batch costs at most
+// BENCH_RATIO times the mechanics-only reference (best of BENCH_RUNS, for
+// a stable ratio on a loaded machine)
+#define BENCH_RATIO 1.5
+#define BENCH_RUNS 3
+static int bench_suite(axis_t **axes) {
+  axis_t *ax = axes[0], *ref[3];
+  size_t n = 4000000, j, k;
+  data_t t_ref = INFINITY, t_batch = INFINITY, dev = 0;
+  int rv = 0;
+  for (k = 0; k < BENCH_RUNS; k++)
+    t_ref = fmin(t_ref, bench(ax, forward_integrate_mech, n));
+  printf("mechanics only (reference): %6.2f ns/step\n", t_ref);
+  ax->tau = ax->encoder = ax->backlash = 0;
+  axis_gains(ax);
+  printf("all stages disabled:        %6.2f ns/step\n",
+         bench(ax, axis_forward_integrate, n));
+  for (j = 0; j < 3; j++)
+    stages_on(axes[j]);
+  printf("all stages enabled:         %6.2f ns/step\n",
+         bench(ax, axis_forward_integrate, n));
+  for (k = 0; k < BENCH_RUNS; k++)
+    t_batch = fmin(t_batch, bench_batch(axes, n));
+  printf("all stages, 3 axes batched: %6.2f ns/step per axis\n", t_batch);
+
+  // the same motion, scalar and batched
+  for (j = 0; j < 3; j++) {
+    if (!(ref[j] = malloc(sizeof(axis_t))))
+      return 1;
+    memcpy(ref[j], axes[j], sizeof(axis_t));
+  }
+  for (k = 1; k <= 1000; k++) {
+    for (j = 0; j < 3; j++) {
+      axis_set_setpoint(axes[j], k < 500 ? 0.05 : 0.01);
+      axis_set_setpoint(ref[j], k < 500 ? 0.05 : 0.01);
+      axis_pid(axes[j]);
+      axis_pid(ref[j]);
+      axis_advance(ref[j], axes[j]->time + 0.005);
+    }
+    axis_advance_batch(axes, 3, axes[0]->time + 0.005);
+    for (j = 0; j < 3; j++) {
+      dev = fmax(dev, fabs(axes[j]->position - ref[j]->position));
+      dev = fmax(dev, fabs(axes[j]->measured - ref[j]->measured));
+    }
+  }
+  for (j = 0; j < 3; j++)
+    free(ref[j]);
+  printf("batched vs scalar: max deviation %g m, cost ratio %.2f\n", dev,
+         t_batch / t_ref);
+  if (dev > 1E-12) {
+    eprintf("Batched integration differs from the scalar one\n");
+    rv = 1;
+  }
+  if (t_batch > t_ref * BENCH_RATIO) {
+    eprintf("Full model costs more than %.1f times the mechanics\n",
+            BENCH_RATIO);
+    rv = 1;
+  }
+  return rv;
+}
 
-#ifdef AXIS_MAIN
+// Step function of the simulation thread: the three axes are integrated
+// together, as on the real machine
+static void tuning_step(void *ud, data_t t) {
+  axis_advance_batch((axis_t **)ud, 3, t);
+}
 
 int main(int argc, char const **argv) {
   // data_t dt = 0.005;
   // data_t time = 0;
-  axis_t *ax = axis_new("machine.ini", "X");
-  axis_t *ay = axis_new("machine.ini", "Y");
-  axis_t *az = axis_new("machine.ini", "Z");
+  int bench_mode = argc >= 2 && strcmp(argv[1], "bench") == 0;
+  char const *ini = bench_mode && argc == 3 ? argv[2] : "machine.ini";
+  axis_t *ax = axis_new(ini, "X");
+  axis_t *ay = axis_new(ini, "Y");
+  axis_t *az = axis_new(ini, "Z");
   axis_t *a;
+  axis_t *axes[3] = {ax, ay, az};
+  simloop_t *loop = NULL;
+  if (bench_mode) {
+    if (!ax || !ay || !az)
+      exit(EXIT_FAILURE);
+    exit(bench_suite(axes) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
   if (argc != 3) {
     eprintf("Usage: %s <seconds> <X|Y|Z>\n", argv[0]);
+    eprintf("       %s bench [machine.ini]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
   switch (toupper(argv[2][0]))
@@ -312,9 +603,9 @@ int main(int argc, char const **argv) {
 
   printf("t q x v p i d\n");
 
-  axis_run(ax);
-  axis_run(ay);
-  axis_run(az);
+  loop = simloop_new(TUNING_PERIOD, -1, tuning_step, axes);
+  if (!loop || simloop_start(loop))
+    exit(EXIT_FAILURE);
 
   fprintf(stderr, "axis %s: p %.3f i %.3f d %.3f\n", a->name, a->p, a->i, a->d);
   while (a->time < atof(argv[1])) {
@@ -328,10 +619,12 @@ int main(int argc, char const **argv) {
            axis_speed(a), a->setpoint - a->position, a->err_i, a->err_d );
     usleep(10000);
   }
-  axis_stop(ax);
-  axis_stop(ay);
-  axis_stop(az);
-  usleep(500000);
+  simloop_stop(loop);
+  fprintf(stderr, "%llu ticks, %llu overruns, max step %.3f ms\n",
+          (unsigned long long)simloop_ticks(loop),
+          (unsigned long long)simloop_overruns(loop),
+          simloop_max_step(loop) * 1E3);
+  simloop_free(loop);
   axis_free(ax);
   axis_free(ay);
   axis_free(az);
@@ -11,6 +11,9 @@
 
 typedef struct axis axis_t;
 
+// Axes integrated together by axis_advance_batch()
+#define AXIS_LANES 4
+
 // Lifecycle
 axis_t *axis_new(char const *ini_path, char const *name);
 void axis_free(axis_t *axis);
@@ -26,7 +29,6 @@ data_t axis_length(axis_t const *b);
 data_t axis_torque(axis_t const *b);
 data_t axis_max_power(axis_t const *b);
 axis_t *axis_linked(axis_t const *b);
-int axis_running(axis_t const *b);
 
 void axis_set_torque(axis_t *b, data_t value);
 void axis_set_setpoint(axis_t *b, data_t value);
@@ -36,7 +38,8 @@ void axis_set_i(axis_t *b, data_t value);
 void axis_reset(axis_t *axis, data_t position);
 void axis_pid(axis_t *axis);
 void axis_forward_integrate(axis_t *axis, data_t time);
-void axis_run(axis_t *axis);
-void axis_stop(axis_t *axis);
+void axis_advance(axis_t *axis, data_t time);
+// Same as axis_advance() on each of the n axes, integrated together
+void axis_advance_batch(axis_t *const *axes, size_t n, data_t time);
 
 #endif // AXIS_H
\ No newline at end of file
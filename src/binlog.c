@@ -0,0 +1,224 @@
+//   ____  _       _
+//  | __ )(_)_ __ | | ___   __ _
+//  |  _ \| | '_ \| |/ _ \ / _` |
+//  | |_) | | | | | | (_) | (_| |
+//  |____/|_|_| |_|_|\___/ \__, |
+//                         |___/
+
+#include "binlog.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+//   ____            _                 _   _
+//  |  _ \  ___  ___| | __ _ _ __ __ _| |_(_) ___  _ __  ___
+//  | | | |/ _ \/ __| |/ _` | '__/ _` | __| |/ _ \| '_ \/ __|
+//  | |_| |  __/ (__| | (_| | | | (_| | |_| | (_) | | | \__ \
+//  |____/ \___|\___|_|\__,_|_|  \__,_|\__|_|\___/|_| |_|___/
+
+// Period of the background writer when the ring is empty (nanoseconds)
+#define FLUSH_PERIOD 20000000
+
+typedef struct binlog {
+  FILE *file;              // destination file
+  data_t *ring;            // capacity * n_cols values
+  size_t capacity, mask;   // number of records in the ring (power of 2)
+  uint32_t n_cols;         // values per record
+  atomic_size_t head;      // next record to be written (producer)
+  atomic_size_t tail;      // next record to be flushed (writer thread)
+  atomic_size_t dropped;   // records lost because the ring was full
+  atomic_int stop;         // stop request for the writer thread
+  pthread_t thread;        // writer thread
+} binlog_t;
+
+static void *binlog_writer(void *ud);
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+binlog_t *binlog_new(char const *path, binlog_kind_t kind, uint32_t n_cols,
+                     size_t capacity) {
+  binlog_header_t header = {.magic = BINLOG_MAGIC, .kind = kind,
+                            .n_cols = n_cols};
+  binlog_t *log = NULL;
+  sigset_t mask, old_mask;
+  int rc;
+  assert(path && n_cols > 0);
+  log = malloc(sizeof(*log));
+  if (!log) {
+    eprintf("Could not allocate memory for binary log\n");
+    return NULL;
+  }
+  memset(log, 0, sizeof(*log));
+  log->n_cols = n_cols;
+  log->capacity = 1;
+  while (log->capacity < capacity)
+    log->capacity <<= 1;
+  log->mask = log->capacity - 1;
+  atomic_init(&log->head, 0);
+  atomic_init(&log->tail, 0);
+  atomic_init(&log->dropped, 0);
+  atomic_init(&log->stop, 0);
+
+  log->ring = malloc(log->capacity * n_cols * sizeof(data_t));
+  if (!log->ring) {
+    eprintf("Could not allocate memory for binary log ring\n");
+    goto fail;
+  }
+  log->file = fopen(path, "wb");
+  if (!log->file) {
+    eprintf("Cannot open %s for writing\n", path);
+    goto fail;
+  }
+  if (fwrite(&header, sizeof(header), 1, log->file) != 1) {
+    eprintf("Could not write header of %s\n", path);
+    goto fail;
+  }
+  // the writer must not steal the timer signals of the real-time loop
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  rc = pthread_create(&log->thread, NULL, binlog_writer, log);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (rc) {
+    eprintf("Could not start the binary log writer\n");
+    goto fail;
+  }
+  return log;
+
+fail:
+  if (log->file)
+    fclose(log->file);
+  free(log->ring);
+  free(log);
+  return NULL;
+}
+
+void binlog_free(binlog_t *log) {
+  assert(log);
+  atomic_store(&log->stop, 1);
+  pthread_join(log->thread, NULL);
+  fclose(log->file);
+  if (atomic_load(&log->dropped) > 0)
+    wprintf("Binary log dropped %zu records\n", atomic_load(&log->dropped));
+  free(log->ring);
+  free(log);
+}
+
+// Accessors ===================================================================
+size_t binlog_dropped(binlog_t const *log) {
+  assert(log);
+  return atomic_load(&((binlog_t *)log)->dropped);
+}
+
+// Methods =====================================================================
+// Single producer: only the real-time thread calls this
+int binlog_write(binlog_t *log, data_t const *record) {
+  assert(log && record);
+  size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+  if (head - tail >= log->capacity) {
+    atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+    return 1;
+  }
+  memcpy(log->ring + (head & log->mask) * log->n_cols, record,
+         log->n_cols * sizeof(data_t));
+  atomic_store_explicit(&log->head, head + 1, memory_order_release);
+  return 0;
+}
+
+//   ____  _        _   _         __                  _   _
+//  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
+//  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//   ___) | || (_| | |_| | (__  |  _| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Background writer: flushes whatever is in the ring with (at most) two
+// contiguous fwrite calls, then sleeps if nothing is left
+static void *binlog_writer(void *ud) {
+  binlog_t *log = (binlog_t *)ud;
+  struct timespec period = {.tv_sec = 0, .tv_nsec = FLUSH_PERIOD};
+  size_t head, tail, first, n;
+  int stop;
+  while (1) {
+    stop = atomic_load(&log->stop);
+    head = atomic_load_explicit(&log->head, memory_order_acquire);
+    tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    if (head == tail) {
+      if (stop)
+        break;
+      nanosleep(&period, NULL);
+      continue;
+    }
+    first = tail & log->mask;
+    n = head - tail;
+    if (first + n > log->capacity) { // wraps around the end of the ring
+      fwrite(log->ring + first * log->n_cols, sizeof(data_t) * log->n_cols,
+             log->capacity - first, log->file);
+      n -= log->capacity - first;
+      first = 0;
+    }
+    fwrite(log->ring + first * log->n_cols, sizeof(data_t) * log->n_cols, n,
+           log->file);
+    atomic_store_explicit(&log->tail, head, memory_order_release);
+  }
+  fflush(log->file);
+  return NULL;
+}
+
+//   _____         _
+//  |_   _|__  ___| |_
+//    | |/ _ \/ __| __|
+//    | |  __/\__ \ |_
+//    |_|\___||___/\__|
+
+#ifdef BINLOG_MAIN
+int main(int argc, char const *argv[]) {
+  char const *path = argc > 1 ? argv[1] : "binlog_test.bin";
+  binlog_header_t header;
+  data_t rec[3];
+  size_t i, n = 10000;
+  FILE *f;
+  binlog_t *log = binlog_new(path, BINLOG_CCNC, 3, 1024);
+  if (!log)
+    exit(EXIT_FAILURE);
+  // a small ring forces many wrap-arounds; retry on full ring
+  for (i = 0; i < n; i++) {
+    rec[0] = i;
+    rec[1] = i * 0.5;
+    rec[2] = -(data_t)i;
+    while (binlog_write(log, rec)) {
+      struct timespec ts = {0, 100000};
+      nanosleep(&ts, NULL);
+    }
+  }
+  binlog_free(log);
+
+  // read back and check
+  f = fopen(path, "rb");
+  if (!f || fread(&header, sizeof(header), 1, f) != 1 ||
+      strcmp(header.magic, BINLOG_MAGIC) || header.n_cols != 3) {
+    eprintf("Bad header\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; fread(rec, sizeof(rec), 1, f) == 1; i++) {
+    if (rec[0] != i || rec[1] != i * 0.5 || rec[2] != -(data_t)i) {
+      eprintf("Bad record %zu\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+  fclose(f);
+  remove(path);
+  if (i != n) {
+    eprintf("Read %zu records, expected %zu\n", i, n);
+    exit(EXIT_FAILURE);
+  }
+  printf("Read back %zu records\n", i);
+  return 0;
+}
+#endif
@@ -0,0 +1,62 @@
+//   ____  _       _
+//  | __ )(_)_ __ | | ___   __ _
+//  |  _ \| | '_ \| |/ _ \ / _` |
+//  | |_) | | | | | | (_) | (_| |
+//  |____/|_|_| |_|_|\___/ \__, |
+//                         |___/
+// Buffered binary logger
+// Fixed-size records of data_t values are pushed into a lock-free ring by the
+// real-time thread and written to file in large chunks by a background thread
+
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include "defines.h"
+
+//   _____
+//  |_   _|   _ _ __   ___  ___
+//    | || | | | '_ \ / _ \/ __|
+//    | || |_| | |_) |  __/\__ \
+//    |_| \__, | .__/ \___||___/
+//        |___/|_|
+
+// Opaque struct
+typedef struct binlog binlog_t;
+
+// Record layouts (stored in the file header, used by the text converter)
+typedef enum {
+  BINLOG_SIMULATE = 1, // t qx sx x vx qy sy y vy qz sz z vz d r
+  BINLOG_CCNC          // n type t_tot t_blk lambda s feed x y z
+} binlog_kind_t;
+
+#define BINLOG_MAGIC "CCNCLOG"
+
+// File header, followed by records of n_cols data_t values
+typedef struct {
+  char magic[8];
+  uint32_t kind;
+  uint32_t n_cols;
+} binlog_header_t;
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+// capacity is the number of records in the ring (rounded up to a power of 2)
+binlog_t *binlog_new(char const *path, binlog_kind_t kind, uint32_t n_cols,
+                     size_t capacity);
+// flushes all pending records, stops the writer thread and closes the file
+void binlog_free(binlog_t *log);
+
+// Accessors ===================================================================
+size_t binlog_dropped(binlog_t const *log);
+
+// Methods =====================================================================
+// Never blocks: returns 1 (and counts the record as dropped) if the ring is
+// full
+int binlog_write(binlog_t *log, data_t const *record);
+
+#endif // BINLOG_H
@@ -5,8 +5,10 @@
 //  |____/|_|\___/ \___|_|\_\
 //
 #include "block.h"
+#include "curve.h"
 #include "defines.h"
 #include "machine.h"
+#include "profile.h"
 #include <ctype.h> // toupper()
 #include <math.h>
 #include <sys/param.h> // MIN()
@@ -17,42 +19,177 @@
 //  | |_| |  __/ (__| | (_| | | | (_| | |_| | (_) | | | \__ \
 //  |____/ \___|\___|_|\__,_|_|  \__,_|\__|_|\___/|_| |_|___/
 //
-// Velocity profile data
+// Incremental arc stepper: the angle is advanced by rotating the last
+// (cos, sin) pair, rather than evaluating cos() and sin() at every tick
+// Maximum rotation per step for the series expansion (rad): the truncation
+// error of the 5th order series is below phi^6/720 ~ 2E-11 per step
+#define ARC_STEP_MAX 0.05
+// Exact re-evaluation period (steps), bounding the accumulated drift
+#define ARC_RESYNC 256
 typedef struct {
-  data_t a, d;             // acceleration and deceleration
-  data_t f, l;             // nominal feedrate and length
-  data_t fs, fe;           // initial and final feedrate
-  data_t dt_1, dt_m, dt_2; // trapezoidal profile times
-  data_t dt;               // total block duration
-} block_profile_t;
-
-// Object struct (opaque)
+  data_t lambda;  // last interpolated lambda (negative: invalid)
+  data_t c, s;    // cos and sin of the angle at lambda
+  unsigned steps; // incremental steps since the last exact evaluation
+} block_arcstep_t;
+
+// Corner blends: quintic Bezier with three control points on each leg,
+// equally spaced by d / 5 up to distance d from the corner. Both end
+// curvatures vanish, so the path is curvature continuous with the lines.
+// The midpoint is the farthest from the corner, at 11/16 d sin(theta/2)
+// where theta is the change of direction
+#define BLEND_DEV (11.0 / 16.0)
+// Smallest change of direction worth a blend (rad), and largest one (a
+// near reversal is better taken with an exact stop)
+#define BLEND_MIN_ANGLE 1E-6
+#define BLEND_MAX_ANGLE (M_PI - 1E-3)
+
+// A cruise counts as at the programmed feed when within this fraction of it
+// (quantization lowers the cruise feed of short blocks a little)
+#define CRUISE_FEED_TOL 0.01
+
+// Samples per segment for the extents of blends and splines
+#define EXTENTS_SAMPLES 16
+
+// Nearest point on helices: samples per turn bracketing the minimum, and
+// golden section steps refining it
+#define NEAREST_SAMPLES 16
+#define NEAREST_STEPS 44
+
+// Longest run of lines merged by block_compress() (the fit is checked
+// again over the whole run at each extension)
+#define COMPRESS_MAX_RUN 256
+
+// Spline fitting: runs of at least SPLINE_MIN_RUN lines, turning by less
+// than SPLINE_MAX_TURN (rad) at each vertex, are replaced by cubic pieces
+// spanning up to SPLINE_MAX_PIECE lines each. The fit is checked both ways
+// (polyline to curve and curve to polyline) on SPLINE_SAMPLES points per
+// line
+#define SPLINE_MIN_RUN 3
+#define SPLINE_MAX_RUN 1024
+#define SPLINE_MAX_PIECE 32
+#define SPLINE_MAX_TURN 0.5
+#define SPLINE_SAMPLES 8
+
+// Cutter compensation: offset ends closer than COMP_TOL (mm) meet without a
+// join. Each compensated block is described in the XY plane by its offset
+// element, a line through p with unit direction d, or a circle of center c
+// and radius ro (the programmed radius being r)
+#define COMP_TOL 1E-6
+typedef struct {
+  int arc;
+  data_t p[2], d[2];
+  data_t c[2], r, ro;
+} comp_elem_t;
+
+// Working planes of arcs (G17, G18, G19): the first two axes of each row
+// span the plane, and arcs turn counterclockwise about the third one
+typedef enum { PLANE_XY = 0, PLANE_ZX, PLANE_YZ } plane_t;
+static int const plane_axes[3][3] = {{0, 1, 2}, {2, 0, 1}, {1, 2, 0}};
+
+// Arc geometry, allocated for arc blocks only. The center is kept relative
+// to the start point, as given by the I, J, K words, so that the record is
+// the same for translated copies of the arc, which share it (the stepper
+// state is an angle, the same for all of them)
+typedef struct {
+  data_t ofs[3];         // center, from the start point
+  data_t R;              // R word (0: the center is given by ofs)
+  data_t r;              // radius
+  data_t theta0, dtheta; // initial and arc angles
+  block_arcstep_t step;  // stepper state
+  unsigned refs;         // blocks sharing the record
+} block_arc_t;
+
+// Instances of a subprogram line share its words, and with them the last
+// profile planned for any of them, with the inputs it was planned for
+typedef struct {
+  unsigned refs;    // blocks sharing the words
+  profile_t *prof;  // last planned profile (NULL: none yet)
+  data_t fs, fe;    // junction feeds (mm/min)
+  data_t l, f, R;   // length, nominal feed and radius of curvature
+} block_share_t;
+
+// Words and modes of the G-code line only read while parsing and planning,
+// in a separate allocation (cold data). The line follows the struct
+typedef struct {
+  size_t n;             // block number
+  size_t tool;          // tool number
+  data_t feedrate;      // feedrate in mm/min
+  data_t spindle;       // spindle rotational speed in RPM
+  block_share_t *share; // NULL unless shared by instances
+} block_src_t;
+
+// Object struct (opaque). The fields read while interpolating come first,
+// so that running through the program touches as few cache lines as
+// possible, then those only used for planning. The target point follows
+// the struct in the same allocation, and for the first block its start
+// point (machine zero) follows the target
 typedef struct block {
-  char *line;               // G-code string
-  block_type_t type;        // block type
-  size_t n;                 // block number
-  size_t tool;              // tool number
-  data_t feedrate;          // feedrate in mm/min
-  data_t arc_feedrate;      // actual nominal feedrate along an arc motion
-  data_t spindle;           // spindle rotational speed in RPM
-  point_t *target;          // final coordinate of this block
-  point_t *delta;           // projections
-  point_t *center;          // arc center coordinates
-  data_t length;            // segment of arc length
-  data_t i, j, r;           // arc parameters
-  data_t theta0, dtheta;    // initial and arc angles
-  data_t acc;               // actual acceleration
-  block_profile_t *prof;    // block velocity profile data
-  machine_t const *machine; // machine object (holding config data)
   struct block *prev;
   struct block *next;
+  uint8_t type;          // block type (block_type_t)
+  uint8_t plane;         // plane of arcs (plane_t: G17, G18, G19)
+  uint8_t blend;         // G64 (1) or G61 (0) path mode
+  uint8_t incremental;   // G91 (1) or G90 (0) distance mode
+  int8_t comp;           // cutter compensation: G40 (0), G41 (1), G42 (-1)
+  uint8_t axes;          // axes given by the line (X: 1, Y: 2, Z: 4)
+  data_t length;         // segment of arc length
+  data_t t_ofs, s_ofs;   // time and distance where the profile starts
+  profile_t *prof;       // block velocity profile data
+  union {
+    block_arc_t *arc;    // arc geometry (ARC_CW, ARC_CCW)
+    curve_t *curve;      // blend or spline curve (BLEND, SPLINE)
+  };
+  // planning
+  data_t arc_feedrate;   // actual nominal feedrate along the path
+  data_t fs, fe;         // junction feeds in mm/min (0: exact stop)
+  data_t ovr;            // feed override of the current profile
+  block_src_t *src;      // words of the G-code line
 } block_t;
 
 // STATIC FUNCTIONS
-static point_t *start_point(block_t *b);
-static int block_set_fields(block_t *b, char cmd, char *argv);
-static void block_compute(block_t *b);
-static int block_arc(block_t *b);
+static point_t *start_point(block_t const *b);
+static void block_delta(block_t const *b, data_t d[3]);
+static int block_set_fields(block_t *b, machine_t const *m, char cmd,
+                            char *arg, data_t w[4]);
+static int block_moves(block_t const *b);
+static int block_motion(block_t *b, machine_t const *m);
+static int block_compute(block_t *b, machine_t const *m);
+static int block_words(block_t *b, machine_t const *m);
+static int block_own(block_t *b);
+static int block_share(block_t *b, block_t const *t);
+static int block_reuse(block_t *b);
+static void block_remember(block_t *b);
+static int block_same_modes(block_t const *a, block_t const *b);
+static data_t block_tq(machine_t const *m);
+static void block_limits(block_t const *b, machine_t const *m, data_t *A,
+                         data_t *J);
+static void block_geometry(block_t *b);
+static int block_direction(block_t const *b, int end, data_t dir[3]);
+static int block_set_arc(block_t *b, block_type_t type, data_t const ofs[3],
+                         data_t R);
+static int block_arc(block_t *b, machine_t const *m);
+static void arc_center(block_t const *b, data_t c[3]);
+static int fit_line(data_t const (*pt)[3], size_t k, data_t tol);
+static int fit_arc(data_t const (*pt)[3], size_t k, data_t tol, data_t c[2],
+                   int *ccw);
+static int fit_cubic(data_t const (*pt)[3], data_t const (*tg)[3], size_t i,
+                     size_t j, data_t tol, data_t ctrl[12]);
+static data_t block_curvature_radius(block_t const *b);
+static void arc_angle(block_arc_t *a, data_t lambda);
+static point_t *arc_point(block_t const *b, point_t const *p0, data_t lambda,
+                          point_t *result);
+static void point_get(point_t const *p, data_t v[3]);
+static void block_point(block_t const *b, data_t lambda, data_t xyz[3]);
+static data_t nearest_dist2(block_t const *b, data_t lambda,
+                            data_t const x[3]);
+static int comp_elem(block_t const *b, data_t const s[2], data_t const e[2],
+                     data_t r, comp_elem_t *o, data_t ts[2], data_t te[2]);
+static void comp_point(comp_elem_t const *o, data_t const q[2],
+                       data_t out[2]);
+static int comp_cross(comp_elem_t const *a, comp_elem_t const *b,
+                      data_t const near[2], data_t x[2]);
+static int comp_finish(block_t *a, data_t const c[2], machine_t const *m,
+                       block_t *stop, data_t const x[2], data_t const y[2]);
 
 //   _____                 _   _
 //  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
@@ -62,68 +199,63 @@ static int block_arc(block_t *b);
 //
 // LIFECYCLE ===================================================================
 block_t *block_new(char const *line, block_t *prev, machine_t const *machine) {
-  assert(line);
-  // allocate memory
-  block_t *b = malloc(sizeof(block_t));
-  if (!b) {
+  assert(line && (prev || machine));
+  size_t len = strlen(line) + 1;
+  // allocate memory: the block with its target point (and start point, for
+  // the first block) at once, and the words with their line
+  block_t *b = malloc(sizeof(block_t) + (prev ? 1 : 2) * point_size());
+  block_src_t *src = malloc(sizeof(block_src_t) + len);
+  profile_t *prof = profile_new();
+  if (!b || !src || !prof) {
     eprintf("Could not allocate memory for a block\n");
-    goto fail;
+    free(b);
+    free(src);
+    if (prof)
+      profile_free(prof);
+    return NULL;
   }
 
   if (prev) { // copy the memory from the previous block
     memcpy(b, prev, sizeof(block_t));
+    memcpy(src, prev->src, sizeof(block_src_t));
+    src->share = NULL;
     b->prev = prev;
     prev->next = b;
   } else { // this is the first block: set everything to 0
     memset(b, 0, sizeof(block_t));
+    memset(src, 0, sizeof(block_src_t));
+    memcpy(point_new_at((char *)(b + 1) + point_size()),
+           machine_zero(machine), point_size());
   }
 
   // in any case all non-modal parameters are set to 0
-  b->i = b->j = b->r = 0;
   b->length = 0;
+  b->fs = b->fe = 0;
   b->type = NO_MOTION;
-
-  // machine parameters
-  b->machine = machine;
-  b->acc = machine_A(b->machine);
-
-  // fields to be calculated
-  b->prof = malloc(sizeof(block_profile_t));
-  if (!b->prof) {
-    eprintf("Could not allocate memory for block profile\n");
-    goto fail;
-  }
-  b->target = point_new();
-  b->delta = point_new();
-  b->center = point_new();
-  if (!b->center || !b->delta || !b->target) {
-    eprintf("Could not allocate points in a new block\n");
-    goto fail;
-  }
-  b->line = strdup(line);
-  if (!b->line) {
-    eprintf("Could not allocate memory for block line\n");
-    goto fail;
-  }
+  b->axes = 0;
+  b->arc = NULL;
+  b->prof = prof;
+  b->src = src;
+  point_new_at(b + 1);
+  memcpy(src + 1, line, len);
   return b;
-fail:
-  if (b)
-    block_free(b);
-  return NULL;
 }
 
 void block_free(block_t *b) {
   assert(b);
-  if (b->line)
-    free(b->line);
-  if (b->prof)
-    free(b->prof);
-  if (b->target)
-    point_free(b->target);
-  if (b->delta)
-    point_free(b->delta);
-  if (b->center)
-    point_free(b->center);
+  block_share_t *sh = b->src->share;
+  if ((b->type == ARC_CW || b->type == ARC_CCW) && b->arc &&
+      --b->arc->refs == 0)
+    free(b->arc);
+  else if ((b->type == BLEND || b->type == SPLINE) && b->curve)
+    curve_free(b->curve);
+  profile_free(b->prof);
+  if (!sh || --sh->refs == 0) {
+    if (sh && sh->prof)
+      profile_free(sh->prof);
+    free(sh);
+    free(b->src);
+  }
   free(b);
 }
 
@@ -132,9 +264,10 @@ void block_print(block_t *b, FILE *out) {
   char *start = NULL, *end = NULL;
   point_t *p0 = start_point(b);
   point_inspect(p0, &start);
-  point_inspect(b->target, &end);
-  fprintf(out, "%03lu %s->%s F%7.1f S%7.1f T%2lu (G%02d)\n", b->n, start, end,
-          b->feedrate, b->spindle, b->tool, b->type);
+  point_inspect(block_target(b), &end);
+  fprintf(out, "%03lu %s->%s F%7.1f S%7.1f T%2lu (G%02d)\n", b->src->n,
+          start, end, b->src->feedrate, b->src->spindle, b->src->tool,
+          b->type);
   free(start);
   free(end);
 }
@@ -148,146 +281,921 @@ void block_print(block_t *b, FILE *out) {
   }
 
 block_getter(data_t, length, length);
-block_getter(data_t, dtheta, dtheta);
-block_getter(data_t, prof->dt, dt);
 block_getter(block_type_t, type, type);
-block_getter(char *, line, line);
-block_getter(size_t, n, n);
-block_getter(data_t, r, r);
-block_getter(point_t *, center, center);
-block_getter(point_t *, target, target);
+block_getter(size_t, src->n, n);
 block_getter(block_t *, next, next);
+block_getter(data_t, fs, fs);
+block_getter(data_t, ovr, override);
+block_getter(int, comp, comp);
+
+// The target point and the line are found from b, in their allocations
+point_t *block_target(block_t const *b) {
+  assert(b);
+  return (point_t *)(b + 1);
+}
+
+char *block_line(block_t const *b) {
+  assert(b);
+  return (char *)(b->src + 1);
+}
+
+data_t block_r(block_t const *b) {
+  assert(b);
+  return b->type == ARC_CW || b->type == ARC_CCW ? b->arc->r : 0;
+}
+
+data_t block_dtheta(block_t const *b) {
+  assert(b);
+  return b->type == ARC_CW || b->type == ARC_CCW ? b->arc->dtheta : 0;
+}
+
+void block_center(block_t const *b, data_t c[3]) {
+  assert(b && c);
+  if (b->type == ARC_CW || b->type == ARC_CCW)
+    arc_center(b, c);
+  else
+    point_get(start_point(b), c);
+}
+
+int block_shared(block_t const *b) {
+  assert(b);
+  return profile_shared(b->prof);
+}
+
+data_t block_dt(block_t const *b) {
+  assert(b);
+  return b->t_ofs + profile_dt(b->prof);
+}
+
+data_t block_fe(block_t const *b) {
+  assert(b);
+  return profile_fe(b->prof) * 60;
+}
+
+data_t block_cruise(block_t const *b) {
+  assert(b);
+  if (!block_moves(b) ||
+      profile_f(b->prof) * 60 < b->src->feedrate * (1 - CRUISE_FEED_TOL))
+    return 0;
+  return profile_dt_m(b->prof);
+}
 
 
 // METHODS =====================================================================
 
 // we have a G-code line like "N10 G01 X0 Y100  z210.5 F1000 S5000"
-int block_parse(block_t *b) {
-  assert(b);
-  point_t *p0 = NULL;
-  int rv = 0;
-  char *word, *line, *tofree;
+int block_parse(block_t *b, machine_t const *m) {
+  assert(b && m);
+  int rv = block_words(b, m);
+  if (rv < 0)
+    return rv;
+  return rv + block_motion(b, m);
+}
 
-  tofree = line = strdup(b->line);
-  if (!line) {
-    eprintf("Could not allocate memory for line string\n");
-    return -1;
+// Instances after prev of a line parsed as t, from the same modes, are
+// translated copies of t unless the line gives absolute coordinates which
+// move differently from the start point. Copies need no parsing: they share
+// the words, the arc record and the profile of t, computed at rest (the
+// limits come from the machine). Otherwise, the line is parsed again, and
+// the result shared with t when it is a translated copy all the same
+block_t *block_instance(block_t const *t, block_t *prev,
+                        machine_t const *machine) {
+  assert(t);
+  block_t *b;
+  data_t d[3], db[3], xyz[3], s[3];
+  int i, rv;
+  if (t->type == BLEND || t->type == SPLINE || t->fs != 0 || t->fe != 0 ||
+      t->t_ofs != 0 || t->ovr != 1)
+    goto parse;
+  if (!block_same_modes(prev, t->prev))
+    goto parse;
+  // the target of the copy: the given axes move like in t when incremental,
+  // are the same as in t when absolute, and the others stay
+  block_delta(t, d);
+  point_get(block_target(prev), s);
+  point_get(block_target(t), xyz);
+  for (i = 0; i < 3; i++) {
+    if (t->incremental)
+      xyz[i] = s[i] + d[i];
+    else if (!(t->axes & (1 << i)))
+      xyz[i] = s[i];
+    if (fabs(xyz[i] - s[i] - d[i]) > 1E-9)
+      goto parse;
   }
-  // tokenization
-  while ((word = strsep(&line, " ")) != NULL) {
-    // word[0] is the first character (the command)
-    // word + 1 is the string beginning after the forst character
-    rv += block_set_fields(b, toupper(word[0]), word + 1);
+  if (!(b = malloc(sizeof(block_t) + point_size()))) {
+    eprintf("Could not allocate memory for a block\n");
+    return NULL;
   }
-  free(tofree);
-
-  // inherit coordinates from previous point
-  p0 = start_point(b);
-  point_modal(p0, b->target);
-  point_delta(p0, b->target, b->delta);
-  b->length = point_dist(p0, b->target);
-
-  // deal with motion blocks
-  switch (b->type) {
-  case LINE:
-    b->acc = machine_A(b->machine);
-    b->arc_feedrate = b->feedrate;
-    block_compute(b);
-    break;
+  memcpy(b, t, sizeof(block_t));
+  if (block_share(b, t)) {
+    free(b);
+    return NULL;
+  }
+  b->prev = prev;
+  b->next = NULL;
+  prev->next = b;
+  point_set_xyz(point_new_at(b + 1), xyz[0], xyz[1], xyz[2]);
+  return b;
 
-  case ARC_CW:
-  case ARC_CCW:
-    if (block_arc(b)) {
-      wprintf("Could not calculate arc coordinates\n");
-      rv++;
-      break;
-    }
-    // Set corrected feedrate and acceleration
-    // Centripetal acc = f^2/r, must be <= A
-    // We divide by two because with a tangential component equal to A,
-    // any non-null feedrate is providing a total acceleration in excess of A.
-    b->acc = machine_A(b->machine) / 2.0;
-    // Then: a_m^2/4 + (a_m^4 t^4) / (16 r^2) = A^2
-    // solve for t: t^4 = 12 r^2 / a_m^2 (t at max total acceleration)
-    // calculate feedrate at t: f = a_m/2 t = (3/4 a_m^2 r^2)^0.25
-    // INI file gives A in mm/s^2, feedrate is given in mm/min.
-    // A more elegant solution would be to calculate a minimum time soltion
-    // for the whole arc, but it is outside the scope.
-    b->arc_feedrate = MIN(
-        b->feedrate,
-        pow(3.0 / 4.0 * pow(machine_A(b->machine), 2) * pow(b->r, 2), 0.25) *
-            60);
-    block_compute(b);
-    break;
-  default:
-    break;
+parse:
+  if (!(b = block_new(block_line(t), prev, machine)))
+    return NULL;
+  if ((rv = block_words(b, machine)) != 0)
+    goto fail;
+  block_delta(b, db);
+  block_delta(t, d);
+  if (b->type != t->type || b->type == BLEND || b->type == SPLINE ||
+      !block_same_modes(b, t) || t->fs != 0 || t->fe != 0 ||
+      t->t_ofs != 0 || t->ovr != 1 ||
+      ((b->type == ARC_CW || b->type == ARC_CCW) &&
+       (b->arc->R != 0 ||
+        memcmp(b->arc->ofs, t->arc->ofs, sizeof(b->arc->ofs)))) ||
+      fabs(db[0] - d[0]) > 1E-9 || fabs(db[1] - d[1]) > 1E-9 ||
+      fabs(db[2] - d[2]) > 1E-9) {
+    if ((rv = block_motion(b, machine)) != 0)
+      goto fail;
+    return b;
   }
-  return rv;
+  if ((rv = block_share(b, t)) != 0)
+    goto fail;
+  return b;
+fail:
+  eprintf("Error parsing the block %s\n", block_line(t));
+  if (prev)
+    prev->next = NULL;
+  block_free(b);
+  return NULL;
 }
 
+// Closed form evaluation of the (trapezoidal or S-curve) profile; after a
+// replan, the profile covers the block from s_ofs on, starting at t_ofs
 data_t block_lambda(block_t *b, data_t t, data_t *v) {
   assert(b);
-  data_t r;
-  data_t dt_1 = b->prof->dt_1;
-  data_t dt_2 = b->prof->dt_2;
-  data_t dt_m = b->prof->dt_m;
-  data_t a = b->prof->a;
-  data_t d = b->prof->d;
-  data_t f = b->prof->f;
-
-  if (t < 0) {
-    r = 0.0;
-    *v = 0.0;
-  } else if (t < dt_1) { // acceleration
-    r = a * pow(t, 2) / 2.0;
-    *v = a * t;
-  } else if (t < dt_1 + dt_m) { // maintenance
-    r = f * (dt_1 / 2.0 + (t - dt_1));
-    *v = f;
-  } else if (t < dt_1 + dt_m + dt_2) { // deceleration
-    data_t t_2 = dt_1 + dt_m;
-    r = f * dt_1 / 2.0 + f * (dt_m + t - t_2) +
-        d / 2.0 * (pow(t, 2) + pow(t_2, 2)) - d * t * t_2;
-    *v = f + d * (t - t_2);
-  } else {
-    r = b->prof->l;
-    *v = 0.0;
-  }
-
-  r /= b->prof->l;
+  data_t r = b->s_ofs + profile_eval(b->prof, t - b->t_ofs, v);
+  r = b->length > 0 ? r / b->length : 1.0;
   *v *= 60; // convert to mm/min
   return r;
 }
 
-point_t *block_interpolate(block_t *b, data_t lambda) {
-  assert(b);
-  point_t *result = machine_setpoint(b->machine);
+point_t *block_interpolate(block_t *b, machine_t const *m, data_t lambda) {
+  assert(b && m);
+  point_t *result = machine_setpoint(m);
   point_t *p0 = start_point(b);
+  data_t d[3], c[3];
 
+  // blends and splines are traversed by arc length along their curve
+  if (b->type == BLEND || b->type == SPLINE) {
+    data_t xyz[3];
+    curve_eval(b->curve, lambda * b->length, xyz);
+    point_set_xyz(result, xyz[0], xyz[1], xyz[2]);
+    return result;
+  }
   // Parametric equations of segment:
   // x(t) = x(0) + d_x * lambda
   // y(t) = y(0) + d_y * lambda
+  block_delta(b, d);
   if (b->type == LINE) {
-    point_set_x(result, point_x(p0) + point_x(b->delta) * lambda);
-    point_set_y(result, point_y(p0) + point_y(b->delta) * lambda);
+    point_set_x(result, point_x(p0) + d[0] * lambda);
+    point_set_y(result, point_y(p0) + d[1] * lambda);
   }
   // paremetric equations of arc:
   // x(t) = x_c + R cos(theta_0 + dtheta * lambda)
   // y(t) = y_c + R sin(theta_0 + dtheta * lambda)
+  // cos and sin are updated incrementally (see arc_angle())
   else if (b->type == ARC_CW || b->type == ARC_CCW) {
-    point_set_x(result, point_x(b->center) +
-                            b->r * cos(b->theta0 + b->dtheta * lambda));
-    point_set_y(result, point_y(b->center) +
-                            b->r * sin(b->theta0 + b->dtheta * lambda));
+    arc_angle(b->arc, lambda);
+    if (b->plane != PLANE_XY)
+      return arc_point(b, p0, lambda, result);
+    arc_center(b, c);
+    point_set_x(result, c[0] + b->arc->r * b->arc->step.c);
+    point_set_y(result, c[1] + b->arc->r * b->arc->step.s);
   } else {
     wprintf("Unexpected block type\n");
     return NULL;
   }
   // Z is always linearly intepolated (arc becomes spiral)
-  point_set_z(result, point_z(p0) + point_z(b->delta) * lambda);
+  point_set_z(result, point_z(p0) + d[2] * lambda);
   return result;
 }
 
+int block_blend(block_t *b, machine_t const *m) {
+  assert(b && m);
+  block_t *n = b->next, *bl = NULL;
+  data_t t0[3], t1[3], p[3], ctrl[18], c, theta, d;
+  char line[32];
+  int k, j;
+  if (!b->blend || !n || b->type != LINE || n->type != LINE ||
+      block_direction(b, 1, t0) || block_direction(n, 0, t1))
+    return 0;
+  c = t0[0] * t1[0] + t0[1] * t1[1] + t0[2] * t1[2];
+  theta = acos(fmax(-1, fmin(1, c)));
+  if (theta < BLEND_MIN_ANGLE || theta > BLEND_MAX_ANGLE)
+    return 0;
+  // distance d of the blend ends from the corner: the deviation equals
+  // max_error, unless the lines are too short (each line gives up to half
+  // of its length, so that no line is consumed by its two blends)
+  d = machine_max_error(m) / (BLEND_DEV * sin(theta / 2));
+  d = MIN(d, MIN(b->length, n->length) / 2);
+  point_get(block_target(b), p);
+  for (k = 0; k < 3; k++) {
+    for (j = 0; j < 3; j++) {
+      ctrl[k * 3 + j] = p[j] - d * (5 - k) / 5 * t0[j];
+      ctrl[(5 - k) * 3 + j] = p[j] + d * (5 - k) / 5 * t1[j];
+    }
+  }
+
+  // the blend inherits everything from b, and is linked between b and n
+  snprintf(line, sizeof(line), "(blend N%zu)", b->src->n);
+  if (!(bl = block_new(line, b, m))) {
+    b->next = n;
+    return -1;
+  }
+  bl->next = n;
+  n->prev = bl;
+  bl->curve = curve_new(5, 1, ctrl);
+  if (!bl->curve) {
+    b->next = n; // unlink
+    block_free(bl);
+    return -1;
+  }
+  bl->type = BLEND;
+  bl->src->feedrate = MIN(b->src->feedrate, n->src->feedrate);
+  point_set_xyz(block_target(bl), ctrl[15], ctrl[16], ctrl[17]);
+  point_set_xyz(block_target(b), ctrl[0], ctrl[1], ctrl[2]);
+  if (block_motion(b, m) || block_motion(bl, m) || block_motion(n, m))
+    return -1;
+  return 1;
+}
+
+size_t block_truncate(block_t *b) {
+  assert(b);
+  block_t *n = b->next, *tmp;
+  size_t removed = 0;
+  b->next = NULL;
+  while (n) {
+    tmp = n;
+    n = n->next;
+    block_free(tmp);
+    removed++;
+  }
+  return removed;
+}
+
+int block_unblend(block_t *b, machine_t const *m) {
+  assert(b && m);
+  block_t *bl = b->next, *n;
+  data_t p[3], d1[3];
+  if (!bl || bl->type != BLEND || !bl->curve)
+    return 0;
+  // the first control point is at d t0 before the corner, and the
+  // derivative of the quintic at its start is 5 (P1 - P0) = d t0
+  curve_eval_u(bl->curve, 0, p, d1, NULL);
+  point_set_xyz(block_target(b), p[0] + d1[0], p[1] + d1[1], p[2] + d1[2]);
+  n = bl->next;
+  b->next = n;
+  if (n)
+    n->prev = b;
+  block_free(bl);
+  if (block_motion(b, m) || (n && block_motion(n, m)))
+    return -1;
+  return 1;
+}
+
+size_t block_spline(block_t *b, machine_t const *m, data_t tol) {
+  assert(b && m);
+  data_t(*pt)[3] = NULL, (*tg)[3] = NULL, (*ctrl)[3] = NULL, u[2][3], dot, l;
+  size_t *knot = NULL, n, k, i, j, best, n_pcs = 0, removed = 0;
+  block_t *e, *tmp;
+  point_t *p0 = start_point(b);
+  int c;
+  if (b->type != LINE || b->length <= 0)
+    return 0;
+  pt = malloc((SPLINE_MAX_RUN + 1) * sizeof(*pt));
+  tg = malloc((SPLINE_MAX_RUN + 1) * sizeof(*tg));
+  ctrl = malloc((3 * SPLINE_MAX_RUN + 1) * sizeof(*ctrl));
+  knot = malloc((SPLINE_MAX_RUN + 1) * sizeof(*knot));
+  if (!pt || !tg || !ctrl || !knot) {
+    eprintf("Could not allocate memory for spline fitting\n");
+    goto end;
+  }
+
+  // 1. collect the run; the tangent at each inner vertex bisects the
+  //    directions of its two lines, the end tangents follow the lines
+  pt[0][0] = point_x(p0);
+  pt[0][1] = point_y(p0);
+  pt[0][2] = point_z(p0);
+  for (n = 0, e = b; e && n < SPLINE_MAX_RUN; n++, e = e->next) {
+    if (e->type != LINE || e->length <= 0 ||
+        e->src->feedrate != b->src->feedrate ||
+        e->src->spindle != b->src->spindle || e->src->tool != b->src->tool ||
+        e->blend != b->blend)
+      break;
+    block_delta(e, u[1]);
+    for (c = 0; c < 3; c++)
+      u[1][c] /= e->length;
+    if (n > 0) {
+      dot = u[0][0] * u[1][0] + u[0][1] * u[1][1] + u[0][2] * u[1][2];
+      if (acos(fmax(-1, fmin(1, dot))) > SPLINE_MAX_TURN)
+        break;
+      for (c = 0; c < 3; c++)
+        tg[n][c] = u[0][c] + u[1][c];
+      l = sqrt(tg[n][0] * tg[n][0] + tg[n][1] * tg[n][1] +
+               tg[n][2] * tg[n][2]);
+      for (c = 0; c < 3; c++)
+        tg[n][c] /= l;
+    } else {
+      memcpy(tg[0], u[1], sizeof(tg[0]));
+    }
+    point_get(block_target(e), pt[n + 1]);
+    memcpy(u[0], u[1], sizeof(u[0]));
+  }
+  if (n < SPLINE_MIN_RUN)
+    goto end;
+  memcpy(tg[n], u[0], sizeof(tg[n]));
+
+  // 2. greedy pieces: each one reaches the farthest vertex it can fit
+  knot[0] = 0;
+  for (i = 0; i < n; i = best) {
+    best = i;
+    for (j = i + 1; j <= MIN(n, i + SPLINE_MAX_PIECE); j++) {
+      if (!fit_cubic(pt, tg, i, j, tol, ctrl[3 * n_pcs]))
+        break;
+      best = j;
+    }
+    if (best == i) // not even one line fits: the run ends here
+      break;
+    fit_cubic(pt, tg, i, best, tol, ctrl[3 * n_pcs]);
+    knot[++n_pcs] = best;
+  }
+  n = knot[n_pcs];
+  if (n < SPLINE_MIN_RUN || n_pcs >= n)
+    goto end;
+
+  // 3. b becomes the spline, the other lines of the run are freed
+  b->curve = curve_new(3, n_pcs, (data_t const *)ctrl);
+  if (!b->curve)
+    goto end;
+  for (k = 1, e = b->next; k < n; k++) {
+    tmp = e;
+    e = e->next;
+    block_free(tmp);
+  }
+  b->next = e;
+  if (e)
+    e->prev = b;
+  b->type = SPLINE;
+  point_set_xyz(block_target(b), pt[n][0], pt[n][1], pt[n][2]);
+  if (block_motion(b, m))
+    wprintf("Could not compute the spline block %zu\n", b->src->n);
+  removed = n - 1;
+end:
+  free(pt);
+  free(tg);
+  free(ctrl);
+  free(knot);
+  return removed;
+}
+
+data_t block_junction(block_t const *b) {
+  assert(b);
+  data_t t0[3], t1[3];
+  if (!b->blend || !b->next || block_direction(b, 1, t0) ||
+      block_direction(b->next, 0, t1))
+    return 0;
+  // tangent continuity
+  if (t0[0] * t1[0] + t0[1] * t1[1] + t0[2] * t1[2] < cos(BLEND_MIN_ANGLE))
+    return 0;
+  return MIN(b->arc_feedrate, b->next->arc_feedrate);
+}
+
+data_t block_reach(block_t const *b, machine_t const *m, data_t f0) {
+  assert(b && m);
+  data_t A, J;
+  if (!block_moves(b))
+    return 0;
+  block_limits(b, m, &A, &J);
+  return profile_reach(b->length, f0 / 60.0, b->arc_feedrate / 60.0, A, J,
+                       block_curvature_radius(b)) * 60;
+}
+
+int block_plan(block_t *b, machine_t const *m, data_t fs, data_t fe) {
+  assert(b && m);
+  if (!block_moves(b))
+    return 0;
+  b->fs = fs;
+  b->fe = fe;
+  if (block_reuse(b))
+    return 0;
+  if (block_compute(b, m))
+    return 1;
+  block_remember(b);
+  return 0;
+}
+
+int block_plan_batch(block_t *const *v, machine_t const *m,
+                     data_t const *fj, size_t n, data_t f0) {
+  assert((v || n == 0) && m);
+  block_t *b, **batch = NULL;
+  data_t *soa = NULL, *l, *fs, *f, *fe, *dt, A, fi;
+  size_t i, k = 0;
+  int rv = 0;
+  if (n == 0)
+    return 0;
+  A = machine_A(m);
+  batch = malloc(n * sizeof(*batch));
+  soa = malloc(5 * n * sizeof(*soa));
+  if (!batch || !soa) {
+    eprintf("Could not allocate memory for batch planning\n");
+    rv = 1;
+    goto end;
+  }
+  l = soa;
+  fs = l + n;
+  f = fs + n;
+  fe = f + n;
+  dt = fe + n;
+  // 1. gather the trapezoids into arrays (mm/s), plan the others
+  for (i = 0; i < n; i++) {
+    b = v[i];
+    fi = i > 0 ? fj[i - 1] : f0;
+    if (b->type != LINE || machine_J(m) > 0 || b->length <= 0 ||
+        b->arc_feedrate < MAX(fi, fj[i]) || b->arc_feedrate <= 0) {
+      rv |= block_plan(b, m, fi, fj[i]);
+      continue;
+    }
+    b->fs = fi;
+    b->fe = fj[i];
+    batch[k] = b;
+    l[k] = b->length;
+    fs[k] = fi / 60.0;
+    f[k] = b->arc_feedrate / 60.0;
+    fe[k] = fj[i] / 60.0;
+    k++;
+  }
+  // 2. plan, 3. scatter the results back into the profiles
+  profile_trapezoids(k, l, fs, f, fe, dt, A, block_tq(m));
+  for (i = 0; i < k; i++) {
+    b = batch[i];
+    if (block_reuse(b))
+      continue;
+    if (block_own(b)) {
+      rv = 1;
+      continue;
+    }
+    profile_set_trapezoid(b->prof, l[i], fs[i], f[i], fe[i], A, dt[i]);
+    b->ovr = 1;
+    b->t_ofs = b->s_ofs = 0;
+    block_remember(b);
+  }
+end:
+  free(batch);
+  free(soa);
+  return rv;
+}
+
+// Distance run at time t along the current profile
+static data_t block_s(block_t *b, data_t t) {
+  data_t v;
+  return t > 0 ? b->s_ofs + profile_eval(b->prof, t - b->t_ofs, &v) : 0;
+}
+
+// The cruise feed is scaled by ovr (up to fmax, and to the curvature limit
+// on curves), the final feed only when slowing down, so that the junction
+// feeds planned by the look-ahead stay reachable. Starting from the planned
+// profile, a lower final feed is always reachable, or at least one not
+// above the planned one
+int block_replan(block_t *b, machine_t const *m, data_t t, data_t f0,
+                 data_t ovr) {
+  assert(b && m);
+  data_t s0, f, A, J;
+  if (!block_moves(b))
+    return 0;
+  if (t <= 0 && b->t_ofs == 0 && ovr == b->ovr &&
+      fabs(f0 / 60.0 - profile_fs(b->prof)) < 1E-9)
+    return 0; // still the planned profile
+  s0 = block_s(b, t);
+  f = MIN(b->arc_feedrate * ovr, machine_fmax(m));
+  block_limits(b, m, &A, &J);
+  if (block_own(b))
+    return 1;
+  if (profile_compute(b->prof, fmax(0, b->length - s0), f0 / 60.0, f / 60.0,
+                      b->fe * MIN(ovr, 1) / 60.0, A, J,
+                      block_curvature_radius(b), block_tq(m)) < 0) {
+    wprintf("Could not replan the feed profile of block %zu\n", b->src->n);
+    return 1;
+  }
+  b->t_ofs = fmax(t, 0);
+  b->s_ofs = s0;
+  b->ovr = ovr;
+  return 0;
+}
+
+// The profile becomes a single deceleration ramp, as long as the stopping
+// distance or the rest of the block, whichever is shorter: in the latter
+// case it ends at a non-null feed, and the next block must continue the
+// hold. Not quantized, since it ends at rest anyway. The override of a held
+// profile is 0
+int block_hold(block_t *b, machine_t const *m, data_t t, data_t f0) {
+  assert(b && m);
+  data_t s0, l, R, A, J;
+  if (!block_moves(b))
+    return 0;
+  s0 = block_s(b, t);
+  R = block_curvature_radius(b);
+  l = fmax(0, b->length - s0);
+  block_limits(b, m, &A, &J);
+  if (f0 > 0)
+    l = fmin(l, profile_stop(f0 / 60.0, A, J, R));
+  else
+    l = f0 = 0; // already at rest: stay where we are
+  if (block_own(b))
+    return 1;
+  if (profile_compute(b->prof, l, f0 / 60.0, f0 > 0 ? f0 / 60.0 : 1.0, 0, A,
+                      J, R, 0) < 0) {
+    wprintf("Could not plan the feed hold of block %zu\n", b->src->n);
+    return 1;
+  }
+  b->t_ofs = fmax(t, 0);
+  b->s_ofs = s0;
+  b->ovr = 0;
+  return 0;
+}
+
+// Arcs reach past their end points where they cross the quadrant
+// boundaries; curves are sampled, since their control polygon may be much
+// larger than the curve
+void block_extents(block_t const *b, data_t lo[3], data_t hi[3]) {
+  assert(b && lo && hi);
+  point_t const *p0 = start_point(b), *pf = block_target(b);
+  int const *ax = plane_axes[b->plane];
+  block_arc_t const *arc = b->arc;
+  data_t xyz[3], c[3], a, d;
+  size_t k, n;
+  int j;
+  lo[0] = MIN(point_x(p0), point_x(pf));
+  lo[1] = MIN(point_y(p0), point_y(pf));
+  lo[2] = MIN(point_z(p0), point_z(pf));
+  hi[0] = MAX(point_x(p0), point_x(pf));
+  hi[1] = MAX(point_y(p0), point_y(pf));
+  hi[2] = MAX(point_z(p0), point_z(pf));
+  if (b->type == ARC_CW || b->type == ARC_CCW) {
+    arc_center(b, c);
+    for (k = 0; k < 4; k++) {
+      a = k * M_PI / 2;
+      d = fmod(arc->dtheta > 0 ? a - arc->theta0 : arc->theta0 - a,
+               2 * M_PI);
+      if (d < 0)
+        d += 2 * M_PI;
+      if (d > fabs(arc->dtheta))
+        continue;
+      xyz[0] = c[ax[0]] + arc->r * cos(a);
+      xyz[1] = c[ax[1]] + arc->r * sin(a);
+      lo[ax[0]] = MIN(lo[ax[0]], xyz[0]);
+      lo[ax[1]] = MIN(lo[ax[1]], xyz[1]);
+      hi[ax[0]] = MAX(hi[ax[0]], xyz[0]);
+      hi[ax[1]] = MAX(hi[ax[1]], xyz[1]);
+    }
+  } else if ((b->type == BLEND || b->type == SPLINE) && b->curve) {
+    n = curve_segments(b->curve) * EXTENTS_SAMPLES;
+    for (k = 1; k < n; k++) {
+      curve_eval_u(b->curve, (data_t)k / EXTENTS_SAMPLES, xyz, NULL, NULL);
+      for (j = 0; j < 3; j++) {
+        lo[j] = MIN(lo[j], xyz[j]);
+        hi[j] = MAX(hi[j], xyz[j]);
+      }
+    }
+  }
+}
+
+// Lines are projected, planar arcs are projected on their circle, and the
+// ends are candidates too. Helices are sampled and refined by golden
+// section, curves are searched by curve_nearest()
+data_t block_nearest(block_t const *b, data_t const x[3], data_t *lambda) {
+  assert(b && x);
+  data_t const g = (sqrt(5) - 1) / 2;
+  data_t p0[3], pf[3], c[3], d[3], l, dd, phi, best = 0, dmin, d2;
+  data_t lo, hi, u1, u2, d1;
+  int const *ax = plane_axes[b->plane];
+  block_arc_t const *arc = b->arc;
+  size_t k, n;
+  int i;
+  if ((b->type == BLEND || b->type == SPLINE) && b->curve) {
+    dmin = curve_nearest(b->curve, x, &l);
+    if (lambda)
+      *lambda = b->length > 0 ? l / b->length : 1.0;
+    return dmin;
+  }
+  point_get(start_point(b), p0);
+  point_get(block_target(b), pf);
+  if (b->type == ARC_CW || b->type == ARC_CCW) {
+    arc_center(b, c);
+    dmin = nearest_dist2(b, 0, x);
+    if ((d2 = nearest_dist2(b, 1, x)) < dmin) {
+      dmin = d2;
+      best = 1;
+    }
+    if (pf[ax[2]] == p0[ax[2]]) { // planar: the angle of x on the circle
+      phi = atan2(x[ax[1]] - c[ax[1]], x[ax[0]] - c[ax[0]]);
+      l = fmod(arc->dtheta > 0 ? phi - arc->theta0 : arc->theta0 - phi,
+               2 * M_PI);
+      if (l < 0)
+        l += 2 * M_PI;
+      if (l < fabs(arc->dtheta) &&
+          (d2 = nearest_dist2(b, l / fabs(arc->dtheta), x)) < dmin) {
+        dmin = d2;
+        best = l / fabs(arc->dtheta);
+      }
+    } else {
+      n = (size_t)ceil(fabs(arc->dtheta) / (2 * M_PI) * NEAREST_SAMPLES);
+      for (k = 1; k < n; k++) {
+        if ((d2 = nearest_dist2(b, (data_t)k / n, x)) < dmin) {
+          dmin = d2;
+          best = (data_t)k / n;
+        }
+      }
+      lo = fmax(best - 1.0 / n, 0);
+      hi = fmin(best + 1.0 / n, 1);
+      u1 = hi - g * (hi - lo);
+      u2 = lo + g * (hi - lo);
+      d1 = nearest_dist2(b, u1, x);
+      d2 = nearest_dist2(b, u2, x);
+      for (i = 0; i < NEAREST_STEPS; i++) {
+        if (d1 < d2) {
+          hi = u2;
+          u2 = u1;
+          d2 = d1;
+          u1 = hi - g * (hi - lo);
+          d1 = nearest_dist2(b, u1, x);
+        } else {
+          lo = u1;
+          u1 = u2;
+          d1 = d2;
+          u2 = lo + g * (hi - lo);
+          d2 = nearest_dist2(b, u2, x);
+        }
+      }
+      if (fmin(d1, d2) < dmin) {
+        dmin = fmin(d1, d2);
+        best = d1 < d2 ? u1 : u2;
+      }
+    }
+  } else { // lines, rapids, and the point of the other blocks
+    for (i = 0; i < 3; i++)
+      d[i] = pf[i] - p0[i];
+    dd = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    best = 1;
+    if (dd > 0) {
+      l = ((x[0] - p0[0]) * d[0] + (x[1] - p0[1]) * d[1] +
+           (x[2] - p0[2]) * d[2]) / dd;
+      best = fmin(fmax(l, 0), 1);
+    }
+    dmin = nearest_dist2(b, best, x);
+  }
+  if (lambda)
+    *lambda = best;
+  return sqrt(dmin);
+}
+
+// Three blocks: a rapid up to the safe Z over the current position, a rapid
+// over the start of b, and a G61 plunge at the feed of b (a rapid if b is
+// not a feed motion). The approach inherits feed, spindle and tool from b
+block_t *block_approach(block_t *b, machine_t const *m,
+                        point_t const *from) {
+  assert(b && m && from);
+  block_t *prev = b->prev, *a[3] = {NULL, NULL, NULL};
+  point_t *s = start_point(b);
+  data_t z = MAX(point_z(from), point_z(s));
+  char line[128];
+  int k;
+  // the approach ends at rest
+  if (b->fs > 0 && block_plan(b, m, 0, b->fe))
+    return NULL;
+  for (k = 0; k < 3; k++) {
+    if (k == 0)
+      snprintf(line, sizeof(line), "G00 G90 X%.6f Y%.6f Z%.6f",
+               point_x(from), point_y(from), z);
+    else if (k == 1)
+      snprintf(line, sizeof(line), "G00 G90 X%.6f Y%.6f Z%.6f",
+               point_x(s), point_y(s), z);
+    else
+      snprintf(line, sizeof(line), "G%02d G61 G90 X%.6f Y%.6f Z%.6f",
+               block_moves(b) ? LINE : RAPID, point_x(s), point_y(s),
+               point_z(s));
+    if (!(a[k] = block_new(line, k ? a[k - 1] : prev, m)))
+      goto fail;
+    a[k]->src->feedrate = b->src->feedrate;
+    a[k]->src->spindle = b->src->spindle;
+    a[k]->src->tool = b->src->tool;
+    if (block_parse(a[k], m)) {
+      eprintf("Could not parse the approach block %s\n", line);
+      goto fail;
+    }
+  }
+  a[2]->next = b;
+  b->prev = a[2];
+  return a[0];
+fail:
+  if (prev)
+    prev->next = b;
+  for (k = 0; k < 3; k++) {
+    if (a[k])
+      block_free(a[k]);
+  }
+  return NULL;
+}
+
+size_t block_compress(block_t *b, machine_t const *m, data_t tol) {
+  assert(b && m);
+  data_t pt[COMPRESS_MAX_RUN + 1][3], c[2], best_c[2] = {0, 0};
+  block_t *e, *tmp;
+  size_t k, best = 0;
+  int ccw = 0, best_ccw = 0, arc = 0;
+  point_t *p0 = start_point(b);
+  if (b->type != LINE || b->length <= 0)
+    return 0;
+  pt[0][0] = point_x(p0);
+  pt[0][1] = point_y(p0);
+  pt[0][2] = point_z(p0);
+  // greedy: extend the run while it fits a line (preferred) or an arc
+  for (k = 1, e = b; e && k <= COMPRESS_MAX_RUN; k++, e = e->next) {
+    if (e->type != LINE || e->length <= 0 ||
+        e->src->feedrate != b->src->feedrate ||
+        e->src->spindle != b->src->spindle || e->src->tool != b->src->tool ||
+        e->blend != b->blend)
+      break;
+    point_get(block_target(e), pt[k]);
+    if (fit_line(pt, k, tol)) {
+      best = k;
+      arc = 0;
+    } else if (k >= 3 && fit_arc(pt, k, tol, c, &ccw)) {
+      best = k;
+      arc = 1;
+      best_c[0] = c[0];
+      best_c[1] = c[1];
+      best_ccw = ccw;
+    } else {
+      break;
+    }
+  }
+  if (best < 2)
+    return 0;
+  if (arc) {
+    c[0] = best_c[0] - pt[0][0];
+    c[1] = best_c[1] - pt[0][1];
+    if (block_set_arc(b, best_ccw ? ARC_CCW : ARC_CW,
+                      (data_t[3]){c[0], c[1], 0}, 0))
+      return 0;
+    b->plane = PLANE_XY;
+  }
+
+  // b takes the place of the whole run
+  for (k = 1, e = b->next; k < best; k++) {
+    tmp = e;
+    e = e->next;
+    block_free(tmp);
+  }
+  b->next = e;
+  if (e)
+    e->prev = b;
+  point_set_xyz(block_target(b), pt[best][0], pt[best][1], pt[best][2]);
+  if (block_motion(b, m))
+    wprintf("Could not compute the merged block %zu\n", b->src->n);
+  return best - 1;
+}
+
+// One forward pass: the end of each compensated element is only known when
+// the next one is met, so that the pending element and the blocks without
+// XY motion that follow it are the whole window. Programmed positions are
+// carried along in p, since the targets are overwritten with the offset
+// ones
+long block_compensate(block_t *b, machine_t const *m, size_t *joins) {
+  assert(b && m && joins);
+  block_t *a = NULL, *jn, *nx;
+  comp_elem_t oa, ob;
+  data_t p[2], s[2], e[2], pa[2] = {0, 0}, x[2], y[2], ta[2] = {0, 0};
+  data_t tb[2], te[2], r = 0, rb, cr;
+  long count = 0;
+  int moves, join;
+  char line[32];
+  point_t *p0 = start_point(b);
+
+  p[0] = point_x(p0);
+  p[1] = point_y(p0);
+  for (; b; b = b->next) {
+    s[0] = p[0];
+    s[1] = p[1];
+    e[0] = p[0] = point_x(block_target(b));
+    e[1] = p[1] = point_y(block_target(b));
+    moves = b->type == RAPID || b->type == LINE || b->type == ARC_CW ||
+            b->type == ARC_CCW;
+
+    // end of the compensation: the pending element ends offset at its own
+    // end, and the exit move goes from there to the programmed target
+    if (!b->comp && moves && a) {
+      if (b->type != LINE && b->type != RAPID) {
+        eprintf("Cutter compensation must end with a line (N%zu)\n", b->src->n);
+        return -1;
+      }
+      comp_point(&oa, pa, x);
+      if (comp_finish(a, oa.c, m, b, x, x) || block_motion(b, m))
+        return -1;
+      a = NULL;
+      continue;
+    }
+    // blocks without XY motion keep the offset position of the path
+    if (!b->comp || !moves ||
+        (b->type <= LINE && hypot(e[0] - s[0], e[1] - s[1]) < COMP_TOL))
+      continue;
+    if (b->type >= ARC_CW && b->plane != PLANE_XY) {
+      eprintf("Cutter compensation needs arcs in G17 (N%zu)\n", b->src->n);
+      return -1;
+    }
+    if ((rb = machine_tool_radius(m, b->src->tool)) < 0) {
+      eprintf("Tool T%zu of N%zu is not in the tool table\n", b->src->tool,
+              b->src->n);
+      return -1;
+    }
+    if (a && rb != r) {
+      eprintf("Cannot change tool with cutter compensation on (N%zu)\n",
+              b->src->n);
+      return -1;
+    }
+    if (comp_elem(b, s, e, rb, &ob, tb, te)) {
+      eprintf("Tool radius too large for the arc N%zu\n", b->src->n);
+      return -1;
+    }
+    count++;
+
+    // start of the compensation: the entry move goes from the programmed
+    // start to the offset path
+    if (!a) {
+      if (b->type >= ARC_CW) {
+        eprintf("Cutter compensation must start with a line (N%zu)\n",
+                b->src->n);
+        return -1;
+      }
+      goto next;
+    }
+
+    // corner between a and b at pa: outside corners get an arc around it,
+    // inside corners are trimmed at the crossing of the two elements
+    comp_point(&oa, pa, x);
+    comp_point(&ob, pa, y);
+    cr = ta[0] * tb[1] - ta[1] * tb[0];
+    join = 0;
+    if (hypot(y[0] - x[0], y[1] - x[1]) < COMP_TOL) {
+      y[0] = x[0];
+      y[1] = x[1];
+    } else if (b->comp * cr < 0) {
+      join = 1;
+    } else if (!comp_cross(&oa, &ob, pa, x)) {
+      y[0] = x[0];
+      y[1] = x[1];
+    } else {
+      wprintf("Cutter compensation gouges the corner at N%zu\n", b->src->n);
+      join = 2;
+    }
+    if (join) {
+      snprintf(line, sizeof(line), "(join N%zu)", a->src->n);
+      nx = a->next;
+      if (!(jn = block_new(line, a, m))) {
+        a->next = nx;
+        return -1;
+      }
+      jn->next = nx;
+      nx->prev = jn;
+      jn->type = LINE;
+      jn->plane = PLANE_XY;
+      if (join == 1 && block_set_arc(jn, b->comp > 0 ? ARC_CW : ARC_CCW,
+                                     (data_t[3]){0, 0, 0}, 0))
+        return -1;
+      point_set_xyz(block_target(jn), y[0], y[1],
+                    point_z(block_target(a)));
+      if (comp_finish(a, oa.c, m, jn, x, x) ||
+          comp_finish(jn, pa, m, b, y, y))
+        return -1;
+      (*joins)++;
+    } else if (comp_finish(a, oa.c, m, b, x, y)) {
+      return -1;
+    }
+  next:
+    a = b;
+    oa = ob;
+    r = rb;
+    pa[0] = e[0];
+    pa[1] = e[1];
+    ta[0] = te[0];
+    ta[1] = te[1];
+  }
+  // the compensation lasts up to the end of the program
+  if (a) {
+    comp_point(&oa, pa, x);
+    if (comp_finish(a, oa.c, m, NULL, x, x))
+      return -1;
+  }
+  return count;
+}
+
 //   ____  _        _   _         __                  _   _
 //  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
 //  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
@@ -295,51 +1203,75 @@ point_t *block_interpolate(block_t *b, data_t lambda) {
 //  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
 
 // Return a reliable previous point, i.e. machine zero if this is the first
-// block
-static point_t *start_point(block_t *b) {
+// block (a block allocated with a previous one never becomes the first)
+static point_t *start_point(block_t const *b) {
   assert(b);
-  return b->prev ? b->prev->target : machine_zero(b->machine);
+  return b->prev ? block_target(b->prev)
+                 : (point_t *)((char *)(b + 1) + point_size());
 }
 
-static int block_set_fields(block_t *b, char cmd, char *arg) {
+// Arc words go in w (I, J, K, R), since only arcs keep them
+static int block_set_fields(block_t *b, machine_t const *m, char cmd,
+                            char *arg, data_t w[4]) {
   assert(b && arg);
   switch (cmd) {
   case 'N':
-    b->n = atol(arg);
+    b->src->n = atol(arg);
     break;
-  case 'G':
-    b->type = (block_type_t)atoi(arg);
+  case 'G': {
+    int g = atoi(arg);
+    if (g == 61 || g == 64) { // path modes
+      b->blend = (g == 64);
+    } else if (g == 90 || g == 91) { // distance modes
+      b->incremental = (g == 91);
+    } else if (g >= 17 && g <= 19) { // arc planes
+      b->plane = (plane_t)(g - 17);
+    } else if (g >= 40 && g <= 42) { // cutter compensation
+      b->comp = (g == 41) - (g == 42);
+    } else if (g >= RAPID && g <= NO_MOTION) {
+      b->type = (block_type_t)g;
+    } else {
+      wprintf("Unsupported command G%s\n", arg);
+      return 1;
+    }
     break;
+  }
   case 'X':
-    point_set_x(b->target, atof(arg));
+    point_set_x(block_target(b), atof(arg));
+    b->axes |= 1;
     break;
   case 'Y':
-    point_set_y(b->target, atof(arg));
+    point_set_y(block_target(b), atof(arg));
+    b->axes |= 2;
     break;
   case 'Z':
-    point_set_z(b->target, atof(arg));
+    point_set_z(block_target(b), atof(arg));
+    b->axes |= 4;
     break;
   case 'I':
-    b->i = atof(arg);
+    w[0] = atof(arg);
     break;
   case 'J':
-    b->j = atof(arg);
+    w[1] = atof(arg);
+    break;
+  case 'K':
+    w[2] = atof(arg);
     break;
   case 'R':
-    b->r = atof(arg);
+    w[3] = atof(arg);
     break;
   case 'F':
     if (strcmp(arg, "MAX") == 0) {
-      b->feedrate = machine_fmax(b->machine);
+      b->src->feedrate = machine_fmax(m);
     } else {
-      b->feedrate = MIN(atof(arg), machine_fmax(b->machine));
+      b->src->feedrate = MIN(atof(arg), machine_fmax(m));
     }
     break;
   case 'S':
-    b->spindle = atof(arg);
+    b->src->spindle = atof(arg);
     break;
   case 'T':
-    b->tool = atol(arg);
+    b->src->tool = atol(arg);
     break;
 
   default:
@@ -348,74 +1280,320 @@ static int block_set_fields(block_t *b, char cmd, char *arg) {
     break;
   }
   // Both R and IJ are specified
-  if (b->r && (b->i || b->j)) {
-    wprintf("Cannot mix R and I,J\n");
+  if (w[3] && (w[0] || w[1] || w[2])) {
+    wprintf("Cannot mix R and I,J,K\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Interpolated motion (not rapid, not dwell)
+static int block_moves(block_t const *b) {
+  return b->type == LINE || b->type == ARC_CW || b->type == ARC_CCW ||
+         b->type == BLEND || b->type == SPLINE;
+}
+
+// Geometry and profile of motion blocks
+static int block_motion(block_t *b, machine_t const *m) {
+  int rv = 0;
+  block_geometry(b);
+  switch (b->type) {
+  case LINE:
+    b->arc_feedrate = b->src->feedrate;
+    rv += block_compute(b, m);
+    break;
+
+  case ARC_CW:
+  case ARC_CCW:
+    if (block_arc(b, m)) {
+      wprintf("Could not calculate arc coordinates\n");
+      rv++;
+      break;
+    }
+    // Minimum time solution for the whole arc: the whole acceleration
+    // budget is split between tangential and centripetal terms, so that
+    // a_t^2 + (f^2/R)^2 = A^2 at any time during the ramps (see profile.h).
+    // Centripetal acc alone caps the feedrate at sqrt(A R).
+    // INI file gives A in mm/s^2, feedrate is given in mm/min.
+    b->arc_feedrate = MIN(b->src->feedrate,
+                          sqrt(machine_A(m) * block_curvature_radius(b)) * 60);
+    rv += block_compute(b, m);
+    break;
+
+  case BLEND:
+  case SPLINE:
+    // the tightest radius caps the feedrate over the whole curve, and the
+    // ramps follow the same time optimal law as arcs
+    b->length = curve_length(b->curve);
+    b->arc_feedrate = b->src->feedrate;
+    if (block_curvature_radius(b) > 0)
+      b->arc_feedrate =
+          MIN(b->src->feedrate,
+              sqrt(machine_A(m) * block_curvature_radius(b)) * 60);
+    rv += block_compute(b, m);
+    break;
+  default:
+    break;
+  }
+  return rv;
+}
+
+// Words of the line into the fields of b, with the absolute target
+static int block_words(block_t *b, machine_t const *m) {
+  point_t *p0, *pf = block_target(b);
+  data_t w[4] = {0, 0, 0, 0};
+  int rv = 0;
+  char *word, *line, *tofree;
+
+  tofree = line = strdup(block_line(b));
+  if (!line) {
+    eprintf("Could not allocate memory for line string\n");
+    return -1;
+  }
+  // tokenization
+  while ((word = strsep(&line, " ")) != NULL) {
+    // word[0] is the first character (the command)
+    // word + 1 is the string beginning after the forst character
+    rv += block_set_fields(b, m, toupper(word[0]), word + 1, w);
+  }
+  free(tofree);
+  if ((b->type == ARC_CW || b->type == ARC_CCW) &&
+      block_set_arc(b, b->type, w, w[3]))
+    return -1;
+
+  // incremental coordinates are turned into absolute ones here, once; the
+  // missing ones are inherited from the start point in both modes
+  p0 = start_point(b);
+  if (b->incremental)
+    point_set_xyz(pf, point_x(p0) + point_x(pf), point_y(p0) + point_y(pf),
+                  point_z(p0) + point_z(pf));
+  else
+    point_modal(p0, pf);
+  return rv;
+}
+
+// A profile shared with other instances is copied before being changed
+static int block_own(block_t *b) {
+  profile_t *p;
+  if (!profile_shared(b->prof))
+    return 0;
+  if (!(p = profile_copy(b->prof)))
+    return 1;
+  profile_free(b->prof);
+  b->prof = p;
+  return 0;
+}
+
+// b becomes a translated copy of t, sharing its words, arc record and
+// profile (b may have its own ones, which are freed, or those of t)
+static int block_share(block_t *b, block_t const *t) {
+  block_share_t *sh = t->src->share;
+  if (!sh && !(sh = calloc(1, sizeof(*sh)))) {
+    eprintf("Could not allocate memory for a block\n");
     return 1;
   }
+  if (!t->src->share) {
+    sh->refs = 1;
+    t->src->share = sh;
+  }
+  if (b->src != t->src)
+    free(b->src);
+  b->src = t->src;
+  sh->refs++;
+  if (b->type == ARC_CW || b->type == ARC_CCW) {
+    if (b->arc != t->arc)
+      free(b->arc);
+    b->arc = t->arc;
+    b->arc->refs++;
+  }
+  if (b->prof != t->prof)
+    profile_free(b->prof);
+  b->prof = profile_share(t->prof);
+  b->length = t->length;
+  b->arc_feedrate = t->arc_feedrate;
+  b->ovr = 1;
+  b->t_ofs = b->s_ofs = 0;
   return 0;
 }
 
-static data_t quantize(data_t t, data_t tq, data_t *dq) {
-  data_t q;
-  q = ((size_t)(t / tq) + 1) * tq;
-  *dq = q - t;
-  return q;
+// Instances planned with the same inputs as the last planned one share its
+// profile (see block_share_t); returns 1 if b took it
+static int block_reuse(block_t *b) {
+  block_share_t *sh = b->src->share;
+  if (!sh || !sh->prof || sh->fs != b->fs || sh->fe != b->fe ||
+      sh->l != b->length || sh->f != b->arc_feedrate ||
+      sh->R != block_curvature_radius(b))
+    return 0;
+  if (b->prof != sh->prof) {
+    profile_free(b->prof);
+    b->prof = profile_share(sh->prof);
+  }
+  b->ovr = 1;
+  b->t_ofs = b->s_ofs = 0;
+  return 1;
+}
+
+// The profile just planned for b becomes the one shared by the instances
+// planned alike; a later change of b copies it first (see block_own())
+static void block_remember(block_t *b) {
+  block_share_t *sh = b->src->share;
+  if (!sh)
+    return;
+  if (sh->prof)
+    profile_free(sh->prof);
+  sh->prof = profile_share(b->prof);
+  sh->fs = b->fs;
+  sh->fe = b->fe;
+  sh->l = b->length;
+  sh->f = b->arc_feedrate;
+  sh->R = block_curvature_radius(b);
 }
 
-static void block_compute(block_t *b) {
+// The modes and words inherited by the next line are the same after a and
+// after b
+static int block_same_modes(block_t const *a, block_t const *b) {
+  return a && b && a->plane == b->plane && a->blend == b->blend &&
+         a->incremental == b->incremental && a->comp == b->comp &&
+         a->src->n == b->src->n && a->src->tool == b->src->tool &&
+         a->src->feedrate == b->src->feedrate &&
+         a->src->spindle == b->src->spindle;
+}
+
+// Quantum of profile durations: tq, or 0 when the machine plans time
+// continuously across blocks
+static data_t block_tq(machine_t const *m) {
+  return machine_quantize(m) ? machine_tq(m) : 0;
+}
+
+// Acceleration and jerk limits of the profile: arcs are planned without
+// jerk limit (see block_motion())
+static void block_limits(block_t const *b, machine_t const *m, data_t *A,
+                         data_t *J) {
+  *A = machine_A(m);
+  *J = b->type == ARC_CW || b->type == ARC_CCW ? 0 : machine_J(m);
+}
+
+// Profile from fs to fe (rest-to-rest unless planned by block_plan()),
+// quantized to tq unless disabled (see profile.h): trapezoidal, or 7-phase
+// S-curve when the machine has a jerk limit
+static int block_compute(block_t *b, machine_t const *m) {
   assert(b);
-  data_t A, a, d;
-  data_t dt, dt_1, dt_2, dt_m, dq;
-  data_t f_m, l;
-
-  A = b->acc;
-  f_m = b->arc_feedrate / 60.0;
-  l = b->length;
-  dt_1 = f_m / A;
-  dt_2 = dt_1;
-  dt_m = l / f_m - (dt_1 + dt_2) / 2.0;
-  if (dt_m > 0) { // trapezoidal profile
-    dt = quantize(dt_1 + dt_m + dt_2, machine_tq(b->machine), &dq);
-    dt_m += dq;
-    f_m = (2 * l) / (dt_1 + dt_2 + 2 * dt_m);
-  } else { // triangular profile (short block)
-    dt_1 = dt_2 = sqrt(l / A);
-    dt = quantize(dt_1 + dt_2, machine_tq(b->machine), &dq);
-    dt_m = 0;
-    dt_2 += dq;
-    f_m = 2 * l / (dt_1 + dt_2);
-  }
-  a = f_m / dt_1;
-  d = -(f_m / dt_2);
-  // copy back values into block object
-  b->prof->dt_1 = dt_1;
-  b->prof->dt_2 = dt_2;
-  b->prof->dt_m = dt_m;
-  b->prof->a = a;
-  b->prof->d = d;
-  b->prof->f = f_m;
-  b->prof->dt = dt;
-  b->prof->l = l;
+  data_t A, J;
+  if (block_own(b))
+    return 1;
+  b->ovr = 1;
+  b->t_ofs = b->s_ofs = 0;
+  block_limits(b, m, &A, &J);
+  if (profile_compute(b->prof, b->length, b->fs / 60.0,
+                      b->arc_feedrate / 60.0, b->fe / 60.0, A, J,
+                      block_curvature_radius(b), block_tq(m)) < 0) {
+    wprintf("Could not compute the feed profile of block %zu\n", b->src->n);
+    return 1;
+  }
+  return 0;
+}
+
+// Radius of curvature of an arc; with a Z component the path is a helix
+// z = c theta, whose radius of curvature is (r^2 + c^2) / r. Blends use
+// their smallest radius; lines are straight (0)
+static data_t block_curvature_radius(block_t const *b) {
+  data_t c, d[3];
+  switch (b->type) {
+  case ARC_CW:
+  case ARC_CCW:
+    block_delta(b, d);
+    c = b->arc->dtheta ? d[plane_axes[b->plane][2]] / b->arc->dtheta : 0;
+    return (b->arc->r * b->arc->r + c * c) / b->arc->r;
+  case BLEND:
+  case SPLINE:
+    return isfinite(curve_min_radius(b->curve)) ? curve_min_radius(b->curve)
+                                                : 0;
+  default:
+    return 0;
+  }
+}
+
+// Projections and length of a straight move from the start point
+static void block_geometry(block_t *b) {
+  b->length = point_dist(start_point(b), block_target(b));
+}
+
+// Unit tangent at the start (end = 0) or at the end (end = 1) of a line or
+// a blend; returns 1 for other block types, which never carry speed
+static int block_direction(block_t const *b, int end, data_t dir[3]) {
+  data_t n;
+  if (b->type == LINE && b->length > 0) {
+    block_delta(b, dir);
+  } else if (b->type == BLEND || b->type == SPLINE) {
+    curve_eval_u(b->curve, end ? curve_segments(b->curve) : 0, NULL, dir,
+                 NULL);
+  } else {
+    return 1;
+  }
+  n = sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+  dir[0] /= n;
+  dir[1] /= n;
+  dir[2] /= n;
+  return 0;
+}
+
+// Make b an arc of the given type, with the center at ofs from the start
+// point or, if R is not 0, with radius R; the geometry is computed by
+// block_arc(). Only lines and arcs can become arcs (the curve of blends and
+// splines shares the memory of the arc record)
+static int block_set_arc(block_t *b, block_type_t type, data_t const ofs[3],
+                         data_t R) {
+  block_arc_t *a = b->arc;
+  assert(b->type != BLEND && b->type != SPLINE);
+  if (a && a->refs > 1) { // shared with other instances
+    a->refs--;
+    a = NULL;
+  }
+  if (!a && !(a = malloc(sizeof(*a)))) {
+    eprintf("Could not allocate memory for an arc\n");
+    return 1;
+  }
+  memset(a, 0, sizeof(*a));
+  memcpy(a->ofs, ofs, sizeof(a->ofs));
+  a->R = R;
+  a->step.lambda = -1;
+  a->refs = 1;
+  b->arc = a;
+  b->type = type;
+  return 0;
+}
+
+// Center of the arc b
+static void arc_center(block_t const *b, data_t c[3]) {
+  int const *ax = plane_axes[b->plane];
+  point_get(start_point(b), c);
+  c[ax[0]] += b->arc->ofs[ax[0]];
+  c[ax[1]] += b->arc->ofs[ax[1]];
 }
 
 // Calculate the arc coordinates
 // see slides pages 107-109
-static int block_arc(block_t *b) {
-  data_t x0, y0, z0, xc, yc, xf, yf, zf, r;
-  point_t *p0 = start_point(b);
-  x0 = point_x(p0);
-  y0 = point_y(p0);
-  z0 = point_z(p0);
-  xf = point_x(b->target);
-  yf = point_y(b->target);
-  zf = point_z(b->target);
-
-  if (b->r) { // if the radius is given
-    data_t dx = point_x(b->delta);
-    data_t dy = point_y(b->delta);
-    r = b->r;
-    data_t dxy2 = pow(dx, 2) + pow(dy, 2);
-    data_t sq = sqrt(-pow(dy, 2) * dxy2 * (dxy2 - 4 * r * r));
+static int block_arc(block_t *b, machine_t const *m) {
+  block_arc_t *a = b->arc;
+  data_t p0[3], pf[3], *off = a->ofs;
+  data_t u0, v0, uc, vc, uf, vf, wf, w0, r;
+  int const *ax = plane_axes[b->plane];
+  point_get(start_point(b), p0);
+  point_get(block_target(b), pf);
+  // coordinates in the arc plane (u, v) and along its normal (w)
+  u0 = p0[ax[0]];
+  v0 = p0[ax[1]];
+  w0 = p0[ax[2]];
+  uf = pf[ax[0]];
+  vf = pf[ax[1]];
+  wf = pf[ax[2]];
+
+  if (a->R) { // if the radius is given
+    data_t du = uf - u0;
+    data_t dv = vf - v0;
+    r = a->R;
+    data_t duv2 = pow(du, 2) + pow(dv, 2);
+    data_t sq = sqrt(-pow(dv, 2) * duv2 * (duv2 - 4 * r * r));
     // signs table
     // sign(r) | CW(-1) | CCW(+1)
     // --------------------------
@@ -423,38 +1601,395 @@ static int block_arc(block_t *b) {
     //      +1 |     -  |    +
     int s = (r > 0) - (r < 0);
     s *= (b->type == ARC_CCW ? 1 : -1);
-    xc = x0 + (dx - s * sq / dxy2) / 2.0;
-    yc = y0 + dy / 2.0 + s * (dx * sq) / (2 * dy * dxy2);
+    uc = u0 + (du - s * sq / duv2) / 2.0;
+    vc = v0 + dv / 2.0 + s * (du * sq) / (2 * dv * duv2);
+    // from now on, the center is known
+    off[ax[0]] = uc - u0;
+    off[ax[1]] = vc - v0;
+    a->R = 0;
   }
-  else { // if I,J are given
+  else { // if I,J (G17), K,I (G18) or J,K (G19) are given
     data_t r2;
-    r = hypot(b->i, b->j);
-    xc = x0 + b->i;
-    yc = y0 + b->j;
-    r2 = hypot(xf - xc, yf - yc);
-    if (fabs(r - r2) > machine_error(b->machine)) {
+    r = hypot(off[ax[0]], off[ax[1]]);
+    uc = u0 + off[ax[0]];
+    vc = v0 + off[ax[1]];
+    r2 = hypot(uf - uc, vf - vc);
+    if (fabs(r - r2) > machine_max_error(m)) {
       fprintf(stderr, "Arc endpoints mismatch error (%f)\n", r - r2);
       return 1;
     }
-    b->r = r;
   }
-  point_set_x(b->center, xc);
-  point_set_y(b->center, yc);
-  b->theta0 = atan2(y0 - yc, x0 - xc);
-  b->dtheta = atan2(yf - yc, xf - xc) - b->theta0;
+  // the center is in the plane of the start point
+  off[ax[2]] = 0;
+  a->theta0 = atan2(v0 - vc, u0 - uc);
+  a->dtheta = atan2(vf - vc, uf - uc) - a->theta0;
   // we need the net angle so we take the 2PI complement if negative
-  if (b->dtheta <0) 
-    b->dtheta = 2 * M_PI + b->dtheta;
+  if (a->dtheta <0) 
+    a->dtheta = 2 * M_PI + a->dtheta;
   // if CW, take the negative complement
   if (b->type == ARC_CW)
-    b->dtheta = -(2 * M_PI - b->dtheta);
+    a->dtheta = -(2 * M_PI - a->dtheta);
   //
-  b->length = hypot(zf - z0, b->dtheta * b->r);
+  b->length = hypot(wf - w0, a->dtheta * r);
   // from now on, it's safer to drop the sign of radius angle
-  b->r = fabs(b->r);
+  a->r = fabs(r);
+  a->step.lambda = -1;
+  return 0;
+}
+
+// Arcs in the ZX and YZ planes, from the stepper state: the center is in
+// the plane, the normal coordinate is linear with lambda
+static point_t *arc_point(block_t const *b, point_t const *p0, data_t lambda,
+                          point_t *result) {
+  int const *ax = plane_axes[b->plane];
+  data_t c[3], s[3], d[3], xyz[3];
+  arc_center(b, c);
+  point_get(p0, s);
+  block_delta(b, d);
+  xyz[ax[0]] = c[ax[0]] + b->arc->r * b->arc->step.c;
+  xyz[ax[1]] = c[ax[1]] + b->arc->r * b->arc->step.s;
+  xyz[ax[2]] = s[ax[2]] + d[ax[2]] * lambda;
+  point_set_xyz(result, xyz[0], xyz[1], xyz[2]);
+  return result;
+}
+
+// Offset element of the compensated block b, programmed from s to e with
+// a tool of radius r, and the unit tangents at its start and end (ts, te).
+// Returns 1 if the offset arc would vanish
+static int comp_elem(block_t const *b, data_t const s[2], data_t const e[2],
+                     data_t r, comp_elem_t *o, data_t ts[2], data_t te[2]) {
+  data_t l, turn, c[3];
+  memset(o, 0, sizeof(*o));
+  if (b->type == RAPID || b->type == LINE) {
+    l = hypot(e[0] - s[0], e[1] - s[1]);
+    o->d[0] = ts[0] = te[0] = (e[0] - s[0]) / l;
+    o->d[1] = ts[1] = te[1] = (e[1] - s[1]) / l;
+    // the left normal is (-dy, dx)
+    o->p[0] = s[0] - b->comp * r * o->d[1];
+    o->p[1] = s[1] + b->comp * r * o->d[0];
+    return 0;
+  }
+  // the left side of a counterclockwise arc is towards its center
+  turn = b->type == ARC_CCW ? 1 : -1;
+  o->arc = 1;
+  arc_center(b, c);
+  o->c[0] = c[0];
+  o->c[1] = c[1];
+  o->r = b->arc->r;
+  o->ro = b->arc->r - b->comp * turn * r;
+  ts[0] = -turn * (s[1] - o->c[1]) / o->r;
+  ts[1] = turn * (s[0] - o->c[0]) / o->r;
+  te[0] = -turn * (e[1] - o->c[1]) / o->r;
+  te[1] = turn * (e[0] - o->c[0]) / o->r;
+  return o->ro < COMP_TOL;
+}
+
+// Offset of the programmed point q on the element o
+static void comp_point(comp_elem_t const *o, data_t const q[2],
+                       data_t out[2]) {
+  data_t t;
+  if (o->arc) {
+    out[0] = o->c[0] + (q[0] - o->c[0]) * o->ro / o->r;
+    out[1] = o->c[1] + (q[1] - o->c[1]) * o->ro / o->r;
+  } else { // projection of q on the offset line
+    t = (q[0] - o->p[0]) * o->d[0] + (q[1] - o->p[1]) * o->d[1];
+    out[0] = o->p[0] + t * o->d[0];
+    out[1] = o->p[1] + t * o->d[1];
+  }
+}
+
+// Crossing of the elements a and b nearest to near, in x; 1 if they do not
+// cross
+static int comp_cross(comp_elem_t const *a, comp_elem_t const *b,
+                      data_t const near[2], data_t x[2]) {
+  comp_elem_t const *l = a->arc ? b : a, *c = a->arc ? a : b;
+  data_t den, t, f[2], bq, cq, disc, d, h, m[2], u[2], x1[2], x2[2];
+  if (!a->arc && !b->arc) {
+    den = a->d[0] * b->d[1] - a->d[1] * b->d[0];
+    if (fabs(den) < 1E-12)
+      return 1;
+    t = ((b->p[0] - a->p[0]) * b->d[1] - (b->p[1] - a->p[1]) * b->d[0]) /
+        den;
+    x[0] = a->p[0] + t * a->d[0];
+    x[1] = a->p[1] + t * a->d[1];
+    return 0;
+  }
+  if (!l->arc) { // line and circle
+    f[0] = l->p[0] - c->c[0];
+    f[1] = l->p[1] - c->c[1];
+    bq = l->d[0] * f[0] + l->d[1] * f[1];
+    cq = f[0] * f[0] + f[1] * f[1] - c->ro * c->ro;
+    if ((disc = bq * bq - cq) < 0)
+      return 1;
+    t = -bq - sqrt(disc);
+    x1[0] = l->p[0] + t * l->d[0];
+    x1[1] = l->p[1] + t * l->d[1];
+    t = -bq + sqrt(disc);
+    x2[0] = l->p[0] + t * l->d[0];
+    x2[1] = l->p[1] + t * l->d[1];
+  } else { // two circles
+    u[0] = b->c[0] - a->c[0];
+    u[1] = b->c[1] - a->c[1];
+    d = hypot(u[0], u[1]);
+    if (d < 1E-12 || d > a->ro + b->ro || d < fabs(a->ro - b->ro))
+      return 1;
+    u[0] /= d;
+    u[1] /= d;
+    t = (a->ro * a->ro - b->ro * b->ro + d * d) / (2 * d);
+    h = sqrt(fmax(0, a->ro * a->ro - t * t));
+    m[0] = a->c[0] + t * u[0];
+    m[1] = a->c[1] + t * u[1];
+    x1[0] = m[0] - h * u[1];
+    x1[1] = m[1] + h * u[0];
+    x2[0] = m[0] + h * u[1];
+    x2[1] = m[1] - h * u[0];
+  }
+  if (hypot(x1[0] - near[0], x1[1] - near[1]) <
+      hypot(x2[0] - near[0], x2[1] - near[1])) {
+    x[0] = x1[0];
+    x[1] = x1[1];
+  } else {
+    x[0] = x2[0];
+    x[1] = x2[1];
+  }
   return 0;
 }
 
+// Move the end of a to x, and the blocks after it up to stop (excluded) to
+// y, recomputing their motion. An arc keeps its center c (XY plane), which
+// must be given since the start point of a may have moved already
+static int comp_finish(block_t *a, data_t const c[2], machine_t const *m,
+                       block_t *stop, data_t const x[2], data_t const y[2]) {
+  point_t *p0 = start_point(a);
+  data_t ofs[3] = {0, 0, 0};
+  block_t *t;
+  if (a->type == ARC_CW || a->type == ARC_CCW) {
+    ofs[0] = c[0] - point_x(p0);
+    ofs[1] = c[1] - point_y(p0);
+    if (block_set_arc(a, a->type, ofs, 0))
+      return 1;
+  }
+  point_set_x(block_target(a), x[0]);
+  point_set_y(block_target(a), x[1]);
+  if (block_motion(a, m))
+    return 1;
+  for (t = a->next; t != stop; t = t->next) {
+    point_set_x(block_target(t), y[0]);
+    point_set_y(block_target(t), y[1]);
+    if (block_motion(t, m))
+      return 1;
+  }
+  return 0;
+}
+
+// Displacement from the start to the end point
+static void block_delta(block_t const *b, data_t d[3]) {
+  point_t const *p0 = start_point(b), *pf = block_target(b);
+  d[0] = point_x(pf) - point_x(p0);
+  d[1] = point_y(pf) - point_y(p0);
+  d[2] = point_z(pf) - point_z(p0);
+}
+
+static void point_get(point_t const *p, data_t v[3]) {
+  v[0] = point_x(p);
+  v[1] = point_y(p);
+  v[2] = point_z(p);
+}
+
+// Point of a line or arc at lambda, from the exact formulas: unlike
+// block_interpolate(), nothing in b or in the machine changes
+static void block_point(block_t const *b, data_t lambda, data_t xyz[3]) {
+  int const *ax = plane_axes[b->plane];
+  data_t p0[3], pf[3], c[3], a;
+  int i;
+  point_get(start_point(b), p0);
+  point_get(block_target(b), pf);
+  for (i = 0; i < 3; i++)
+    xyz[i] = p0[i] + (pf[i] - p0[i]) * lambda;
+  if (b->type == ARC_CW || b->type == ARC_CCW) {
+    arc_center(b, c);
+    a = b->arc->theta0 + b->arc->dtheta * lambda;
+    xyz[ax[0]] = c[ax[0]] + b->arc->r * cos(a);
+    xyz[ax[1]] = c[ax[1]] + b->arc->r * sin(a);
+  }
+}
+
+static data_t nearest_dist2(block_t const *b, data_t lambda,
+                            data_t const x[3]) {
+  data_t p[3];
+  block_point(b, lambda, p);
+  return (p[0] - x[0]) * (p[0] - x[0]) + (p[1] - x[1]) * (p[1] - x[1]) +
+         (p[2] - x[2]) * (p[2] - x[2]);
+}
+
+// Update the arc stepper to theta0 + dtheta * lambda
+// Forward steps below ARC_STEP_MAX are a rotation by phi, with cos(phi) and
+// sin(phi) from their Taylor series, followed by a first order
+// renormalization of the (c, s) vector (which keeps the point on the circle).
+// Backward or large jumps, the block end and every ARC_RESYNC steps use the
+// exact formula
+static void arc_angle(block_arc_t *a, data_t lambda) {
+  block_arcstep_t *st = &a->step;
+  data_t phi, phi2, cp, sp, c, s, k;
+  if (lambda == st->lambda)
+    return;
+  phi = a->dtheta * (lambda - st->lambda);
+  if (st->lambda < 0 || lambda < st->lambda || lambda >= 1 ||
+      fabs(phi) > ARC_STEP_MAX || st->steps >= ARC_RESYNC) {
+    st->c = cos(a->theta0 + a->dtheta * lambda);
+    st->s = sin(a->theta0 + a->dtheta * lambda);
+    st->lambda = lambda;
+    st->steps = 0;
+    return;
+  }
+  phi2 = phi * phi;
+  cp = 1.0 - phi2 * (1.0 / 2.0 - phi2 * (1.0 / 24.0));
+  sp = phi * (1.0 - phi2 * (1.0 / 6.0 - phi2 * (1.0 / 120.0)));
+  c = st->c * cp - st->s * sp;
+  s = st->s * cp + st->c * sp;
+  k = (3.0 - (c * c + s * s)) / 2.0;
+  st->c = c * k;
+  st->s = s * k;
+  st->lambda = lambda;
+  st->steps++;
+}
+
+// Vertices 1..k-1 within tol from the chord pt[0]-pt[k], in forward order
+// along it (a back and forth motion must not be collapsed)
+static int fit_line(data_t const (*pt)[3], size_t k, data_t tol) {
+  data_t d[3], v[3], l, t, t_prev = 0, dist2;
+  size_t i;
+  int j;
+  for (j = 0; j < 3; j++)
+    d[j] = pt[k][j] - pt[0][j];
+  l = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+  if (l <= 0)
+    return 0;
+  for (j = 0; j < 3; j++)
+    d[j] /= l;
+  for (i = 1; i < k; i++) {
+    for (j = 0; j < 3; j++)
+      v[j] = pt[i][j] - pt[0][j];
+    t = v[0] * d[0] + v[1] * d[1] + v[2] * d[2];
+    dist2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2] - t * t;
+    if (t < t_prev || t > l || dist2 > tol * tol)
+      return 0;
+    t_prev = t;
+  }
+  return 1;
+}
+
+// Arc in the XY plane through pt[0], pt[k / 2] and pt[k]: the vertices and
+// the midpoints of the segments must be within tol from the circle, and
+// the vertices must turn around the center in the same direction, by less
+// than a full turn. The center goes in c
+static int fit_arc(data_t const (*pt)[3], size_t k, data_t tol, data_t c[2],
+                   int *ccw) {
+  data_t const *a = pt[0], *m = pt[k / 2], *e = pt[k];
+  data_t D, a2, m2, e2, r, cr, dot, sweep = 0, x, y;
+  size_t i;
+  for (i = 1; i <= k; i++) {
+    if (fabs(pt[i][2] - a[2]) > 1E-9)
+      return 0;
+  }
+  D = 2 * (a[0] * (m[1] - e[1]) + m[0] * (e[1] - a[1]) + e[0] * (a[1] - m[1]));
+  if (fabs(D) < 1E-12)
+    return 0;
+  a2 = a[0] * a[0] + a[1] * a[1];
+  m2 = m[0] * m[0] + m[1] * m[1];
+  e2 = e[0] * e[0] + e[1] * e[1];
+  c[0] = (a2 * (m[1] - e[1]) + m2 * (e[1] - a[1]) + e2 * (a[1] - m[1])) / D;
+  c[1] = (a2 * (e[0] - m[0]) + m2 * (a[0] - e[0]) + e2 * (m[0] - a[0])) / D;
+  r = hypot(a[0] - c[0], a[1] - c[1]);
+  *ccw = D > 0;
+  for (i = 1; i <= k; i++) {
+    x = (pt[i - 1][0] + pt[i][0]) / 2;
+    y = (pt[i - 1][1] + pt[i][1]) / 2;
+    if (fabs(hypot(pt[i][0] - c[0], pt[i][1] - c[1]) - r) > tol ||
+        fabs(hypot(x - c[0], y - c[1]) - r) > tol)
+      return 0;
+    cr = (pt[i - 1][0] - c[0]) * (pt[i][1] - c[1]) -
+         (pt[i - 1][1] - c[1]) * (pt[i][0] - c[0]);
+    dot = (pt[i - 1][0] - c[0]) * (pt[i][0] - c[0]) +
+          (pt[i - 1][1] - c[1]) * (pt[i][1] - c[1]);
+    if ((cr > 0) != *ccw)
+      return 0;
+    sweep += fabs(atan2(cr, dot));
+  }
+  return sweep < 2 * M_PI - 1E-6;
+}
+
+// Distance of x from the segment a-b
+static data_t segment_dist(data_t const x[3], data_t const a[3],
+                           data_t const b[3]) {
+  data_t d[3], v[3], l2, t;
+  int c;
+  for (c = 0; c < 3; c++) {
+    d[c] = b[c] - a[c];
+    v[c] = x[c] - a[c];
+  }
+  l2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+  t = l2 > 0 ? (v[0] * d[0] + v[1] * d[1] + v[2] * d[2]) / l2 : 0;
+  t = fmax(0, fmin(1, t));
+  for (c = 0; c < 3; c++)
+    v[c] -= t * d[c];
+  return sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+}
+
+// Cubic from pt[i] to pt[j] with unit end tangents tg[i] and tg[j], handles
+// one third of the chord long. The vertices and the midpoints of the lines
+// must be within tol from the (sampled) curve, and the curve within tol from
+// the polyline. The control points go in ctrl
+static int fit_cubic(data_t const (*pt)[3], data_t const (*tg)[3], size_t i,
+                     size_t j, data_t tol, data_t ctrl[12]) {
+  data_t smp[SPLINE_MAX_PIECE * SPLINE_SAMPLES + 1][3], x[3], l, t, d, w;
+  size_t k, m, o, n_smp = (j - i) * SPLINE_SAMPLES;
+  int c;
+  l = sqrt((pt[j][0] - pt[i][0]) * (pt[j][0] - pt[i][0]) +
+           (pt[j][1] - pt[i][1]) * (pt[j][1] - pt[i][1]) +
+           (pt[j][2] - pt[i][2]) * (pt[j][2] - pt[i][2]));
+  for (c = 0; c < 3; c++) {
+    ctrl[c] = pt[i][c];
+    ctrl[3 + c] = pt[i][c] + l / 3 * tg[i][c];
+    ctrl[6 + c] = pt[j][c] - l / 3 * tg[j][c];
+    ctrl[9 + c] = pt[j][c];
+  }
+  // curve samples, within tol from the polyline
+  for (m = 0; m <= n_smp; m++) {
+    t = (data_t)m / n_smp;
+    w = 1 - t;
+    for (c = 0; c < 3; c++)
+      smp[m][c] = w * w * w * ctrl[c] + 3 * w * w * t * ctrl[3 + c] +
+                  3 * w * t * t * ctrl[6 + c] + t * t * t * ctrl[9 + c];
+    // the nearest line is usually the one at the same fraction of the run
+    d = INFINITY;
+    for (o = 0; o < j - i && d > tol; o++) {
+      k = i + MIN(m / SPLINE_SAMPLES, j - i - 1);
+      if (k + o < j)
+        d = fmin(d, segment_dist(smp[m], pt[k + o], pt[k + o + 1]));
+      if (k >= i + o + 1)
+        d = fmin(d, segment_dist(smp[m], pt[k - o - 1], pt[k - o]));
+    }
+    if (d > tol)
+      return 0;
+  }
+  // vertices and midpoints, within tol from the curve
+  for (k = 2 * i + 1; k < 2 * j; k++) {
+    for (c = 0; c < 3; c++)
+      x[c] = k % 2 ? (pt[k / 2][c] + pt[k / 2 + 1][c]) / 2 : pt[k / 2][c];
+    d = INFINITY;
+    for (o = 0; o < n_smp && d > tol; o++) {
+      m = MIN((k - 2 * i) * SPLINE_SAMPLES / 2, n_smp - 1);
+      if (m + o < n_smp)
+        d = fmin(d, segment_dist(x, smp[m + o], smp[m + o + 1]));
+      if (m >= o + 1)
+        d = fmin(d, segment_dist(x, smp[m - o - 1], smp[m - o]));
+    }
+    if (d > tol)
+      return 0;
+  }
+  return 1;
+}
 
 //   _____         _                     _
 //  |_   _|__  ___| |_   _ __ ___   __ _(_)_ __
@@ -463,6 +1998,680 @@ static int block_arc(block_t *b) {
 //    |_|\___||___/\__| |_| |_| |_|\__,_|_|_| |_|
 
 #ifdef BLOCK_MAIN
+#include <time.h>
+
+// Interpolate an arc tick by tick with the stepper and compare with the exact
+// parametric equations; return the maximum deviation (mm)
+static data_t arc_check(block_t *b, machine_t const *m, int jumps) {
+  block_arc_t const *a = b->arc;
+  data_t tq = machine_tq(m), t, lambda, v, x, y, c[3], err, max_err = 0;
+  point_t *sp;
+  size_t k = 0;
+  block_center(b, c);
+  for (t = 0; t - block_dt(b) <= tq / 10.0; t += tq) {
+    lambda = block_lambda(b, t, &v);
+    // every now and then go back, or jump ahead, to exercise the resync
+    if (jumps && ++k % 97 == 0)
+      lambda = fmax(0, lambda - 0.3);
+    else if (jumps && k % 89 == 0)
+      lambda = fmin(1, lambda + 0.2);
+    sp = block_interpolate(b, m, lambda);
+    x = c[0] + a->r * cos(a->theta0 + a->dtheta * lambda);
+    y = c[1] + a->r * sin(a->theta0 + a->dtheta * lambda);
+    err = hypot(point_x(sp) - x, point_y(sp) - y);
+    max_err = fmax(max_err, err);
+  }
+  return max_err;
+}
+
+// Accuracy test of the arc stepper against the exact formula, on arcs of
+// different radius and direction, and a timing comparison
+static int arc_test(machine_t *m) {
+  char const *lines[] = {
+      "N10 G00 X0 Y0 Z0",
+      "N20 G02 X100 Y0 I50 J0 F3000",
+      "N30 G03 X0 Y0 I-50 J0 F3000",
+      "N40 G02 X0 Y0 I0 J200 Z-10 F5000",
+      "N50 G03 X2 Y0 I1 J0 F200",
+      "N60 G02 X300 Y400 R-500 F10000",
+      NULL};
+  block_t *b[8] = {NULL};
+  data_t err, worst = 0;
+  size_t i, k, n = 10000000;
+  struct timespec t0, t1;
+  int rv = 0;
+  for (i = 0; lines[i]; i++) {
+    b[i] = block_new(lines[i], i ? b[i - 1] : NULL, m);
+    if (!b[i] || block_parse(b[i], m)) {
+      eprintf("Could not parse %s\n", lines[i]);
+      rv = 1;
+      goto end;
+    }
+    if (block_type(b[i]) != ARC_CW && block_type(b[i]) != ARC_CCW)
+      continue;
+    err = fmax(arc_check(b[i], m, 0), arc_check(b[i], m, 1));
+    worst = fmax(worst, err);
+    printf("%-35s r: %7.2f max deviation: %.3e mm\n", lines[i],
+           block_r(b[i]), err);
+  }
+  if (worst > machine_max_error(m)) {
+    eprintf("Arc stepper deviation %e exceeds max_error %f\n", worst,
+            machine_max_error(m));
+    rv = 1;
+  }
+  // cost per call: incremental stepper vs exact evaluation
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (k = 1; k <= n; k++)
+    block_interpolate(b[1], m, (data_t)k / n);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  printf("stepper: %6.2f ns/call\n",
+         ((t1.tv_sec - t0.tv_sec) * 1E9 + (t1.tv_nsec - t0.tv_nsec)) / n);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (k = 1; k <= n; k++) {
+    b[1]->arc->step.lambda = -1; // force the exact evaluation
+    block_interpolate(b[1], m, (data_t)k / n);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  printf("exact:   %6.2f ns/call\n",
+         ((t1.tv_sec - t0.tv_sec) * 1E9 + (t1.tv_nsec - t0.tv_nsec)) / n);
+end:
+  for (i = 0; b[i]; i++)
+    block_free(b[i]);
+  return rv;
+}
+
+// Distance of x from the line through p with unit direction t
+static data_t line_dist(data_t const x[3], data_t const p[3],
+                        data_t const t[3]) {
+  data_t d[3], dot;
+  int j;
+  for (j = 0; j < 3; j++)
+    d[j] = x[j] - p[j];
+  dot = d[0] * t[0] + d[1] * t[1] + d[2] * t[2];
+  for (j = 0; j < 3; j++)
+    d[j] -= dot * t[j];
+  return sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+}
+
+// Corner blends: deviation from the original corner, curvature continuity
+// with the lines and non-zero junction feeds
+static int blend_test(machine_t *m) {
+  char const *lines[] = {"N10 G00 X0 Y0 Z0",
+                         "N20 G64 G01 X20 Y0 F3000",
+                         "N30 G01 X20 Y20",
+                         "N40 G01 X40 Y25 Z5",
+                         "N50 G01 X10 Y5 Z5",
+                         "N60 G01 X10.02 Y5.01 Z5",
+                         "N70 G01 X10 Y30 Z5",
+                         "N80 G61 G01 X0 Y30 Z5",
+                         "N90 G01 X0 Y0 Z0",
+                         NULL};
+  block_t *first = NULL, *b = NULL, *prev = NULL, *tmp;
+  data_t corner[3], t0[3], t1[3], x[3], d2[3], err, worst = 0;
+  data_t tol = machine_max_error(m);
+  size_t i, k, n_blends = 0;
+  int rv = 0;
+  for (i = 0; lines[i]; i++) {
+    b = block_new(lines[i], prev, m);
+    if (!b || block_parse(b, m)) {
+      eprintf("Could not parse %s\n", lines[i]);
+      rv = 1;
+      goto end;
+    }
+    if (!first)
+      first = b;
+    prev = b;
+  }
+  for (b = first; b; b = b->next) {
+    corner[0] = point_x(block_target(b));
+    corner[1] = point_y(block_target(b));
+    corner[2] = point_z(block_target(b));
+    if (block_direction(b, 1, t0) || !b->next ||
+        block_direction(b->next, 0, t1))
+      continue;
+    if (block_blend(b, m) != 1)
+      continue;
+    b = b->next;
+    n_blends++;
+    err = 0;
+    for (k = 0; k <= 1000; k++) {
+      block_interpolate(b, m, k / 1000.0);
+      x[0] = point_x(machine_setpoint(m));
+      x[1] = point_y(machine_setpoint(m));
+      x[2] = point_z(machine_setpoint(m));
+      err = fmax(err, fmin(line_dist(x, corner, t0), line_dist(x, corner, t1)));
+    }
+    worst = fmax(worst, err);
+    printf("blend after %-26s length: %.4f mm, min radius: %.4f mm, "
+           "deviation: %.6f mm\n",
+           block_line(b->prev), b->length, curve_min_radius(b->curve), err);
+    // curvature continuity: no curvature at both ends
+    curve_eval_u(b->curve, 0, NULL, NULL, d2);
+    err = fabs(d2[0]) + fabs(d2[1]) + fabs(d2[2]);
+    curve_eval_u(b->curve, 1, NULL, NULL, d2);
+    err += fabs(d2[0]) + fabs(d2[1]) + fabs(d2[2]);
+    if (err > 1E-9 || block_junction(b->prev) <= 0 || block_junction(b) <= 0) {
+      eprintf("Blend is not curvature continuous or stops at its ends\n");
+      rv = 1;
+    }
+  }
+  // from N20-N30 to N70-N80: the corner at the end of N70 still follows the
+  // G64 mode of N70, while N80-N90 is G61
+  if (n_blends != 6) {
+    eprintf("Expected 6 blends, got %zu\n", n_blends);
+    rv = 1;
+  }
+  if (worst > tol * (1 + 1E-6)) {
+    eprintf("Blend deviation %f exceeds max_error %f\n", worst, tol);
+    rv = 1;
+  }
+end:
+  for (b = first; b;) {
+    tmp = b;
+    b = b->next;
+    block_free(tmp);
+  }
+  return rv;
+}
+
+// Compression of a dense polyline: a straight run, a half circle and a
+// zig-zag which must be left alone
+static int compress_test(machine_t *m) {
+  char line[128];
+  block_t *first = NULL, *b = NULL, *prev = NULL, *tmp;
+  data_t tol = 0.002, x, y, c[3], err = 0, a;
+  size_t i, n = 0, n_blocks = 0, removed = 0, n_arcs = 0;
+  int rv = 0;
+  for (i = 0; i < 301; i++) {
+    if (i == 0)
+      snprintf(line, sizeof(line), "N%zu G00 X0 Y0 Z0", n);
+    else if (i <= 100) // 100 segments, 0.1 mm long
+      snprintf(line, sizeof(line), "N%zu G01 X%.4f Y0 F1000", n, i * 0.1);
+    else if (i <= 280) { // half circle of radius 10 in 1 degree steps
+      a = -M_PI / 2 + (i - 100) * M_PI / 180;
+      snprintf(line, sizeof(line), "N%zu G01 X%.6f Y%.6f", n,
+               10 + 10 * cos(a), 10 + 10 * sin(a));
+    } else
+      snprintf(line, sizeof(line), "N%zu G01 X%.4f Y%.4f", n,
+               10 - (i - 280) * 0.1, 20 + (i % 2) * 0.5);
+    n += 10;
+    b = block_new(line, prev, m);
+    if (!b || block_parse(b, m)) {
+      eprintf("Could not parse %s\n", line);
+      rv = 1;
+      goto end;
+    }
+    if (!first)
+      first = b;
+    prev = b;
+  }
+  for (b = first; b; b = b->next) {
+    removed += block_compress(b, m, tol);
+    n_blocks++;
+    if (b->type == ARC_CCW) {
+      n_arcs++;
+      // the original vertices must lie on the merged arc
+      for (i = 1; i < 180; i++) {
+        a = -M_PI / 2 + i * M_PI / 180;
+        x = 10 + 10 * cos(a);
+        y = 10 + 10 * sin(a);
+        block_center(b, c);
+        err = fmax(err, fabs(hypot(x - c[0], y - c[1]) - block_r(b)));
+      }
+    }
+  }
+  printf("%zu blocks compressed into %zu (%zu arcs), reduction ratio %.2f, "
+         "arc deviation %.6f mm\n",
+         n_blocks + removed, n_blocks, n_arcs,
+         (data_t)(n_blocks + removed) / n_blocks, err);
+  // rapid, line, arc, 20 zig-zag lines
+  if (n_blocks != 23 || n_arcs != 1 || err > tol) {
+    eprintf("Unexpected compression result\n");
+    rv = 1;
+  }
+  if (point_x(block_target(prev)) != 10 - 20 * 0.1 ||
+      point_y(block_target(prev)) != 20) {
+    eprintf("The program end point moved\n");
+    rv = 1;
+  }
+end:
+  for (b = first; b;) {
+    tmp = b;
+    b = b->next;
+    block_free(tmp);
+  }
+  return rv;
+}
+
+// Spline fitting of a dense 3D freeform path: the interpolated curve must
+// stay within max_error from the polyline, with 10x fewer blocks at least
+static int spline_test(machine_t *m) {
+  char line[128];
+  block_t *first = NULL, *b = NULL, *prev = NULL, *tmp;
+  data_t (*pt)[3] = NULL, x[3], err = 0, d, tol = machine_max_error(m);
+  size_t i, k, n = 400, n_blocks = 0, removed = 0;
+  int rv = 0;
+  pt = malloc((n + 1) * sizeof(*pt));
+  if (!pt)
+    return 1;
+  for (i = 0; i <= n; i++) {
+    pt[i][0] = i * 0.05;
+    pt[i][1] = 5 * sin(pt[i][0] / 8) + 2 * sin(pt[i][0] / 3);
+    pt[i][2] = cos(pt[i][0] / 10) - 1;
+    snprintf(line, sizeof(line), "N%zu G01 X%.6f Y%.6f Z%.6f F3000", i * 10,
+             pt[i][0], pt[i][1], pt[i][2]);
+    b = block_new(line, prev, m);
+    if (!b || block_parse(b, m)) {
+      eprintf("Could not parse %s\n", line);
+      rv = 1;
+      goto end;
+    }
+    if (!first)
+      first = b;
+    prev = b;
+  }
+  // the first block goes from machine zero to the path start
+  for (b = first->next; b; b = b->next) {
+    removed += block_spline(b, m, tol);
+    n_blocks++;
+    if (b->type != SPLINE)
+      continue;
+    for (k = 0; k <= 10000; k++) {
+      block_interpolate(b, m, k / 10000.0);
+      x[0] = point_x(machine_setpoint(m));
+      x[1] = point_y(machine_setpoint(m));
+      x[2] = point_z(machine_setpoint(m));
+      for (i = 0, d = INFINITY; i < n; i++)
+        d = fmin(d, segment_dist(x, pt[i], pt[i + 1]));
+      err = fmax(err, d);
+    }
+  }
+  printf("%zu lines fitted with %zu blocks, reduction ratio %.2f, "
+         "max deviation %.6f mm\n",
+         n_blocks + removed, n_blocks, (data_t)(n_blocks + removed) / n_blocks,
+         err);
+  if (n_blocks * 10 > n_blocks + removed || err > tol) {
+    eprintf("Unexpected spline fitting result\n");
+    rv = 1;
+  }
+  for (b = first; b->next; b = b->next)
+    ;
+  if (fabs(point_x(block_target(b)) - pt[n][0]) > 1E-6 ||
+      fabs(point_z(block_target(b)) - pt[n][2]) > 1E-6) {
+    eprintf("The program end point moved\n");
+    rv = 1;
+  }
+end:
+  for (b = first; b;) {
+    tmp = b;
+    b = b->next;
+    block_free(tmp);
+  }
+  free(pt);
+  return rv;
+}
+
+// Change the feed override twice while interpolating a line: the path must
+// stay continuous, the feed must follow the override within the acceleration
+// limit, and each replan must take a small fraction of a tick
+static int override_test(machine_t *m) {
+  block_t *b0 = NULL, *b = NULL;
+  data_t tq = machine_tq(m), A = machine_A(m), t, s, s_prev = 0, v = 0, v_prev;
+  data_t ovr = 1, dv_max = 0, v_max = 0, worst = 0, d;
+  struct timespec t0, t1;
+  size_t n_replan = 0;
+  int rv = 0;
+  b0 = block_new("N10 G00 X0 Y0 Z0", NULL, m);
+  b = block_new("N20 G01 X2000 F3000", b0, m);
+  if (!b0 || !b || block_parse(b0, m) || block_parse(b, m)) {
+    rv = 1;
+    goto end;
+  }
+  for (t = 0; t <= block_dt(b) + tq / 10.0; t += tq) {
+    if ((ovr == 1 && t >= 12) || (ovr == 0.5 && t >= 25)) {
+      ovr = ovr == 1 ? 0.5 : 1.5;
+      block_lambda(b, t, &v);
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      rv |= block_replan(b, m, t, v, ovr);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      d = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1E9;
+      worst = fmax(worst, d);
+      n_replan++;
+    }
+    v_prev = v;
+    s = block_lambda(b, t, &v) * b->length;
+    if (s < s_prev - 1E-9) {
+      eprintf("Path went backward at t = %f\n", t);
+      rv = 1;
+    }
+    if (t > 0)
+      dv_max = fmax(dv_max, fabs(v - v_prev) / 60 / tq);
+    v_max = fmax(v_max, v);
+    s_prev = s;
+  }
+  printf("%zu replans, worst %.3f us (%.2f%% of tq), final length %f, "
+         "max acceleration %f, max feed %f\n",
+         n_replan, worst * 1E6, worst / tq * 100, s_prev, dv_max, v_max);
+  if (n_replan != 2 || fabs(s_prev - b->length) > 1E-6 ||
+      dv_max > A * 1.001 || v_max > 4500 * 1.001 || v_max < 4500 * 0.99 ||
+      worst > tq / 10) {
+    eprintf("Unexpected feed override result\n");
+    rv = 1;
+  }
+end:
+  block_free(b0);
+  block_free(b);
+  return rv;
+}
+
+// Hold a line while cruising, then resume: the stop must happen within the
+// stopping distance and the acceleration limit, with no motion while held.
+// A hold too close to the end of the block must end it at a non-null feed
+static int hold_test(machine_t *m) {
+  block_t *b0 = NULL, *b = NULL;
+  data_t tq = machine_tq(m), A = machine_A(m), t, t_hold = 12, s, s_hold = 0;
+  data_t s_prev = 0, v = 0, v_prev, dv_max = 0, s_stop;
+  int rv = 0, held = 0;
+  b0 = block_new("N10 G00 X0 Y0 Z0", NULL, m);
+  b = block_new("N20 G01 X2000 F3000", b0, m);
+  if (!b0 || !b || block_parse(b0, m) || block_parse(b, m)) {
+    rv = 1;
+    goto end;
+  }
+  s_stop = profile_stop(3000 / 60.0, machine_A(m), machine_J(m), 0);
+  for (t = 0; held == 1 || t <= block_dt(b) + tq / 10.0; t += tq) {
+    if (!held && t >= t_hold) {
+      s_hold = block_lambda(b, t, &v) * b->length;
+      rv |= block_hold(b, m, t, v);
+      held = 1;
+    } else if (held == 1 && t > block_dt(b) + tq / 10.0) {
+      // stopped: hold for a second, then resume
+      s_prev = block_lambda(b, t, &v) * b->length;
+      s = block_lambda(b, t + 1, &v) * b->length;
+      if (v != 0 || fabs(s - s_prev) > 1E-9 || s - s_hold > s_stop + 1E-6) {
+        eprintf("Bad stop at %f mm (hold at %f, feed %f)\n", s, s_hold, v);
+        rv = 1;
+      }
+      printf("Stopped in %f mm (stopping distance %f mm), override %f\n",
+             s - s_hold, s_stop, block_override(b));
+      rv |= block_replan(b, m, t, 0, 1);
+      held = 2;
+    }
+    v_prev = v;
+    s = block_lambda(b, t, &v) * b->length;
+    if (s < s_prev - 1E-9) {
+      eprintf("Path went backward at t = %f\n", t);
+      rv = 1;
+    }
+    if (t > 0)
+      dv_max = fmax(dv_max, fabs(v - v_prev) / 60 / tq);
+    s_prev = s;
+  }
+  printf("Final length %f, max acceleration %f\n", s_prev, dv_max);
+  if (held != 2 || fabs(s_prev - b->length) > 1E-6 || dv_max > A * 1.001) {
+    eprintf("Unexpected feed hold result\n");
+    rv = 1;
+  }
+  // too close to the end of a block ending at 1500 mm/min (a junction):
+  // the block ends while still decelerating
+  rv |= block_plan(b, m, 0, 1500);
+  t = block_dt(b) - 0.1;
+  block_lambda(b, t, &v);
+  rv |= block_hold(b, m, t, v);
+  block_lambda(b, block_dt(b), &v);
+  if (v <= 0 || block_lambda(b, block_dt(b), &v) != 1) {
+    eprintf("Short hold should end the block at a non-null feed\n");
+    rv = 1;
+  }
+end:
+  block_free(b0);
+  block_free(b);
+  return rv;
+}
+
+// Plan a run of collinear G64 lines with random lengths and feeds, without
+// jerk limit, both one by one and in batch: the profiles must match
+static int batch_test(machine_t *m) {
+  char line[128];
+  size_t n = 2000, i, n_diff = 0;
+  block_t **v = malloc(n * sizeof(*v)), *prev = NULL;
+  data_t *fj = malloc(n * sizeof(*fj)), *dt = malloc(n * sizeof(*dt));
+  data_t x = 0, fs, f1, f2, worst = 0, jump = 0, t1 = 0, t2 = 0;
+  struct timespec c0, c1, c2;
+  int rv = 0;
+  if (!v || !fj || !dt) {
+    rv = 1;
+    goto end;
+  }
+  srand(2);
+  for (i = 0; i < n; i++) {
+    x += 0.05 + 5.0 * rand() / RAND_MAX;
+    snprintf(line, sizeof(line), "N%zu G64 G01 X%.3f Y0 Z0 F%d", i, x,
+             1000 + rand() % 5000);
+    v[i] = prev = block_new(line, prev, m);
+    if (!v[i] || block_parse(v[i], m)) {
+      rv = 1;
+      n = i + (v[i] != NULL);
+      goto end;
+    }
+  }
+  for (i = 0; i < n; i++)
+    fj[i] = block_junction(v[i]);
+  fj[n - 1] = 0;
+  for (i = n - 1; i > 0; i--)
+    fj[i - 1] = MIN(fj[i - 1], block_reach(v[i], m, fj[i]));
+  for (i = 0, fs = 0; i < n; i++)
+    fs = fj[i] = MIN(fj[i], block_reach(v[i], m, fs));
+  clock_gettime(CLOCK_MONOTONIC, &c0);
+  for (i = 0; i < n; i++)
+    rv |= block_plan(v[i], m, i ? fj[i - 1] : 0, fj[i]);
+  clock_gettime(CLOCK_MONOTONIC, &c1);
+  for (i = 0; i < n; i++) {
+    dt[i] = block_dt(v[i]);
+    t1 += dt[i];
+  }
+  rv |= block_plan_batch(v, m, fj, n, 0);
+  clock_gettime(CLOCK_MONOTONIC, &c2);
+  // at the reachability limit of fe, rounding may make profile_compute()
+  // give up quantizing where the kernel does not: less than a tick apart
+  for (i = 0; i < n; i++) {
+    t2 += block_dt(v[i]);
+    worst = fmax(worst, fabs(block_dt(v[i]) - dt[i]));
+    n_diff += fabs(block_dt(v[i]) - dt[i]) > 1E-9;
+  }
+  // continuity: each block starts at the feed where the previous one ends
+  for (i = 1; i < n; i++) {
+    block_lambda(v[i - 1], block_dt(v[i - 1]), &f1);
+    block_lambda(v[i], 0, &f2);
+    jump = fmax(jump, fabs(f1 - f2));
+  }
+  printf("%zu lines: %f s one by one, %f s in batch (planned in %.3f ms and "
+         "%.3f ms), %zu durations differ, at most by %g s\n",
+         n, t1, t2,
+         ((c1.tv_sec - c0.tv_sec) + (c1.tv_nsec - c0.tv_nsec) / 1E9) * 1E3,
+         ((c2.tv_sec - c1.tv_sec) + (c2.tv_nsec - c1.tv_nsec) / 1E9) * 1E3,
+         n_diff, worst);
+  if (worst >= machine_tq(m) || n_diff > n / 100 || jump > 1E-6) {
+    eprintf("Batch planning differs from one by one planning\n");
+    rv = 1;
+  }
+end:
+  for (i = 0; v && i < n; i++)
+    block_free(v[i]);
+  free(v);
+  free(fj);
+  free(dt);
+  return rv;
+}
+
+// Parse the lines into a chain of blocks b (NULL terminated)
+static int modes_parse(char const **lines, block_t **b, machine_t *m) {
+  size_t i;
+  for (i = 0; lines[i]; i++) {
+    b[i] = block_new(lines[i], i ? b[i - 1] : NULL, m);
+    if (!b[i] || block_parse(b[i], m)) {
+      eprintf("Could not parse %s\n", lines[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// The same path written with absolute and incremental coordinates; a
+// helical arc in the XY plane, then the same in ZX and YZ with the axes
+// permuted: the interpolated points and the extents must match
+static int modes_test(machine_t *m) {
+  char const *abs[] = {"N10 G00 X0 Y0 Z0", "N20 G01 X10 Y5 F1000",
+                       "N30 G02 X20 Y5 I5 J0", "N40 G01 Z-3",
+                       "N50 G01 X1", NULL};
+  char const *inc[] = {"N10 G00 X0 Y0 Z0", "N20 G91 G01 X10 Y5 F1000",
+                       "N30 G02 X10 I5 J0", "N40 G01 Z-3",
+                       "N50 G90 G01 X1", NULL};
+  char const *planes[3][3] = {
+      {"N10 G00 X0 Y0 Z0", "N20 G17 G02 X10 Y0 Z-2 I5 J0 F1000", NULL},
+      {"N10 G00 X0 Y0 Z0", "N20 G18 G02 Z10 X0 Y-2 K5 I0 F1000", NULL},
+      {"N10 G00 X0 Y0 Z0", "N20 G19 G02 Y10 Z0 X-2 J5 K0 F1000", NULL}};
+  block_t *a[8] = {NULL}, *b[8] = {NULL}, *c[3][3] = {{NULL}};
+  data_t xyz[3][3], lo[3][3], hi[3][3], lambda;
+  int const *ax;
+  size_t i, k, q;
+  int rv = 1;
+  if (modes_parse(abs, a, m) || modes_parse(inc, b, m))
+    goto end;
+  for (i = 0; abs[i]; i++) {
+    if (point_dist(block_target(a[i]), block_target(b[i])) > 1E-12 ||
+        fabs(a[i]->length - b[i]->length) > 1E-12 ||
+        fabs(block_dt(a[i]) - block_dt(b[i])) > 1E-12) {
+      eprintf("Incremental block %s differs from %s\n", inc[i], abs[i]);
+      goto end;
+    }
+  }
+  for (k = 0; k < 3; k++) {
+    if (modes_parse(planes[k], c[k], m))
+      goto end;
+    block_extents(c[k][1], lo[k], hi[k]);
+  }
+  for (i = 0; i <= 100; i++) {
+    lambda = i / 100.0;
+    for (k = 0; k < 3; k++) {
+      block_interpolate(c[k][1], m, lambda);
+      point_get(machine_setpoint(m), xyz[k]);
+    }
+    for (k = 1; k < 3; k++) {
+      ax = plane_axes[k];
+      for (q = 0; q < 3; q++) {
+        if (fabs(xyz[k][ax[q]] - xyz[0][q]) > 1E-9 ||
+            fabs(lo[k][ax[q]] - lo[0][q]) > 1E-9 ||
+            fabs(hi[k][ax[q]] - hi[0][q]) > 1E-9 ||
+            fabs(block_dt(c[k][1]) - block_dt(c[0][1])) > 1E-12) {
+          eprintf("Arc in plane G%zu differs at lambda %f\n", k + 17, lambda);
+          goto end;
+        }
+      }
+    }
+  }
+  rv = 0;
+end:
+  for (i = 0; i < 8; i++) {
+    if (a[i])
+      block_free(a[i]);
+    if (b[i])
+      block_free(b[i]);
+  }
+  for (k = 0; k < 3; k++) {
+    for (i = 0; i < 3; i++) {
+      if (c[k][i])
+        block_free(c[k][i]);
+    }
+  }
+  return rv;
+}
+
+// Distance of x from the contour of comp_test(): a 20 x 20 square whose
+// right side is replaced by a half circle bulging outwards
+static data_t comp_dist(data_t const x[2]) {
+  data_t v[5][2] = {{0, 0}, {20, 0}, {20, 20}, {0, 20}, {0, 0}};
+  data_t d = INFINITY, t, dx, dy;
+  size_t i;
+  for (i = 0; i < 4; i++) {
+    if (i == 1) { // the half circle, centered at (20, 10)
+      if (x[0] >= 20)
+        d = fmin(d, fabs(hypot(x[0] - 20, x[1] - 10) - 10));
+      continue;
+    }
+    dx = v[i + 1][0] - v[i][0];
+    dy = v[i + 1][1] - v[i][1];
+    t = ((x[0] - v[i][0]) * dx + (x[1] - v[i][1]) * dy) / (dx * dx + dy * dy);
+    t = fmax(0, fmin(1, t));
+    d = fmin(d, hypot(x[0] - v[i][0] - t * dx, x[1] - v[i][1] - t * dy));
+  }
+  return d;
+}
+
+// The contour is compensated on both sides with T2, entering and leaving
+// in the middle of the bottom side: from the end of the entry move to the
+// start of the exit one, every interpolated point must be one tool radius
+// away from it. The outside corners get a join each (one on the left, two
+// on the right), the others are trimmed or tangent
+static int comp_test(machine_t *m) {
+  char const *fmt[] = {"N10 G00 X0 Y-10 Z0 T2", "N20 G4%d G01 X10 Y0 F1000",
+                       "N30 G01 X20", "N40 G03 X20 Y20 I0 J10",
+                       "N45 G01 Z-1", "N50 G01 X0", "N60 G01 Y0",
+                       "N65 G01 X10", "N70 G40 G01 X0 Y-10", NULL};
+  block_t *b[9] = {NULL}, *t, *tmp;
+  data_t r = machine_tool_radius(m, 2), x[3], d;
+  size_t i, k, joins;
+  long n;
+  char line[64];
+  int g, rv = 1;
+  for (g = 1; g <= 2; g++) {
+    for (i = 0; fmt[i]; i++) {
+      snprintf(line, sizeof(line), fmt[i], g);
+      if (!(b[i] = block_new(line, i ? b[i - 1] : NULL, m)) ||
+          block_parse(b[i], m)) {
+        eprintf("Could not parse %s\n", line);
+        goto end;
+      }
+    }
+    joins = 0;
+    if ((n = block_compensate(b[0], m, &joins)) != 6 || joins != (size_t)g) {
+      eprintf("G4%d: %ld blocks compensated, %zu joins\n", g, n, joins);
+      goto end;
+    }
+    if (point_z(block_target(b[4])) != -1 ||
+        fabs(comp_dist((data_t[2]){point_x(block_target(b[4])),
+                                   point_y(block_target(b[4]))}) - r) > 1E-9) {
+      eprintf("G4%d: the Z move is not on the offset path\n", g);
+      goto end;
+    }
+    for (t = b[0]; t; t = t->next) {
+      if (t->src->n < 30 || t->src->n > 65)
+        continue;
+      for (k = 0; k <= 20; k++) {
+        block_interpolate(t, m, k / 20.0);
+        point_get(machine_setpoint(m), x);
+        if (fabs((d = comp_dist(x)) - r) > 1E-6) {
+          eprintf("G4%d: %s at %f is %f from the contour\n", g, block_line(t),
+                  k / 20.0, d);
+          goto end;
+        }
+      }
+    }
+    for (t = b[0]; t; t = tmp) {
+      tmp = t->next;
+      block_free(t);
+    }
+    memset(b, 0, sizeof(b));
+  }
+  rv = 0;
+end:
+  for (t = b[0]; t; t = tmp) {
+    tmp = t->next;
+    block_free(t);
+  }
+  return rv;
+}
+
 int main(int argc, char const *argv[]) {
   machine_t *m = machine_new(argv[1]);
   block_t *b1 = NULL, *b2 = NULL, *b3 = NULL, *b4 = NULL;
@@ -470,15 +2679,40 @@ int main(int argc, char const *argv[]) {
     eprintf("Error creating machine\n");
     exit(EXIT_FAILURE);
   }
+  if (argc > 2) {
+    int rv = 1;
+    if (strcmp(argv[2], "arc") == 0)
+      rv = arc_test(m);
+    else if (strcmp(argv[2], "blend") == 0)
+      rv = blend_test(m);
+    else if (strcmp(argv[2], "compress") == 0)
+      rv = compress_test(m);
+    else if (strcmp(argv[2], "spline") == 0)
+      rv = spline_test(m);
+    else if (strcmp(argv[2], "override") == 0)
+      rv = override_test(m);
+    else if (strcmp(argv[2], "hold") == 0)
+      rv = hold_test(m);
+    else if (strcmp(argv[2], "batch") == 0)
+      rv = batch_test(m);
+    else if (strcmp(argv[2], "modes") == 0)
+      rv = modes_test(m);
+    else if (strcmp(argv[2], "comp") == 0)
+      rv = comp_test(m);
+    else
+      eprintf("Unknown test %s\n", argv[2]);
+    machine_free(m);
+    return rv ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
 
   b1 = block_new("N10 G01 X90 Y90 Z100 T3 F1000", NULL, m);
-  block_parse(b1);
+  block_parse(b1, m);
   b2 = block_new("N20 G01 y100 S2000", b1, m);
-  block_parse(b2);
+  block_parse(b2, m);
   b3 = block_new("N30 G01 Y200", b2, m);
-  block_parse(b3);
+  block_parse(b3, m);
   b4 = block_new("N40 G01 x0 y0 z0", b3, m);
-  block_parse(b4);
+  block_parse(b4, m);
 
   block_print(b1, stderr);
   block_print(b2, stderr);
@@ -492,7 +2726,7 @@ int main(int argc, char const *argv[]) {
     printf("t lambda v x y z\n");
     for (t = 0; t - dt <= tq/10.0; t += tq) {
       lambda = block_lambda(b2, t, &v);
-      block_interpolate(b2, lambda);
+      block_interpolate(b2, m, lambda);
       printf("%f %f %f %.3f %.3f %.3f\n", t, lambda, v, 
         point_x(machine_setpoint(m)),
         point_y(machine_setpoint(m)),
@@ -29,7 +29,9 @@ typedef enum {
   LINE,
   ARC_CW,
   ARC_CCW,
-  NO_MOTION
+  NO_MOTION,
+  BLEND, // corner blend curve, inserted by block_blend()
+  SPLINE // piecewise cubic, fitted by block_spline()
 } block_type_t;
 
 //   _____                 _   _                 
@@ -40,6 +42,12 @@ typedef enum {
                                               
 // LIFECYCLE ===================================================================
 block_t *block_new(char const *line, block_t *prev, machine_t const *machine);
+// New block from the same line as t, which comes from an earlier instance
+// of a subprogram, parsed and appended after prev: when it is a translated
+// copy of t, the profile of t is shared rather than computed again (it is
+// copied as soon as either is planned differently). NULL on error
+block_t *block_instance(block_t const *t, block_t *prev,
+                        machine_t const *machine);
 void block_free(block_t *b);
 void block_print(block_t *b, FILE *out);
 
@@ -52,17 +60,91 @@ data_t block_r(block_t const *b);
 block_type_t block_type(block_t const *b);
 char *block_line(block_t const *b);
 size_t block_n(block_t const *b);
-point_t *block_center(block_t const *b);
+// Center of an arc in c, or its start point for other blocks
+void block_center(block_t const *b, data_t c[3]);
 block_t *block_next(block_t const *b);
 point_t *block_target(block_t const *b);
+data_t block_fe(block_t const *b); // planned final feed (mm/min)
+data_t block_fs(block_t const *b); // junction feed at the start (mm/min)
+data_t block_override(block_t const *b); // feed override of the profile
+// Time spent cruising at the programmed feed (s), 0 if it is never reached
+data_t block_cruise(block_t const *b);
+// 1 if the profile is shared with other instances of the same line
+int block_shared(block_t const *b);
+// Cutter compensation mode: 1 for G41 (tool on the left), -1 for G42 (on
+// the right), 0 for G40
+int block_comp(block_t const *b);
 
 
 
 // METHODS =====================================================================
 
-int block_parse(block_t *b);
+// The methods take the machine m the block is parsed for: blocks do not
+// keep a pointer to it (see program_t)
+int block_parse(block_t *b, machine_t const *m);
+// In G64 mode, replace the corner between b and the next line with a
+// curvature continuous blend, deviating at most max_error from the corner.
+// Returns 1 if a BLEND block was inserted after b, 0 if not, -1 on error
+int block_blend(block_t *b, machine_t const *m);
+// Free all the blocks following b, which becomes the last one; returns
+// their number
+size_t block_truncate(block_t *b);
+// Remove the blend following b, if any, moving the end of b back to the
+// corner. Returns 1 if a blend was removed, 0 if not, -1 on error
+int block_unblend(block_t *b, machine_t const *m);
+// Highest feed (mm/min) at which b can pass to the next block without
+// stopping, 0 if the junction is a corner or b is in G61 mode
+data_t block_junction(block_t const *b);
+// Highest feed (mm/min) reachable along b when starting from feed f0
+data_t block_reach(block_t const *b, machine_t const *m, data_t f0);
+// Recompute the profile with initial and final feeds fs and fe (mm/min)
+int block_plan(block_t *b, machine_t const *m, data_t fs, data_t fe);
+// Same as block_plan() on n blocks at once, block i going from junction
+// feed fj[i - 1] (f0 for the first) to fj[i]: straight lines with no jerk
+// limit are planned together by a vectorized kernel
+int block_plan_batch(block_t *const *v, machine_t const *m,
+                     data_t const *fj, size_t n, data_t f0);
+// Replan the rest of the block from time t (s) and feed f0 (mm/min), with
+// the feed override ovr; the part before t is unchanged. Constant time: it
+// never looks beyond the junction feeds of b
+int block_replan(block_t *b, machine_t const *m, data_t t, data_t f0,
+                 data_t ovr);
+// Replan the rest of the block from time t (s) and feed f0 (mm/min) as a
+// deceleration to rest; returns with the block stopped before its end
+// unless the stopping distance is longer than what remains. A later
+// block_replan() resumes the motion from where it stopped
+int block_hold(block_t *b, machine_t const *m, data_t t, data_t f0);
+// Insert before b the blocks bringing the tool from the point from to the
+// start of b, clearing the part by staying at or above the higher of the
+// two Z. Returns the first inserted block, NULL on error
+block_t *block_approach(block_t *b, machine_t const *m,
+                        point_t const *from);
+// Axis aligned box (lo, hi corners, mm) enclosing the path of b from its
+// start point, arcs and curves included
+void block_extents(block_t const *b, data_t lo[3], data_t hi[3]);
+// Distance (mm) from the point x to the path of b, and the lambda of the
+// nearest point in lambda (the same parameter as block_interpolate(), but
+// without touching the machine setpoint)
+data_t block_nearest(block_t const *b, data_t const x[3], data_t *lambda);
+// Merge the lines following b (same feed, spindle, tool and path mode)
+// into b, as long as the whole run stays within tol from a single line or
+// XY arc. The merged blocks are freed; returns their number
+size_t block_compress(block_t *b, machine_t const *m, data_t tol);
+// Replace b and the lines following it with a piecewise cubic curve
+// through a subset of their vertices, within tol from the polyline. Lines
+// are fitted while their direction changes smoothly and they share feed,
+// spindle, tool and path mode. The fitted blocks are freed; returns their
+// number
+size_t block_spline(block_t *b, machine_t const *m, data_t tol);
+// Cutter radius compensation (G41/G42) of b and of the blocks following
+// it, in place: lines and XY arcs are offset by the radius of their tool,
+// outside corners are joined by arcs around the programmed corner, inside
+// corners are trimmed. The compensation starts and ends with a line from
+// and to the programmed path. Returns the number of compensated blocks,
+// adding the inserted joins to joins; -1 on error
+long block_compensate(block_t *b, machine_t const *m, size_t *joins);
 data_t block_lambda(block_t *b, data_t time, data_t *v);
-point_t *block_interpolate(block_t *b, data_t lambda);
+point_t *block_interpolate(block_t *b, machine_t const *m, data_t lambda);
 
 
 
@@ -0,0 +1,62 @@
+//    ____
+//   / ___|   _ _ ____   _____
+//  | |  | | | | '__\ \ / / _ \
+//  | |__| |_| | |   \ V /  __/
+//   \____\__,_|_|    \_/ \___|
+// Parametric curve: a chain of Bezier segments of the same degree,
+// traversed by arc length
+// Consecutive segments share their end control points; the arc length is
+// tabulated once on creation, so that evaluating the point at a given
+// distance from the start costs a table lookup and one Newton step
+
+#ifndef CURVE_H
+#define CURVE_H
+
+#include "defines.h"
+
+//   _____
+//  |_   _|   _ _ __   ___  ___
+//    | || | | | '_ \ / _ \/ __|
+//    | || |_| | |_) |  __/\__ \
+//    |_| \__, | .__/ \___||___/
+//        |___/|_|
+
+// Opaque struct
+typedef struct curve curve_t;
+
+// Highest supported degree
+#define CURVE_MAX_DEGREE 5
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+// ctrl holds degree * n_seg + 1 points as consecutive (x, y, z) triplets;
+// the data is copied
+curve_t *curve_new(size_t degree, size_t n_seg, data_t const *ctrl);
+void curve_free(curve_t *c);
+
+// Accessors ===================================================================
+size_t curve_degree(curve_t const *c);
+size_t curve_segments(curve_t const *c);
+data_t curve_length(curve_t const *c);     // mm
+data_t curve_min_radius(curve_t const *c); // mm, INFINITY if straight
+
+// Methods =====================================================================
+// Point at distance s (mm) from the start, written in xyz. Successive calls
+// with increasing s are the fast path
+void curve_eval(curve_t *c, data_t s, data_t xyz[3]);
+
+// Point, first and second derivative with respect to the parameter
+// u in [0, n_seg]; any of the outputs may be NULL
+void curve_eval_u(curve_t const *c, data_t u, data_t p[3], data_t d1[3],
+                  data_t d2[3]);
+
+// Distance (mm) from the point x to the nearest point of the curve, whose
+// distance from the start (mm) is written in s when not NULL
+data_t curve_nearest(curve_t const *c, data_t const x[3], data_t *s);
+
+#endif // CURVE_H
@@ -8,14 +8,15 @@ gv_fsm version 0.3.4
 Generation date: 2023-05-31 13:19:57 +0200
 Generated from: src/fsm.dot
 The finite state machine has:
-  8 states
-  7 transition functions
+  9 states
+  9 transition functions
 Functions and types have been generated with prefix "ccnc_"
 ******************************************************************************/
 
 #include <syslog.h>
 #include <stdio.h>
 #include <termios.h> // setting terminal attributes
+#include <poll.h>
 #include <unistd.h>
 #include <math.h>
 #include <sys/param.h>
@@ -35,6 +36,10 @@ static void signal_handler(int signal) {
   }
 }
 
+// Terminal settings saved while in non-blocking mode (see keys_nb_begin())
+static struct termios _keys_tio;
+static int _keys_nb = 0;
+
 static char read_key() {
   char key;
   struct termios old_tio, new_tio;
@@ -53,13 +58,124 @@ static char read_key() {
   return key;
 }
 
+// Wait for a keypress, or for the descriptor fd to become readable (then
+// returns 0); with fd < 0, same as read_key()
+static char read_key_or(int fd) {
+  char key = 0;
+  struct termios old_tio, new_tio;
+  struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                          {.fd = fd, .events = POLLIN}};
+  if (fd < 0)
+    return read_key();
+  tcgetattr(STDIN_FILENO, &old_tio);
+  new_tio = old_tio;
+  cfmakeraw(&new_tio);
+  tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+  if (poll(fds, 2, -1) > 0 && (fds[0].revents & POLLIN))
+    key = getchar();
+  tcsetattr(STDIN_FILENO, TCSANOW, &old_tio);
+  return key;
+}
+
+// Non-blocking variant, for polling the keyboard on every tick: returns 0
+// when no key is pending or stdin is not a terminal set by keys_nb_begin()
+static char read_key_nb() {
+  char key = 0;
+  if (!_keys_nb || read(STDIN_FILENO, &key, 1) != 1)
+    return 0;
+  return key;
+}
+
+// The terminal is put in non-canonical mode with VMIN = 0 once, when the
+// motion starts, so that polling it on each tick is a single read(); the
+// settings are restored when back to idle or on stop
+static void keys_nb_begin() {
+  struct termios new_tio;
+  if (_keys_nb || !isatty(STDIN_FILENO) ||
+      tcgetattr(STDIN_FILENO, &_keys_tio) != 0)
+    return;
+  new_tio = _keys_tio;
+  new_tio.c_lflag &= ~(ICANON | ECHO);
+  new_tio.c_cc[VMIN] = 0;
+  new_tio.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSANOW, &new_tio) == 0)
+    _keys_nb = 1;
+}
+
+static void keys_nb_end() {
+  if (!_keys_nb)
+    return;
+  tcsetattr(STDIN_FILENO, TCSANOW, &_keys_tio);
+  _keys_nb = 0;
+}
+
+// Keyboard commands during interpolation: '+' and '-' change the feed
+// override in steps of 10%, '*' resets it, spacebar requests a feed hold
+static void poll_keys(ccnc_state_data_t *data) {
+  data_t ovr = machine_override(data->machine);
+  switch (read_key_nb()) {
+  case '+':
+    machine_set_override(data->machine, ovr + 0.1);
+    break;
+  case '-':
+    machine_set_override(data->machine, ovr - 0.1);
+    break;
+  case '*':
+    machine_set_override(data->machine, 1.0);
+    break;
+  case ' ':
+    if (!data->hold)
+      fprintf(stderr, "\nFeed hold requested\n");
+    data->hold = 1;
+    return;
+  default:
+    return;
+  }
+  fprintf(stderr, "\nFeed override: %.0f%%\n",
+          machine_override(data->machine) * 100);
+}
+
+// Position table: one row per tick, either as text on stdout or into the
+// binary log (no float formatting on the real-time loop)
+static void log_position(ccnc_state_data_t *data, block_t *b, data_t lambda,
+                         data_t feed, point_t *pos) {
+  if (data->log) {
+    data_t record[] = {block_n(b), block_type(b), data->t_tot, data->t_blk,
+                       lambda, lambda * block_length(b), feed,
+                       point_x(pos), point_y(pos), point_z(pos)};
+    binlog_write(data->log, record);
+  } else {
+    printf("%lu %d %f %f %f %f %f %f %f %f\n", block_n(b), block_type(b),
+           data->t_tot, data->t_blk, lambda, lambda * block_length(b), feed,
+           point_x(pos), point_y(pos), point_z(pos));
+  }
+}
+
+// Replace the current program with the next job from the queue, the
+// finished one being freed in the background; 0 if no job is ready (never
+// waits for the one being prepared)
+static int next_job(ccnc_state_data_t *data) {
+  program_t *p = queue_try_next(data->queue);
+  if (!p)
+    return 0;
+  fprintf(stderr, "Job %s done, next job: %s\n", data->prog_file,
+          program_filename(p));
+  queue_discard(data->queue, data->program);
+  data->program = p;
+  data->prog_file = program_filename(p);
+  data->finished = 0;
+  if (program_watch(p) < 0)
+    wprintf("Changes to %s will not be reloaded\n", data->prog_file);
+  return 1;
+}
+
 // SEARCH FOR Your Code Here FOR CODE INSERTION POINTS!
 
 // GLOBALS
 // State human-readable names
 const char *ccnc_state_names[] = {"init",         "idle",         "stop",
                                   "load_block",   "go_to_zero",   "no_motion",
-                                  "rapid_motion", "interp_motion"};
+                                  "rapid_motion", "interp_motion", "hold"};
 
 // List of state functions
 state_func_t *const ccnc_state_table[CCNC_NUM_STATES] = {
@@ -71,6 +187,7 @@ state_func_t *const ccnc_state_table[CCNC_NUM_STATES] = {
     ccnc_do_no_motion,     // in state no_motion
     ccnc_do_rapid_motion,  // in state rapid_motion
     ccnc_do_interp_motion, // in state interp_motion
+    ccnc_do_hold,          // in state hold
 };
 
 // Table of transition functions
@@ -78,21 +195,27 @@ transition_func_t
     *const ccnc_transition_table[CCNC_NUM_STATES][CCNC_NUM_STATES] = {
         /* states:           init             , idle             , stop ,
            load_block       , go_to_zero       , no_motion        , rapid_motion
-           , interp_motion     */
-        /* init          */ {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
+           , interp_motion    , hold             */
+        /* init          */
+        {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
         /* idle          */
-        {NULL, NULL, NULL, ccnc_reset, ccnc_begin_zero, NULL, NULL, NULL},
-        /* stop          */ {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
+        {NULL, NULL, NULL, ccnc_reset, ccnc_begin_zero, NULL, NULL, NULL, NULL},
+        /* stop          */
+        {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
         /* load_block    */
         {NULL, NULL, NULL, NULL, NULL, NULL, ccnc_begin_rapid,
-         ccnc_begin_interp},
+         ccnc_begin_interp, NULL},
         /* go_to_zero    */
-        {NULL, ccnc_end_zero, NULL, NULL, NULL, NULL, NULL, NULL},
-        /* no_motion     */ {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
+        {NULL, ccnc_end_zero, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
+        /* no_motion     */
+        {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL},
         /* rapid_motion  */
-        {NULL, NULL, NULL, ccnc_end_rapid, NULL, NULL, NULL, NULL},
+        {NULL, NULL, NULL, ccnc_end_rapid, NULL, NULL, NULL, NULL, NULL},
         /* interp_motion */
-        {NULL, NULL, NULL, ccnc_end_interp, NULL, NULL, NULL, NULL},
+        {NULL, NULL, NULL, ccnc_end_interp, NULL, NULL, NULL, NULL,
+         ccnc_begin_hold},
+        /* hold          */
+        {NULL, NULL, NULL, NULL, NULL, NULL, NULL, ccnc_end_hold, NULL},
 };
 
 /*  ____  _        _
@@ -113,6 +236,7 @@ transition_func_t
 ccnc_state_t ccnc_do_init(ccnc_state_data_t *data) {
   ccnc_state_t next_state = CCNC_STATE_IDLE;
   point_t *sp = NULL, *zero = NULL;
+  int i;
   signal(SIGINT, signal_handler);
   syslog(LOG_INFO, "[FSM] In state init");
 
@@ -145,9 +269,14 @@ ccnc_state_t ccnc_do_init(ccnc_state_data_t *data) {
     goto next_state;
   }
 
-  // 4. print the parsed program
+  // 4. print the parsed program, report the blocks exceeding the machine
+  //    travel (the program is not started until they are fixed), and watch
+  //    it for changes
   fprintf(stderr, "Current program: %s\n", data->prog_file);
   program_print(data->program, stderr);
+  program_validate(data->program, data->machine);
+  if (program_watch(data->program) < 0)
+    wprintf("Changes to %s will not be reloaded\n", data->prog_file);
 
   // 5. sync the machine position to zero
   sp = machine_setpoint(data->machine);
@@ -155,6 +284,28 @@ ccnc_state_t ccnc_do_init(ccnc_state_data_t *data) {
   point_set_xyz(sp, point_x(zero), point_y(zero), point_z(zero));
   machine_sync(data->machine, 1);
 
+  // 6. when resuming, approach the first block from there
+  if (data->resume > 0) {
+    if (program_resume(data->program, data->resume, sp)) {
+      next_state = CCNC_STATE_STOP;
+      goto next_state;
+    }
+    fprintf(stderr, "Resuming from block N%zu\n", data->resume);
+  }
+
+  // 7. start the job queue: the other files, and those published on the job
+  //    topic, are parsed and planned in the background while the program
+  //    before them runs, each one from the end of the last
+  data->queue = queue_new(data->machine,
+                          block_target(program_last(data->program)));
+  if (!data->queue) {
+    next_state = CCNC_STATE_STOP;
+    goto next_state;
+  }
+  for (i = 0; i < data->n_jobs; i++)
+    queue_push(data->queue, data->jobs[i]);
+  machine_set_job_handler(data->machine, queue_on_job, data->queue);
+
 next_state:
   switch (next_state) {
   case CCNC_STATE_IDLE:
@@ -176,16 +327,40 @@ next_state:
 // transition to stop
 ccnc_state_t ccnc_do_idle(ccnc_state_data_t *data) {
   char key;
+  int rv;
   ccnc_state_t next_state = CCNC_NO_CHANGE;
   syslog(LOG_INFO, "[FSM] In state idle");
 
   // Steps:
-  // 1. Wait for keypress and command according state transition
+  // 1. Wait for keypress and command according state transition; when the
+  //    program file changes, reload it. Back from motion, the terminal
+  //    settings are restored first
+  keys_nb_end();
   fprintf(stderr, "Press " BGRN "spacebar" CRESET " to run, " BBLU
                   "'z' to zero, " BRED "'q'" CRESET " to quit\n");
-  key = read_key();
+  key = read_key_or(program_watch_fd(data->program));
+  if (!key && program_changed(data->program)) {
+    rv = program_reload(data->program, data->machine);
+    if (rv < 0) {
+      next_state = CCNC_STATE_STOP;
+    } else if (rv > 0) {
+      fprintf(stderr, "Reloaded %s: %d of %zu blocks updated\n",
+              data->prog_file, rv, program_length(data->program));
+    }
+  }
   switch (key) {
   case ' ':
+    // jobs queued after the end of the program are started from here, as
+    // soon as they are ready
+    if (data->finished && queue_length(data->queue) > 0 && !next_job(data)) {
+      wprintf("Next job is being prepared, not started\n");
+      break;
+    }
+    if (program_validate(data->program, data->machine) > 0) {
+      wprintf("Program exceeds the machine travel, not started\n");
+      break;
+    }
+    data->finished = 0;
     next_state = CCNC_STATE_LOAD_BLOCK;
     break;
   case 'q':
@@ -233,8 +408,9 @@ ccnc_state_t ccnc_do_stop(ccnc_state_data_t *data) {
   syslog(LOG_INFO, "[FSM] In state stop");
 
   // Steps:
-  // 0. reset signal handler
+  // 0. reset signal handler and terminal settings
   signal(SIGINT, SIG_DFL);
+  keys_nb_end();
 
   // 1. disconnect
   wprintf("Disconnect...\n");
@@ -244,12 +420,19 @@ ccnc_state_t ccnc_do_stop(ccnc_state_data_t *data) {
 
   wprintf("Clean up...\n");
   // 2. free resources
+  if (data->queue) {
+    machine_set_job_handler(data->machine, NULL, NULL);
+    queue_free(data->queue);
+  }
   if (data->program) {
     program_free(data->program);
   }
   if (data->machine) {
     machine_free(data->machine);
   }
+  if (data->log) {
+    binlog_free(data->log);
+  }
   wprintf("done.\n");
 
   switch (next_state) {
@@ -275,9 +458,16 @@ ccnc_state_t ccnc_do_load_block(ccnc_state_data_t *data) {
   syslog(LOG_INFO, "[FSM] In state load_block");
 
   // Steps:
-  // 1. get and print the next block
+  // 1. get and print the next block; at the end of the program, go on
+  //    with the next job if it is ready, otherwise wait for it in idle
   b = program_next(data->program);
+  if (!b && queue_length(data->queue) > 0 && next_job(data))
+    b = program_next(data->program);
   if (!b) { // end of program
+    if (queue_length(data->queue) > 0)
+      wprintf("Next job is being prepared, press " BGRN "spacebar" CRESET
+              " when ready\n");
+    data->finished = 1;
     next_state = CCNC_STATE_IDLE;
     goto next_state;
   }
@@ -296,6 +486,8 @@ ccnc_state_t ccnc_do_load_block(ccnc_state_data_t *data) {
   case LINE:
   case ARC_CW:
   case ARC_CCW:
+  case BLEND:
+  case SPLINE:
     next_state = CCNC_STATE_INTERP_MOTION;
     break;
 
@@ -381,6 +573,7 @@ ccnc_state_t ccnc_do_no_motion(ccnc_state_data_t *data) {
 
   // 2. increment total time
   data->t_tot += tq;
+  data->feed = data->t_carry = 0;
 
   switch (next_state) {
   case CCNC_STATE_LOAD_BLOCK:
@@ -424,9 +617,7 @@ ccnc_state_t ccnc_do_rapid_motion(ccnc_state_data_t *data) {
   }
 
   // 4. print position table
-  printf("%lu %d %f %f %f %f %f %f %f %f\n", block_n(b), block_type(b),
-         data->t_tot, data->t_blk, 0.0, 0.0, 0.0, point_x(pos), point_y(pos),
-         point_z(pos));
+  log_position(data, b, 0.0, 0.0, pos);
 
   // 5.  print progress percentage
   // fprintf(stderr, "\b\b\b\b\b\b\b\b");
@@ -467,17 +658,32 @@ ccnc_state_t ccnc_do_interp_motion(ccnc_state_data_t *data) {
   data_t lambda, feed;
   block_t *b = program_current(data->program);
   point_t *sp = NULL;
+  data_t ovr;
+  int done;
   syslog(LOG_INFO, "[FSM] In state interp_motion");
 
   // Steps:
+  // 0. on a feed hold request, replan the rest of the block as a stop from
+  //    the current time and feed (once: a held profile has null override);
+  //    otherwise, on a feed override change (keyboard or MQTT), replan the
+  //    rest of the block with the new override
+  poll_keys(data);
+  ovr = machine_override(data->machine);
+  if (data->hold && block_override(b) != 0) {
+    block_lambda(b, data->t_blk, &feed);
+    block_hold(b, data->machine, data->t_blk, feed);
+  } else if (!data->hold && ovr != block_override(b)) {
+    block_lambda(b, data->t_blk, &feed);
+    block_replan(b, data->machine, data->t_blk, feed, ovr);
+  }
+
   // 1. calculate lambda and interpolate position
   lambda = block_lambda(b, data->t_blk, &feed);
-  sp = block_interpolate(b, lambda);
+  data->feed = feed;
+  sp = block_interpolate(b, data->machine, lambda);
 
   // 2. print position table
-  printf("%lu %d %f %f %f %f %f %f %f %f\n", block_n(b), block_type(b),
-         data->t_tot, data->t_blk, lambda, lambda * block_length(b), feed,
-         point_x(sp), point_y(sp), point_z(sp));
+  log_position(data, b, lambda, feed, sp);
 
   // 3. print progress indicator
   fprintf(stderr, "\b\b\b\b\b\b\b\b");
@@ -487,9 +693,26 @@ ccnc_state_t ccnc_do_interp_motion(ccnc_state_data_t *data) {
   // 4. sync machine
   machine_sync(data->machine, 0);
 
-  // 5. check if block is done
-  if (data->t_blk >= block_dt(b) + tq / 10.0) {
+  // 5. check if block is done, or if the hold has stopped before its end.
+  //    With quantized profiles the block is left on the tick that lands on
+  //    its end; otherwise as soon as the next tick would fall beyond it.
+  //    The time past the end is carried over to the next block, counting
+  //    the load_block tick in between as motion time: with quantized
+  //    profiles, the next block starts at 2 tq, its t = 0 being the end
+  //    point just published
+  if (data->hold)
+    done = data->t_blk >= block_dt(b) + tq / 10.0;
+  else if (machine_quantize(data->machine))
+    done = data->t_blk >= block_dt(b) - tq / 10.0;
+  else
+    done = data->t_blk + tq > block_dt(b);
+  if (done && data->hold && lambda < 1) {
+    next_state = CCNC_STATE_HOLD;
+  } else if (done) {
     next_state = CCNC_STATE_LOAD_BLOCK;
+    block_lambda(b, block_dt(b), &data->feed);
+    if (!data->hold)
+      data->t_carry = data->t_blk + 2 * tq - block_dt(b);
   }
 
   // 6. increment times
@@ -500,6 +723,7 @@ ccnc_state_t ccnc_do_interp_motion(ccnc_state_data_t *data) {
   case CCNC_NO_CHANGE:
   case CCNC_STATE_LOAD_BLOCK:
   case CCNC_STATE_INTERP_MOTION:
+  case CCNC_STATE_HOLD:
     break;
   default:
     syslog(
@@ -516,6 +740,51 @@ ccnc_state_t ccnc_do_interp_motion(ccnc_state_data_t *data) {
   return next_state;
 }
 
+// Function to be executed in state hold
+// valid return states: CCNC_NO_CHANGE, CCNC_STATE_INTERP_MOTION,
+// CCNC_STATE_HOLD SIGINT triggers an emergency transition to stop
+ccnc_state_t ccnc_do_hold(ccnc_state_data_t *data) {
+  ccnc_state_t next_state = CCNC_NO_CHANGE;
+  data_t tq = machine_tq(data->machine);
+  block_t *b = program_current(data->program);
+  point_t *sp = NULL;
+  data_t lambda, feed;
+  syslog(LOG_INFO, "[FSM] In state hold");
+
+  // Steps:
+  // 1. keep the set point where the motion stopped; the block timer is
+  //    frozen, so that the resumed profile starts from here
+  lambda = block_lambda(b, data->t_blk, &feed);
+  sp = block_interpolate(b, data->machine, lambda);
+  log_position(data, b, lambda, feed, sp);
+  machine_sync(data->machine, 0);
+
+  // 2. spacebar resumes
+  if (read_key_nb() == ' ')
+    next_state = CCNC_STATE_INTERP_MOTION;
+
+  // 3. increment total time only
+  data->t_tot += tq;
+
+  switch (next_state) {
+  case CCNC_NO_CHANGE:
+  case CCNC_STATE_INTERP_MOTION:
+  case CCNC_STATE_HOLD:
+    break;
+  default:
+    syslog(LOG_WARNING,
+           "[FSM] Cannot pass from hold to %s, remaining in this state",
+           ccnc_state_names[next_state]);
+    next_state = CCNC_NO_CHANGE;
+  }
+
+  // SIGINT transition override
+  if (_exit_request)
+    next_state = CCNC_STATE_STOP;
+
+  return next_state;
+}
+
 /*  _____                    _ _   _
  * |_   _| __ __ _ _ __  ___(_) |_(_) ___  _ __
  *   | || '__/ _` | '_ \/ __| | __| |/ _ \| '_ \
@@ -534,11 +803,17 @@ ccnc_state_t ccnc_do_interp_motion(ccnc_state_data_t *data) {
 void ccnc_reset(ccnc_state_data_t *data) {
   syslog(LOG_INFO, "[FSM] State transition ccnc_reset");
   // Steps:
-  // 1. reset both timers
-  data->t_blk = data->t_tot = 0;
+  // 1. reset both timers, the feed and the hold request
+  data->t_blk = data->t_tot = data->t_carry = 0;
+  data->feed = 0;
+  data->hold = 0;
+
+  // 2. print header line on stdout (binary logs have their own header)
+  if (!data->log)
+    printf("n type t_tot t_blk lambda s feed x y z\n");
 
-  // 2. print header line on stdout
-  printf("n type t_tot t_blk lambda s feed x y z\n");
+  // 3. keyboard polled on each tick from now on (see poll_keys())
+  keys_nb_begin();
 }
 
 // This function is called in 1 transition:
@@ -567,8 +842,15 @@ void ccnc_begin_rapid(ccnc_state_data_t *data) {
   point_t *target = block_target(b);
   syslog(LOG_INFO, "[FSM] State transition ccnc_begin_rapid");
   // Steps:
-  // 1. reset block timer
-  data->t_blk = 0;
+  // 1. reset block timer; rapids and dwells end at rest. Rapids are run
+  //    by the machine at its own pace and cannot be held
+  data->t_blk = data->t_carry = 0;
+  data->feed = 0;
+  if (data->hold) {
+    wprintf("Feed hold not possible on rapid block %zu, ignored\n",
+            block_n(b));
+    data->hold = 0;
+  }
 
   // 2. start listening for MQTT status updates
   machine_listen_start(data->machine);
@@ -585,12 +867,23 @@ void ccnc_begin_rapid(ccnc_state_data_t *data) {
 // This function is called in 1 transition:
 // 1. from load_block to interp_motion
 void ccnc_begin_interp(ccnc_state_data_t *data) {
+  block_t *b = program_current(data->program);
   syslog(LOG_INFO, "[FSM] State transition ccnc_begin_interp");
   // Steps:
-  // 1. reset block timer
-  data->t_blk = 0;
-
-  // 2. print first progress string
+  // 1. start from the feed where the previous block actually ended, which
+  //    differs from the planned one if the override has changed meanwhile,
+  //    or keep on decelerating if a hold did not complete in that block
+  if (data->hold)
+    block_hold(b, data->machine, 0, data->feed);
+  else
+    block_replan(b, data->machine, 0, data->feed,
+                 machine_override(data->machine));
+
+  // 2. reset block timer, to the time carried over from the previous block
+  data->t_blk = data->t_carry;
+  data->t_carry = 0;
+
+  // 3. print first progress string
   fprintf(stderr, "[  0.0%%]");
 }
 
@@ -623,6 +916,32 @@ void ccnc_end_zero(ccnc_state_data_t *data) {
   machine_listen_stop(data->machine);
 }
 
+// This function is called in 1 transition:
+// 1. from interp_motion to hold
+void ccnc_begin_hold(ccnc_state_data_t *data) {
+  syslog(LOG_INFO, "[FSM] State transition ccnc_begin_hold");
+  // Steps:
+  // 1. clean last progress string (8 chars) and provide feedback
+  fprintf(stderr, "\b\b\b\b\b\b\b\b");
+  wprintf("Feed hold on block %zu, press " BGRN "spacebar" CRESET
+          " to resume\n",
+          block_n(program_current(data->program)));
+}
+
+// This function is called in 1 transition:
+// 1. from hold to interp_motion
+void ccnc_end_hold(ccnc_state_data_t *data) {
+  syslog(LOG_INFO, "[FSM] State transition ccnc_end_hold");
+  // Steps:
+  // 1. accelerate again along the rest of the block
+  data->hold = 0;
+  block_replan(program_current(data->program), data->machine, data->t_blk, 0,
+               machine_override(data->machine));
+
+  // 2. print first progress string
+  fprintf(stderr, "[  0.0%%]");
+}
+
 /*  ____  _        _
  * / ___|| |_ __ _| |_ ___
  * \___ \| __/ _` | __/ _ \
@@ -661,3 +980,115 @@ int main() {
   return 0;
 }
 #endif
+
+#ifdef FSM_MAIN
+#include <fcntl.h>
+// Speed on the ticks around a junction planned with a feed fj > 0, relative
+// to fj: quantization stretches the blocks, so a bit less is expected
+#define JUNCTION_FLOOR 0.9
+
+// A contour run through the state machine (no broker needed, set points
+// are just not delivered). The set point must move on every interpolation
+// tick; across a junction planned with a feed (G64) the speed must stay
+// close to that feed, and where the plan stops (G61, or corners in G64)
+// it must drop to what the acceleration allows within one tick
+int main(int argc, char const *argv[]) {
+  ccnc_state_data_t data = {0};
+  ccnc_state_t state, prev;
+  char path[] = "/tmp/ccnc_fsmXXXXXX";
+  FILE *f = NULL;
+  point_t *sp, *sp_prev = point_new();
+  block_t *b_prev = NULL;
+  size_t n = 0, n_prev = 0, junctions = 0, rests = 0, bad = 0;
+  data_t t_prev = 0, v = 0, v_last = 0, v_min = INFINITY, fj, v_rest;
+  int fd = mkstemp(path), err = -1, rv = EXIT_FAILURE;
+  if (argc < 2) {
+    eprintf("Usage: %s machine.ini\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (fd < 0 || !(f = fdopen(fd, "w")))
+    exit(EXIT_FAILURE);
+  fprintf(f, "N1 G01 G64 X20 Y0 F3000\nN2 G01 X20 Y20\nN3 G01 X40 Y20\n"
+             "N4 G02 X60 Y20 I10 J0\nN5 G01 X60 Y0\nN6 G01 X0 Y0\n"
+             "N7 G61 G01 X0 Y-10\nN8 G01 X10 Y-10\nN9 G01 X10 Y0\n");
+  fclose(f);
+  data.prog_file = path;
+  if (!(data.machine = machine_new(argv[1])))
+    goto end;
+  if (!(data.program = program_new(path)) ||
+      program_parse(data.program, data.machine) <= 0)
+    goto end;
+  data.queue = queue_new(data.machine,
+                         block_target(program_last(data.program)));
+  data.log = binlog_new("/dev/null", BINLOG_CCNC, 10, 1 << 16);
+  if (!data.queue || !data.log)
+    goto end;
+  sp = machine_setpoint(data.machine);
+  point_set_xyz(sp, 0, 0, 0);
+  v_rest = machine_A(data.machine) * machine_tq(data.machine);
+
+  // progress strings and failed publications go to /dev/null
+  err = dup(STDERR_FILENO);
+  dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+  machine_connect(data.machine, NULL);
+  ccnc_reset(&data);
+  state = CCNC_STATE_LOAD_BLOCK;
+  do {
+    prev = state;
+    state = ccnc_run_state(state, &data);
+    if (prev != CCNC_STATE_INTERP_MOTION)
+      continue;
+    n = block_n(program_current(data.program));
+    if (n_prev) {
+      v_last = v;
+      v = point_dist(sp_prev, sp) / (data.t_tot - t_prev);
+      v_min = MIN(v_min, v);
+    }
+    // the last tick of the previous block and the one across the junction
+    if (n_prev && n != n_prev) {
+      fj = block_fe(b_prev) / 60;
+      junctions++;
+      rests += fj == 0;
+      if (fj > 0 ? MIN(v_last, v) < JUNCTION_FLOOR * fj
+                 : MIN(v_last, v) > v_rest * (1 + 1E-9)) {
+        printf("N%zu-N%zu: speed %f mm/s, planned %f mm/s\n", n_prev, n,
+               MIN(v_last, v), fj);
+        bad++;
+      }
+    }
+    point_set_xyz(sp_prev, point_x(sp), point_y(sp), point_z(sp));
+    t_prev = data.t_tot;
+    n_prev = n;
+    b_prev = program_current(data.program);
+  } while (state != CCNC_STATE_IDLE && state != CCNC_STATE_STOP);
+  keys_nb_end();
+  dup2(err, STDERR_FILENO);
+
+  if (v_min <= 0) {
+    eprintf("Set point stalled (minimum speed %f mm/s)\n", v_min);
+    goto end;
+  }
+  if (rests == 0 || rests == junctions || bad > 0) {
+    eprintf("Wrong junction speeds (%zu of %zu junctions, %zu stops)\n", bad,
+            junctions, rests);
+    goto end;
+  }
+  printf("Crossed %zu junctions (%zu stops), minimum speed %f mm/s\n",
+         junctions, rests, v_min);
+  rv = EXIT_SUCCESS;
+end:
+  if (err >= 0)
+    dup2(err, STDERR_FILENO);
+  if (data.log)
+    binlog_free(data.log);
+  if (data.queue)
+    queue_free(data.queue);
+  if (data.program)
+    program_free(data.program);
+  if (data.machine)
+    machine_free(data.machine);
+  point_free(sp_prev);
+  unlink(path);
+  return rv;
+}
+#endif
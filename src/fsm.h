@@ -8,8 +8,8 @@ gv_fsm version 0.3.4
 Generation date: 2023-05-31 13:16:55 +0200
 Generated from: src/fsm.dot
 The finite state machine has:
-  8 states
-  7 transition functions
+  9 states
+  9 transition functions
 Functions and types have been generated with prefix "ccnc_"
 ******************************************************************************/
 
@@ -18,6 +18,8 @@ Functions and types have been generated with prefix "ccnc_"
 #include <stdlib.h>
 #include "machine.h"
 #include "program.h"
+#include "binlog.h"
+#include "queue.h"
 
 // State data object
 // By default set to void; override this typedef or load the proper
@@ -25,10 +27,19 @@ Functions and types have been generated with prefix "ccnc_"
 typedef struct {
   char *ini_file;
   char *prog_file;
+  char *const *jobs; // more program files, run after prog_file
+  int n_jobs;
   machine_t *machine;
   program_t *program;
   data_t t_tot;
   data_t t_blk;
+  data_t feed;   // last commanded feed (mm/min), where the next block starts
+  int hold;      // feed hold requested
+  data_t t_carry; // time past the end of the last block
+  size_t resume; // N of the block to start from (0: program start)
+  binlog_t *log; // when not NULL, the position table goes here (binary)
+  queue_t *queue; // jobs following the current program
+  int finished;   // the program ran to its end: space starts the next job
 } ccnc_state_data_t;
 
 // NOTHING SHALL BE CHANGED AFTER THIS LINE!
@@ -43,6 +54,7 @@ typedef enum {
   CCNC_STATE_NO_MOTION,  
   CCNC_STATE_RAPID_MOTION,  
   CCNC_STATE_INTERP_MOTION,  
+  CCNC_STATE_HOLD,  
   CCNC_NUM_STATES,
   CCNC_NO_CHANGE
 } ccnc_state_t;
@@ -85,9 +97,13 @@ ccnc_state_t ccnc_do_no_motion(ccnc_state_data_t *data);
 ccnc_state_t ccnc_do_rapid_motion(ccnc_state_data_t *data);
 
 // Function to be executed in state interp_motion
-// valid return states: CCNC_NO_CHANGE, CCNC_STATE_LOAD_BLOCK, CCNC_STATE_INTERP_MOTION
+// valid return states: CCNC_NO_CHANGE, CCNC_STATE_LOAD_BLOCK, CCNC_STATE_INTERP_MOTION, CCNC_STATE_HOLD
 ccnc_state_t ccnc_do_interp_motion(ccnc_state_data_t *data);
 
+// Function to be executed in state hold
+// valid return states: CCNC_NO_CHANGE, CCNC_STATE_INTERP_MOTION, CCNC_STATE_HOLD
+ccnc_state_t ccnc_do_hold(ccnc_state_data_t *data);
+
 
 // List of state functions
 extern state_func_t *const ccnc_state_table[CCNC_NUM_STATES];
@@ -101,6 +117,8 @@ void ccnc_begin_interp(ccnc_state_data_t *data);
 void ccnc_end_rapid(ccnc_state_data_t *data);
 void ccnc_end_interp(ccnc_state_data_t *data);
 void ccnc_end_zero(ccnc_state_data_t *data);
+void ccnc_begin_hold(ccnc_state_data_t *data);
+void ccnc_end_hold(ccnc_state_data_t *data);
 
 // Table of transition functions
 extern transition_func_t *const ccnc_transition_table[CCNC_NUM_STATES][CCNC_NUM_STATES];
@@ -5,7 +5,11 @@
 //  |_|  |_|\__,_|\___|_| |_|_|_| |_|\___|
 
 #include "machine.h"
+#include "setpoint.h"
 #include "toml.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <mqtt_protocol.h>
 #include <unistd.h> // for usleep()
@@ -18,19 +22,36 @@
 
 #define BUFLEN 1024
 
+// Feed override range
+#define OVERRIDE_MIN 0.1
+#define OVERRIDE_MAX 2.0
+
 typedef struct machine {
   data_t A;                      // max acceleration/deceleration
+  data_t J;                      // max jerk (0: trapezoidal profiles)
   data_t tq;                     // sampling time
+  int quantize;                  // block durations rounded up to tq
   data_t max_error, error;       // maximum error and current error
+  data_t chord_tol;              // block compression tolerance (0: off)
+  int spline;                    // fit runs of lines with splines
   data_t fmax;                   // maximum feed rate
   point_t *zero;                 // machine origin
   point_t *setpoint, *position;  // set point and current position
   point_t *offset;               // offset of the workpiece reference frame
+  data_t travel[3];              // X, Y, Z travel (mm, INFINITY: unlimited)
+  data_t *tools;                 // tool diameters (mm), T1 is tools[0]
+  size_t n_tools;                // number of tools in the table
   char broker_address[BUFLEN];   // internet address of MQTT broker
   int broker_port;               // port of MQTT broker
   char pub_topic[BUFLEN];        // topic where to publish the set point
   char sub_topic[BUFLEN];        // topic where current position is published
+  char override_topic[BUFLEN];   // topic for feed override (percent)
+  char job_topic[BUFLEN];        // topic for queueing program files
+  machine_on_job on_job;         // job handler (NULL: jobs are ignored)
+  void *job_arg;                 // argument of the job handler
+  _Atomic data_t feed_override;  // set by the MQTT thread and by the FSM
   char pub_buffer[BUFLEN];       // buffer for storing the payload
+  int binary_setpoint;           // publish set point in binary format
   struct mosquitto *mqt;         // mosquitto object
   struct mosquitto_message *msg; // mosquitto message structure
   int connecting;                // 1 when disconnected or about to connect
@@ -66,12 +87,16 @@ machine_t *machine_new(char const *cfg_path) {
   m->A = 100;
   m->max_error = 0.010;
   m->tq = 0.005;
+  m->quantize = 1;
   m->zero = point_new();
   m->position = point_new();
   m->setpoint = point_new();
   m->offset = point_new();
   point_set_xyz(m->zero, 0, 0, 0);
   point_set_xyz(m->offset, 0, 0, 0);
+  m->travel[0] = m->travel[1] = m->travel[2] = INFINITY;
+  strncpy(m->override_topic, "c-cnc/override", BUFLEN);
+  atomic_init(&m->feed_override, 1.0);
 
   // Import values form a INI file
   // 1. open the file
@@ -115,16 +140,27 @@ machine_t *machine_new(char const *cfg_path) {
   {
     toml_datum_t d;
     toml_array_t *point;
+    size_t i;
     toml_table_t *ccnc = toml_table_in(conf, "C-CNC");
     if (!ccnc) {
       eprintf("Missing C-CNC section\n");
       goto fail;
     }
     T_READ_D(d, m, ccnc, A);
+    T_READ_D(d, m, ccnc, J);
     T_READ_D(d, m, ccnc, max_error);
+    T_READ_D(d, m, ccnc, chord_tol);
     T_READ_D(d, m, ccnc, tq);
     T_READ_D(d, m, ccnc, fmax);
     T_READ_D(d, m, ccnc, rt_pacing);
+    // optional: quantized block durations by default
+    d = toml_bool_in(ccnc, "quantize");
+    if (d.ok)
+      m->quantize = d.u.b;
+    // optional: no spline fitting by default
+    d = toml_bool_in(ccnc, "spline");
+    if (d.ok)
+      m->spline = d.u.b;
     // WP origin
     point = toml_array_in(ccnc, "offset");
     if (!point) {
@@ -147,6 +183,23 @@ machine_t *machine_new(char const *cfg_path) {
         toml_double_at(point, 2).u.d
       );
     }
+    // optional: tool table, diameters of T1, T2, ...
+    point = toml_array_in(ccnc, "tools");
+    if (point && toml_array_nelem(point) > 0) {
+      m->n_tools = toml_array_nelem(point);
+      if (!(m->tools = calloc(m->n_tools, sizeof(data_t)))) {
+        eprintf("Could not allocate the tool table\n");
+        goto fail;
+      }
+      for (i = 0; i < m->n_tools; i++) {
+        d = toml_double_at(point, i);
+        if (!d.ok || d.u.d < 0) {
+          eprintf("Invalid C-CNC:tools[%zu]\n", i);
+          goto fail;
+        }
+        m->tools[i] = d.u.d;
+      }
+    }
   }
   {
     toml_datum_t d;
@@ -159,6 +212,37 @@ machine_t *machine_new(char const *cfg_path) {
     T_READ_I(d, m, mqtt, broker_port);
     T_READ_S(d, m, mqtt, pub_topic);
     T_READ_S(d, m, mqtt, sub_topic);
+    // optional: feed override topic
+    d = toml_string_in(mqtt, "override_topic");
+    if (d.ok) {
+      strncpy(m->override_topic, d.u.s, BUFLEN - 1);
+      free(d.u.s);
+    }
+    // optional: job topic
+    d = toml_string_in(mqtt, "job_topic");
+    if (d.ok) {
+      strncpy(m->job_topic, d.u.s, BUFLEN - 1);
+      free(d.u.s);
+    }
+    // optional: JSON text is the default set point format
+    d = toml_bool_in(mqtt, "binary_setpoint");
+    if (d.ok)
+      m->binary_setpoint = d.u.b;
+  }
+  // 4. axes travel, from the axis sections (SI units); machine coordinates
+  // start from 0 at the negative end of each axis
+  {
+    toml_datum_t d;
+    toml_table_t *axis;
+    char const *names[3] = {"X", "Y", "Z"};
+    int i;
+    for (i = 0; i < 3; i++) {
+      if (!(axis = toml_table_in(conf, names[i])))
+        continue;
+      d = toml_double_in(axis, "length");
+      if (d.ok)
+        m->travel[i] = d.u.d * 1000.0;
+    }
   }
   toml_free(conf);
   if (mosquitto_lib_init() != MOSQ_ERR_SUCCESS) {
@@ -184,6 +268,7 @@ void machine_free(machine_t *m) {
   if (m->mqt)
     mosquitto_destroy(m->mqt);
   mosquitto_lib_cleanup();
+  free(m->tools);
   free(m);
 }
 
@@ -197,8 +282,12 @@ void machine_free(machine_t *m) {
   }
 
 machine_getter(data_t, A);
+machine_getter(data_t, J);
 machine_getter(data_t, tq);
 machine_getter(data_t, max_error);
+machine_getter(data_t, chord_tol);
+machine_getter(int, spline);
+machine_getter(int, quantize);
 machine_getter(data_t, error);
 machine_getter(data_t, fmax);
 machine_getter(data_t, rt_pacing);
@@ -206,6 +295,40 @@ machine_getter(point_t *, zero);
 machine_getter(point_t *, setpoint);
 machine_getter(point_t *, position);
 
+data_t machine_override(machine_t const *m) {
+  assert(m);
+  return atomic_load(&((machine_t *)m)->feed_override);
+}
+
+void machine_limits(machine_t const *m, data_t lo[3], data_t hi[3]) {
+  assert(m && lo && hi);
+  data_t o[3] = {point_x(m->offset), point_y(m->offset), point_z(m->offset)};
+  int i;
+  for (i = 0; i < 3; i++) {
+    lo[i] = -o[i];
+    hi[i] = m->travel[i] - o[i];
+  }
+}
+
+data_t machine_tool_radius(machine_t const *m, size_t t) {
+  assert(m);
+  if (t < 1 || t > m->n_tools)
+    return -1;
+  return m->tools[t - 1] / 2.0;
+}
+
+void machine_set_job_handler(machine_t *m, machine_on_job fn, void *arg) {
+  assert(m);
+  m->job_arg = arg;
+  m->on_job = fn;
+}
+
+void machine_set_override(machine_t *m, data_t ovr) {
+  assert(m);
+  atomic_store(&m->feed_override,
+               fmin(OVERRIDE_MAX, fmax(OVERRIDE_MIN, ovr)));
+}
+
 
 // METHODS =====================================================================
 
@@ -213,19 +336,34 @@ void machine_print_params(machine_t const *m) {
   fprintf(stderr, BGRN "Machine parameters:\n" CRESET);
   // C-CNC section
   fprintf(stderr, BBLK "C-CNC:A:          " CRESET "%f\n", m->A);
+  fprintf(stderr, BBLK "C-CNC:J:          " CRESET "%f\n", m->J);
   fprintf(stderr, BBLK "C-CNC:tq:         " CRESET "%f\n", m->tq);
+  fprintf(stderr, BBLK "C-CNC:quantize:   " CRESET "%s\n",
+          m->quantize ? "true" : "false");
   fprintf(stderr, BBLK "C-CNC:max_error:  " CRESET "%f\n", m->max_error);
+  fprintf(stderr, BBLK "C-CNC:chord_tol:  " CRESET "%f\n", m->chord_tol);
+  fprintf(stderr, BBLK "C-CNC:spline:     " CRESET "%s\n",
+          m->spline ? "true" : "false");
   fprintf(stderr, BBLK "C-CNC:fmax:       " CRESET "%f\n", m->fmax);
   fprintf(stderr, BBLK "C-CNC:zero        " CRESET "[%.3f, %.3f, %.3f]\n", 
     point_x(m->zero), point_y(m->zero), point_z(m->zero));
   fprintf(stderr, BBLK "C-CNC:rt_pacing:  " CRESET "%f\n", m->rt_pacing);
   fprintf(stderr, BBLK "C-CNC:offset      " CRESET "[%.3f, %.3f, %.3f]\n", 
     point_x(m->offset), point_y(m->offset), point_z(m->offset));
+  fprintf(stderr, BBLK "X:Y:Z:length      " CRESET "[%.3f, %.3f, %.3f] mm\n",
+          m->travel[0], m->travel[1], m->travel[2]);
+  fprintf(stderr, BBLK "C-CNC:tools:      " CRESET "%zu diameters\n",
+          m->n_tools);
   // MQTT section
   fprintf(stderr, BBLK "MQTT:broker_addr: " CRESET "%s\n", m->broker_address);
   fprintf(stderr, BBLK "MQTT:broker_port: " CRESET "%d\n", m->broker_port);
   fprintf(stderr, BBLK "MQTT:pub_topic:   " CRESET "%s\n", m->pub_topic);
   fprintf(stderr, BBLK "MQTT:sub_topic:   " CRESET "%s\n", m->sub_topic);
+  fprintf(stderr, BBLK "MQTT:override_topic: " CRESET "%s\n",
+          m->override_topic);
+  fprintf(stderr, BBLK "MQTT:job_topic:   " CRESET "%s\n", m->job_topic);
+  fprintf(stderr, BBLK "MQTT:binary_setpoint: " CRESET "%s\n",
+          m->binary_setpoint ? "true" : "false");
 }
 
 
@@ -248,16 +386,22 @@ int machine_connect(machine_t *m, machine_on_message callback) {
 
 int machine_sync(machine_t *m, int rapid) {
   assert(m && m->mqt);
+  setpoint_t sp = {
+    .x = point_x(m->setpoint) + point_x(m->offset),
+    .y = point_y(m->setpoint) + point_y(m->offset),
+    .z = point_z(m->setpoint) + point_z(m->offset),
+    .rapid = rapid
+  };
+  size_t len;
   // Fill up m->pub_buffer with the set point in JSON format
   // {"x":100.2, "y":123, "z":0.0, "rapid":false}
-  snprintf(m->pub_buffer, BUFLEN, "{\"x\":%f, \"y\":%f, \"z\":%f, \"rapid\":%d}",
-    point_x(m->setpoint) + point_x(m->offset),
-    point_y(m->setpoint) + point_y(m->offset),
-    point_z(m->setpoint) + point_z(m->offset),
-    rapid ? 1 : 0
-  );
+  // or in the more compact binary format (see setpoint.h)
+  if (m->binary_setpoint)
+    len = setpoint_encode_bin(&sp, m->pub_buffer, BUFLEN);
+  else
+    len = setpoint_encode_json(&sp, m->pub_buffer, BUFLEN);
   // send the buffer:
-  if (mosquitto_publish(m->mqt, NULL, m->pub_topic, strlen(m->pub_buffer), m->pub_buffer, 0, 0) != MOSQ_ERR_SUCCESS) {
+  if (mosquitto_publish(m->mqt, NULL, m->pub_topic, len, m->pub_buffer, 0, 0) != MOSQ_ERR_SUCCESS) {
     perror(BRED"Could not sent message"CRESET);
     return EXIT_FAILURE;
   }
@@ -310,6 +454,14 @@ static void on_connect(struct mosquitto *mqt, void *obj, int rc) {
       perror("Could not subsccribe");
       exit(EXIT_FAILURE);
     }
+    if (mosquitto_subscribe(mqt, NULL, m->override_topic, 0) !=
+        MOSQ_ERR_SUCCESS) {
+      perror("Could not subscribe to feed override");
+    }
+    if (m->job_topic[0] &&
+        mosquitto_subscribe(mqt, NULL, m->job_topic, 0) != MOSQ_ERR_SUCCESS) {
+      perror("Could not subscribe to the job topic");
+    }
   }
   // fail to connect
   else {
@@ -331,6 +483,38 @@ static void on_message(struct mosquitto *m, void *obj, const struct mosquitto_me
   // make a copy of the message for storing it into machine
   mosquitto_message_copy(machine->msg, msg);
 
+  // feed override, as a percentage: "120" -> 1.2; anything that is not
+  // a finite number leaves the current override unchanged
+  if (strcmp(msg->topic, machine->override_topic) == 0) {
+    char buf[BUFLEN], *end;
+    int len = msg->payloadlen < BUFLEN ? msg->payloadlen : BUFLEN - 1;
+    data_t ovr;
+    memcpy(buf, msg->payload, len);
+    buf[len] = '\0';
+    ovr = strtod(buf, &end);
+    while (isspace((unsigned char)*end))
+      end++;
+    if (end == buf || *end != '\0' || !isfinite(ovr)) {
+      wprintf("Ignoring invalid feed override \"%s\"\n", buf);
+      return;
+    }
+    machine_set_override(machine, ovr / 100.0);
+    return;
+  }
+
+  // job: the payload is the name of a program file
+  if (machine->job_topic[0] && strcmp(msg->topic, machine->job_topic) == 0) {
+    char file[BUFLEN];
+    int len = msg->payloadlen < BUFLEN ? msg->payloadlen : BUFLEN - 1;
+    memcpy(file, msg->payload, len);
+    file[len] = '\0';
+    if (machine->on_job)
+      machine->on_job(file, machine->job_arg);
+    else
+      wprintf("No job queue, ignoring job %s\n", file);
+    return;
+  }
+
   // act accoring to the last part of the topic:
   // c-cnc/status/error
   if (strcmp(subtopic, "error") == 0) {
@@ -33,14 +33,31 @@ void machine_free(machine_t *m);
 
 // Accessors ===================================================================
 data_t machine_A(machine_t const *m);
+data_t machine_J(machine_t const *m);
 data_t machine_tq(machine_t const *m);
 data_t machine_max_error(machine_t const *m);
+data_t machine_chord_tol(machine_t const *m);
+int machine_spline(machine_t const *m);
+int machine_quantize(machine_t const *m);
 data_t machine_error(const machine_t *m);
 data_t machine_fmax(const machine_t *m);
 data_t machine_rt_pacing(machine_t const *m);
 point_t *machine_zero(machine_t const *m);
 point_t *machine_setpoint(machine_t const *m);
 point_t *machine_position(machine_t const *m);
+// Travel limits of the tool tip in workpiece coordinates (mm), from the
+// length of each axis and the workpiece offset
+void machine_limits(machine_t const *m, data_t lo[3], data_t hi[3]);
+// Radius (mm) of tool t from the tool table, -1 if t is not in the table
+data_t machine_tool_radius(machine_t const *m, size_t t);
+// Feed override factor (1: programmed feed), clamped to [0.1, 2.0]; it is
+// also set from MQTT messages (percent) on the override topic
+data_t machine_override(machine_t const *m);
+void machine_set_override(machine_t *m, data_t ovr);
+// Program files published on the job topic are passed to fn, with arg,
+// from the MQTT thread
+typedef void (*machine_on_job)(char const *file, void *arg);
+void machine_set_job_handler(machine_t *m, machine_on_job fn, void *arg);
 
 // Methods =====================================================================
 void machine_print_params(machine_t const *m);
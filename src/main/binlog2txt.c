@@ -0,0 +1,82 @@
+//   ____  _       _               ____  _        _
+//  | __ )(_)_ __ | | ___   __ _  |___ \| |___  _| |_
+//  |  _ \| | '_ \| |/ _ \ / _` |   __) | __\ \/ / __|
+//  | |_) | | | | | | (_) | (_| |  / __/| |_ >  <| |_
+//  |____/|_|_| |_|_|\___/ \__, | |_____|\__/_/\_\\__|
+//                         |___/
+// Convert a binary log from simulate or ccnc into the usual text columns
+// (the same ones used by plot.gp and the MATLAB scripts)
+
+#include "../binlog.h"
+#include "../defines.h"
+#include <string.h>
+
+#define MAX_COLS 64
+
+int main(int argc, char const *argv[]) {
+  binlog_header_t header;
+  data_t r[MAX_COLS];
+  FILE *in = NULL, *out = stdout;
+  size_t n = 0;
+
+  if (argc < 2 || argc > 3) {
+    eprintf("Usage: %s <binary log> [text output]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (!(in = fopen(argv[1], "rb"))) {
+    eprintf("Cannot open %s\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      strncmp(header.magic, BINLOG_MAGIC, sizeof(header.magic)) ||
+      header.n_cols > MAX_COLS) {
+    eprintf("%s is not a C-CNC binary log\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  if (argc == 3 && !(out = fopen(argv[2], "w"))) {
+    eprintf("Cannot open %s for writing\n", argv[2]);
+    exit(EXIT_FAILURE);
+  }
+
+  switch (header.kind) {
+  case BINLOG_SIMULATE:
+    if (header.n_cols != 15)
+      goto bad_cols;
+    fprintf(out,
+            "        t        qx        sx        x         vx        qy     "
+            "   sy        y         vy        qz        sz        z         vz"
+            "        d  r\n");
+    while (fread(r, sizeof(data_t), header.n_cols, in) == header.n_cols) {
+      fprintf(out,
+              "%f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f "
+              "%9.3f %9.3f %9.3f %c\n",
+              r[0], r[1], r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9], r[10],
+              r[11], r[12], r[13], r[14] ? 'R' : 'I');
+      n++;
+    }
+    break;
+  case BINLOG_CCNC:
+    if (header.n_cols != 10)
+      goto bad_cols;
+    fprintf(out, "n type t_tot t_blk lambda s feed x y z\n");
+    while (fread(r, sizeof(data_t), header.n_cols, in) == header.n_cols) {
+      fprintf(out, "%lu %d %f %f %f %f %f %f %f %f\n", (size_t)r[0], (int)r[1],
+              r[2], r[3], r[4], r[5], r[6], r[7], r[8], r[9]);
+      n++;
+    }
+    break;
+  default:
+    eprintf("Unknown log kind %u\n", header.kind);
+    exit(EXIT_FAILURE);
+  }
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+  fprintf(stderr, "Converted %zu records\n", n);
+  return 0;
+
+bad_cols:
+  eprintf("Unexpected number of columns (%u) for log kind %u\n", header.n_cols,
+          header.kind);
+  exit(EXIT_FAILURE);
+}
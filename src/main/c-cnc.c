@@ -60,7 +60,7 @@ int main(int argc, char const *argv[]) {
     dt = block_dt(curr_b);
     for (t = 0; t <= dt + tq/10.0; t += tq, tt += tq) {
       lambda = block_lambda(curr_b, t, &v);
-      pos = block_interpolate(curr_b, lambda);
+      pos = block_interpolate(curr_b, m, lambda);
       if (!pos) 
         continue;
       machine_sync(m, 0);
@@ -6,28 +6,61 @@
 #include <signal.h>
 
 #define INI_FILE "machine.ini"
+// Ring size of the binary log (records)
+#define BINLOG_RECORDS (1 << 16)
 
 // empty signal handler
 void handler(int signal) {}
 
 
-int main(int argc, char const *argv[]) {
+int main(int argc, char *const argv[]) {
   struct itimerval itv;
   ccnc_state_data_t state_data = {
     .ini_file = INI_FILE,
-    .prog_file = (char *)argv[1],
     .machine = machine_new(INI_FILE),
-    .program = NULL
+    .program = NULL,
+    .log = NULL
   };
   ccnc_state_t cur_state = CCNC_STATE_INIT;
+  char const *log_file = NULL;
+  int opt;
+
+  if (!state_data.machine) {
+    eprintf("Error initializing the machine\n");
+    exit(EXIT_FAILURE);
+  }
   data_t rt_pacing = machine_rt_pacing(state_data.machine);
   useconds_t dt = machine_tq(state_data.machine) * 1E6 / rt_pacing;
   useconds_t dt_max = dt * 10;
 
-  if (!state_data.machine) {
-    eprintf("Error initializing the machine\n");
+  // Command line: ccnc [-b binary_log] [-r N] program.gcode [job.gcode ...]
+  while ((opt = getopt(argc, argv, "b:r:")) != -1) {
+    switch (opt) {
+    case 'b':
+      log_file = optarg;
+      break;
+    case 'r':
+      state_data.resume = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      eprintf("Usage: %s [-b binary_log] [-r N] program.gcode "
+              "[job.gcode ...]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    eprintf("Usage: %s [-b binary_log] [-r N] program.gcode "
+            "[job.gcode ...]\n", argv[0]);
     exit(EXIT_FAILURE);
   }
+  state_data.prog_file = argv[optind];
+  state_data.jobs = argv + optind + 1;
+  state_data.n_jobs = argc - optind - 1;
+  if (log_file) {
+    state_data.log = binlog_new(log_file, BINLOG_CCNC, 10, BINLOG_RECORDS);
+    if (!state_data.log)
+      exit(EXIT_FAILURE);
+  }
 
   // On Linux, set the scheduler and the priority
   #ifdef __linux__
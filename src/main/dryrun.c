@@ -0,0 +1,68 @@
+//   ____
+//  |  _ \ _ __ _   _   _ __ _   _ _ __
+//  | | | | '__| | | | | '__| | | | '_ \
+//  | |_| | |  | |_| | | |  | |_| | | | |
+//  |____/|_|   \__, | |_|   \__,_|_| |_|
+//              |___/
+// Machining time, travel and extents of a G-code program, without running
+// it: ready to be used for job scheduling
+
+#include "../defines.h"
+#include "../program.h"
+#include <time.h>
+#include <unistd.h>
+
+#define INI_FILE "machine.ini"
+
+static data_t elapsed(struct timespec const *a, struct timespec const *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1E9;
+}
+
+int main(int argc, char *const argv[]) {
+  char const *ini_file = INI_FILE;
+  machine_t *m = NULL;
+  program_t *p = NULL;
+  program_stats_t stats;
+  struct timespec t0, t1, t2;
+  int opt, rv = EXIT_FAILURE;
+
+  // Command line: dryrun [-i machine.ini] program.gcode
+  while ((opt = getopt(argc, argv, "i:")) != -1) {
+    switch (opt) {
+    case 'i':
+      ini_file = optarg;
+      break;
+    default:
+      eprintf("Usage: %s [-i machine.ini] program.gcode\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (optind >= argc) {
+    eprintf("Usage: %s [-i machine.ini] program.gcode\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (!(m = machine_new(ini_file)))
+    exit(EXIT_FAILURE);
+  if (!(p = program_new(argv[optind])))
+    goto end;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (program_parse(p, m) < 0)
+    goto end;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (program_stats(p, m, &stats))
+    goto end;
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  printf("Program:         %s\n", argv[optind]);
+  program_stats_print(&stats, stdout);
+  if (program_validate(p, m) == 0)
+    printf("Within the machine travel\n");
+  fprintf(stderr, "Parsed in %.3f s, statistics in %.3f s\n",
+          elapsed(&t0, &t1), elapsed(&t1, &t2));
+  rv = EXIT_SUCCESS;
+end:
+  if (p)
+    program_free(p);
+  machine_free(m);
+  return rv;
+}
@@ -1,58 +1,278 @@
 #include "../axis.h"
+#include "../binlog.h"
 #include "../defines.h"
+#include "../setpoint.h"
+#include "../simloop.h"
 #include "../toml.h"
 #include <mosquitto.h>
 #include <mqtt_protocol.h>
 
 #include <math.h>
-#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #define INI_FILE "machine.ini"
 #define BUFLEN 1024
+// Topic prefix of each simulated machine when running a fleet (N > 1):
+// e.g. machine 12 listens on "m012/c-cnc/setpoint"
+#define FLEET_PREFIX "m%03zu/"
+// Ring size of the binary log (records), and terminal refresh period (ticks)
+// when logging in binary mode
+#define BINLOG_RECORDS (1 << 16)
+#define BINLOG_REFRESH 20
 
 int _running = 1;
 
+// Set point received from the controller (m)
+typedef struct {
+  data_t x, y, z;
+  int rapid;
+} command_t;
+
+// State of a machine after a tick, as seen by the communication loop
+typedef struct {
+  data_t t;
+  data_t setpoint[3], position[3]; // mm
+  data_t torque[3], speed[3];
+  data_t delta; // distance between setpoint and position (mm)
+  int rapid;
+  int program_run;
+} status_t;
+
+// A single simulated machine. The axes belong to the simulation thread;
+// the main thread only exchanges commands and status with it through two
+// double buffers, each with a single writer (see dbuf_write())
 typedef struct {
   axis_t *ax, *ay, *az;
-  data_t dt;
-  char broker_addr[BUFLEN];
-  int broker_port;
   char sub_topic[BUFLEN];
   char pub_topic_err[BUFLEN];
   char pub_topic_pos[BUFLEN];
+  int rapid;       // owned by the simulation thread
+  int program_run; // owned by the simulation thread
+  unsigned cmd_seen; // last command sequence applied to the axes
+  command_t cmd[2];  // written by on_message()
+  atomic_uint cmd_seq;
+  status_t status[2]; // written by sim_step()
+  atomic_uint status_seq;
+} sim_t;
+
+typedef struct fleet fleet_t;
+
+// A worker is a simulation thread that steps a contiguous slice
+// [first, last) of the fleet at every period
+typedef struct {
+  fleet_t *fleet;
+  simloop_t *loop;
+  size_t first, last;
+} worker_t;
+
+// The fleet: N machines mapped onto a fixed pool of workers, sharing one
+// MQTT client and one network loop. The workers run on their own timers;
+// the main thread only exchanges setpoints and status with the broker
+struct fleet {
+  sim_t **sims;
+  size_t n;
+  worker_t *workers;
+  size_t n_workers;
+  data_t dt;
+  char broker_addr[BUFLEN];
+  int broker_port;
   struct mosquitto *mqtt;
   int connecting;
-  int rapid;
-  int program_run;
-} sim_t;
+};
 
 // empty signal handler
 void alrm_handler(int signal) {}
 void int_handler(int signal) { _running = 0; }
 
-sim_t *sim_new(char *ini_path) {
-  FILE *ini_file = NULL;
-  toml_table_t *conf = NULL, *sec = NULL;
-  toml_datum_t datum;
-  char errbuf[BUFLEN];
+//   ____              _     _        _            __  __
+//  |  _ \  ___  _   _| |__ | | ___  | |__  _   _ / _|/ _| ___ _ __
+//  | | | |/ _ \| | | | '_ \| |/ _ \ | '_ \| | | | |_| |_ / _ \ '__|
+//  | |_| | (_) | |_| | |_) | |  __/ | |_) | |_| |  _|  _|  __/ |
+//  |____/ \___/ \__,_|_.__/|_|\___| |_.__/ \__,_|_| |_|  \___|_|
+
+// Single writer: fill the slot that is not published, then publish it with
+// a release store of the sequence number
+static void dbuf_write(atomic_uint *seq, void *slots, size_t size,
+                       void const *src) {
+  unsigned s = atomic_load_explicit(seq, memory_order_relaxed) + 1;
+  memcpy((char *)slots + (s & 1) * size, src, size);
+  atomic_store_explicit(seq, s, memory_order_release);
+}
+
+// Copy the last published slot into dst and return its sequence number.
+// The copy is retried if the writer has meanwhile published twice, i.e. if
+// it may have been overwriting the very slot being copied
+static unsigned dbuf_read(atomic_uint *seq, void const *slots, size_t size,
+                          void *dst) {
+  unsigned s, s2;
+  do {
+    s = atomic_load_explicit(seq, memory_order_acquire);
+    memcpy(dst, (char const *)slots + (s & 1) * size, size);
+    atomic_thread_fence(memory_order_acquire);
+    s2 = atomic_load_explicit(seq, memory_order_relaxed);
+  } while (s2 - s > 1);
+  return s;
+}
+
+//   ____  _                 _       _
+//  / ___|(_)_ __ ___  _   _| | __ _| |_ ___  _ __
+//  \___ \| | '_ ` _ \| | | | |/ _` | __/ _ \| '__|
+//   ___) | | | | | | | |_| | | (_| | || (_) | |
+//  |____/|_|_| |_| |_|\__,_|_|\__,_|\__\___/|_|
+
+void sim_free(sim_t *sim) {
+  if (!sim)
+    return;
+  axis_free(sim->ax);
+  axis_free(sim->ay);
+  axis_free(sim->az);
+  free(sim);
+}
+
+// Create one machine; topics are the fleet ones with the given prefix
+sim_t *sim_new(char const *ini_path, char const *prefix,
+               char const *sub_topic, char const *pub_topic) {
   sim_t *sim = malloc(sizeof(sim_t));
+  if (!sim) {
+    eprintf("Could not allocate memory for simulator\n");
+    return NULL;
+  }
   memset(sim, 0, sizeof(*sim));
-  sim->connecting = 1;
-  sim->rapid = 0;
+  atomic_init(&sim->cmd_seq, 0);
+  atomic_init(&sim->status_seq, 0);
 
   // init axes
   sim->ax = axis_new(ini_path, "X");
   sim->ay = axis_new(ini_path, "Y");
   sim->az = axis_new(ini_path, "Z");
   if (!sim->ax || !sim->ay || !sim->az) {
-    goto fail;
+    sim_free(sim);
+    return NULL;
+  }
+  // topics: the setpoint is received on the controller pub_topic, the
+  // status is published under the controller sub_topic (without the #)
+  snprintf(sim->sub_topic, BUFLEN, "%s%s", prefix, pub_topic);
+  snprintf(sim->pub_topic_err, BUFLEN, "%s%.*s", prefix,
+           (int)strlen(sub_topic) - 1, sub_topic);
+  strcpy(sim->pub_topic_pos, sim->pub_topic_err);
+  strncat(sim->pub_topic_err, "error",
+          BUFLEN - strlen(sim->pub_topic_err) - 1);
+  strncat(sim->pub_topic_pos, "position",
+          BUFLEN - strlen(sim->pub_topic_pos) - 1);
+
+  // Setup axes
+  axis_set_torque(sim->ax, 0);
+  axis_set_torque(sim->ay, 0);
+  axis_set_torque(sim->az, 0);
+  axis_link(sim->ay, sim->az);
+  axis_link(sim->ax, sim->ay);
+
+  axis_reset(sim->ax, 0);
+  axis_reset(sim->ay, 0);
+  axis_reset(sim->az, 0);
+  axis_set_setpoint(sim->ax, 0);
+  axis_set_setpoint(sim->ay, 0);
+  axis_set_setpoint(sim->az, 0);
+  return sim;
+}
+
+// Advance one machine to time t: apply the last command received, PID
+// update, then integrate the dynamics of the three axes together and
+// publish the resulting status
+static void sim_step(sim_t *sim, data_t t) {
+  axis_t *axes[3] = {sim->ax, sim->ay, sim->az};
+  command_t cmd;
+  status_t st;
+  data_t dx, dy, dz;
+  size_t i;
+  if (atomic_load_explicit(&sim->cmd_seq, memory_order_relaxed) !=
+      sim->cmd_seen) {
+    sim->cmd_seen = dbuf_read(&sim->cmd_seq, sim->cmd, sizeof(command_t), &cmd);
+    sim->program_run = 1;
+    sim->rapid = cmd.rapid;
+    axis_set_setpoint(sim->ax, cmd.x);
+    axis_set_setpoint(sim->ay, cmd.y);
+    axis_set_setpoint(sim->az, cmd.z);
+  }
+  axis_pid(sim->ax);
+  axis_pid(sim->ay);
+  axis_pid(sim->az);
+  axis_advance_batch(axes, 3, t);
+  st.t = axis_time(sim->ax);
+  for (i = 0; i < 3; i++) {
+    st.setpoint[i] = axis_setpoint(axes[i]) * 1000;
+    st.position[i] = axis_position(axes[i]) * 1000;
+    st.torque[i] = axis_torque(axes[i]);
+    st.speed[i] = axis_speed(axes[i]);
+  }
+  dx = st.position[0] - st.setpoint[0];
+  dy = st.position[1] - st.setpoint[1];
+  dz = st.position[2] - st.setpoint[2];
+  st.delta = sqrt(dx * dx + dy * dy + dz * dz);
+  st.rapid = sim->rapid;
+  st.program_run = sim->program_run;
+  dbuf_write(&sim->status_seq, sim->status, sizeof(status_t), &st);
+}
+
+//   _____ _           _
+//  |  ___| | ___  ___| |_
+//  | |_  | |/ _ \/ _ \ __|
+//  |  _| | |  __/  __/ |_
+//  |_|   |_|\___|\___|\__|
+
+// Step function of a worker, called by its simulation thread
+static void worker_step(void *ud, data_t t) {
+  worker_t *w = (worker_t *)ud;
+  size_t i;
+  for (i = w->first; i < w->last; i++)
+    sim_step(w->fleet->sims[i], t);
+}
+
+void fleet_free(fleet_t *f) {
+  size_t i;
+  if (!f)
+    return;
+  if (f->workers) {
+    for (i = 0; i < f->n_workers; i++)
+      simloop_free(f->workers[i].loop);
+    free(f->workers);
   }
+  if (f->sims) {
+    for (i = 0; i < f->n; i++)
+      sim_free(f->sims[i]);
+    free(f->sims);
+  }
+  free(f);
+}
+
+// Worker i is pinned to core cpu + i (modulo the number of cores), or not
+// pinned at all if cpu < 0
+fleet_t *fleet_new(char const *ini_path, size_t n, size_t n_workers,
+                   int cpu) {
+  FILE *ini_file = NULL;
+  toml_table_t *conf = NULL, *sec = NULL;
+  toml_datum_t datum;
+  char errbuf[BUFLEN];
+  char sub_topic[BUFLEN] = "c-cnc/status/#", pub_topic[BUFLEN] = "";
+  char prefix[BUFLEN] = "";
+  size_t i, slice;
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  fleet_t *fleet = malloc(sizeof(fleet_t));
+  if (!fleet) {
+    eprintf("Could not allocate memory for fleet\n");
+    return NULL;
+  }
+  memset(fleet, 0, sizeof(*fleet));
+  fleet->connecting = 1;
+  fleet->n = n;
+
   // read config
   ini_file = fopen(ini_path, "r");
   if (!ini_file) {
@@ -70,19 +290,19 @@ sim_t *sim_new(char *ini_path) {
   if (!datum.ok)                                                               \
     wprintf("Missing %s:%s\n", section, key);                                  \
   else                                                                         \
-    sim->field = datum.u.i;
+    field = datum.u.i;
 #define T_READ_D(section, key, field)                                          \
   datum = toml_double_in(sec, key);                                            \
   if (!datum.ok)                                                               \
     wprintf("Missing %s:%s\n", section, key);                                  \
   else                                                                         \
-    sim->field = datum.u.d;
+    field = datum.u.d;
 #define T_READ_S(section, key, field)                                          \
   datum = toml_string_in(sec, key);                                            \
   if (!datum.ok)                                                               \
     wprintf("Missing %s:%s\n", section, key);                                  \
   else {                                                                       \
-    strncpy(sim->field, datum.u.s, BUFLEN);                                    \
+    strncpy(field, datum.u.s, BUFLEN - 1);                                     \
     free(datum.u.s);                                                           \
   }
 
@@ -91,70 +311,142 @@ sim_t *sim_new(char *ini_path) {
     eprintf("Missing C-CNC section\n");
     goto fail;
   }
-  T_READ_D("C-CNC", "tq", dt);
-  sim->dt *= 1E6;
+  T_READ_D("C-CNC", "tq", fleet->dt);
+  fleet->dt *= 1E6;
 
   sec = toml_table_in(conf, "MQTT");
   if (!sec) {
     eprintf("Missing MQTT section\n");
     goto fail;
   }
-  T_READ_I("MQTT", "broker_port", broker_port);
-  T_READ_S("MQTT", "broker_address", broker_addr);
-  T_READ_S("MQTT", "sub_topic", pub_topic_err);
-  T_READ_S("MQTT", "pub_topic", sub_topic);
-  sim->pub_topic_err[strlen(sim->pub_topic_err) - 1] = '\0';
-  strcpy(sim->pub_topic_pos, sim->pub_topic_err);
-  strcat(sim->pub_topic_err, "error");
-  strcat(sim->pub_topic_pos, "position");
-
+  T_READ_I("MQTT", "broker_port", fleet->broker_port);
+  T_READ_S("MQTT", "broker_address", fleet->broker_addr);
+  T_READ_S("MQTT", "sub_topic", sub_topic);
+  T_READ_S("MQTT", "pub_topic", pub_topic);
   toml_free(conf);
-  return sim;
+  conf = NULL;
+
+  // machines
+  fleet->sims = calloc(n, sizeof(sim_t *));
+  if (!fleet->sims) {
+    eprintf("Could not allocate memory for %zu machines\n", n);
+    goto fail;
+  }
+  for (i = 0; i < n; i++) {
+    if (n > 1)
+      snprintf(prefix, BUFLEN, FLEET_PREFIX, i);
+    if (!(fleet->sims[i] =
+              sim_new(ini_path, prefix, sub_topic, pub_topic)))
+      goto fail;
+  }
+
+  // worker pool: contiguous slices of (almost) equal size
+  fleet->n_workers = n_workers > n ? n : n_workers;
+  fleet->workers = calloc(fleet->n_workers, sizeof(worker_t));
+  if (!fleet->workers) {
+    eprintf("Could not allocate memory for workers\n");
+    goto fail;
+  }
+  slice = n / fleet->n_workers;
+  for (i = 0; i < fleet->n_workers; i++) {
+    worker_t *w = &fleet->workers[i];
+    w->fleet = fleet;
+    w->first = i * slice + (i < n % fleet->n_workers ? i : n % fleet->n_workers);
+    w->last = w->first + slice + (i < n % fleet->n_workers ? 1 : 0);
+    w->loop = simloop_new(fleet->dt / 1E6,
+                          cpu < 0 ? -1 : (int)((cpu + i) % n_cpus),
+                          worker_step, w);
+    if (!w->loop)
+      goto fail;
+  }
+  return fleet;
 
 fail:
+  if (conf)
+    toml_free(conf);
+  fleet_free(fleet);
   return NULL;
 }
 
+// Start the simulation threads: from now on the machines move on their own
+static int fleet_start(fleet_t *f) {
+  size_t i;
+  for (i = 0; i < f->n_workers; i++) {
+    if (simloop_start(f->workers[i].loop))
+      return 1;
+  }
+  return 0;
+}
+
+// Report the timing statistics of each simulation thread
+static void fleet_report(fleet_t const *f) {
+  size_t i;
+  for (i = 0; i < f->n_workers; i++) {
+    simloop_t *l = f->workers[i].loop;
+    fprintf(stderr, "Worker %zu: %llu ticks, %llu overruns, max step %.3f ms\n",
+            i, (unsigned long long)simloop_ticks(l),
+            (unsigned long long)simloop_overruns(l), simloop_max_step(l) * 1E3);
+  }
+}
+
+// The topic prefix directly gives the machine index: no search needed
+static sim_t *fleet_lookup(fleet_t const *f, char const *topic) {
+  size_t i = 0;
+  if (f->n > 1) {
+    if (topic[0] != 'm')
+      return NULL;
+    i = strtoul(topic + 1, NULL, 10);
+    if (i >= f->n)
+      return NULL;
+  }
+  return strcmp(topic, f->sims[i]->sub_topic) == 0 ? f->sims[i] : NULL;
+}
+
 static void on_connect(struct mosquitto *m, void *obj, int rc) {
-  sim_t *sim = (sim_t *)obj;
+  fleet_t *fleet = (fleet_t *)obj;
+  size_t i;
   if (rc == CONNACK_ACCEPTED) {
-    wprintf("Connected to %s:%d\n", sim->broker_addr, sim->broker_port);
-    // subscribe to topic
-    if (mosquitto_subscribe(sim->mqtt, NULL, sim->sub_topic, 0) ==
-        MOSQ_ERR_SUCCESS) {
-      wprintf("Subscribed to %s\n", sim->sub_topic);
-    } else {
-      perror("Could not subscribe");
-      exit(EXIT_FAILURE);
+    wprintf("Connected to %s:%d\n", fleet->broker_addr, fleet->broker_port);
+    // subscribe to topics
+    for (i = 0; i < fleet->n; i++) {
+      if (mosquitto_subscribe(fleet->mqtt, NULL, fleet->sims[i]->sub_topic,
+                              0) != MOSQ_ERR_SUCCESS) {
+        perror("Could not subscribe");
+        exit(EXIT_FAILURE);
+      }
     }
+    if (fleet->n == 1)
+      wprintf("Subscribed to %s\n", fleet->sims[0]->sub_topic);
+    else
+      wprintf("Subscribed to %zu topics " FLEET_PREFIX "...\n", fleet->n,
+              (size_t)0);
   }
   // fail to connect
   else {
     eprintf("Conection error: %s\n", mosquitto_connack_string(rc));
     exit(EXIT_FAILURE);
   }
-  sim->connecting = 0;
+  fleet->connecting = 0;
 }
 
 static void on_message(struct mosquitto *m, void *obj,
                        const struct mosquitto_message *msg) {
-  sim_t *sim = (sim_t *)obj;
-  char *substr = NULL;
-  data_t x, y, z;
-  sim->program_run = 1;
-  if (strcmp(msg->topic, sim->sub_topic) == 0) {
-    substr = strchr(msg->payload, 'x');
-    x = atof(substr + 3) / 1000.0;
-    substr = strchr(substr + 4, 'y');
-    y = atof(substr + 3) / 1000.0;
-    substr = strchr(substr + 4, 'z');
-    z = atof(substr + 3) / 1000.0;
-    substr = strchr(substr + 4, 'd');
-    sim->rapid = atoi(substr + 3);
-    axis_set_setpoint(sim->ax, x);
-    axis_set_setpoint(sim->ay, y);
-    axis_set_setpoint(sim->az, z);
+  sim_t *sim = fleet_lookup((fleet_t *)obj, msg->topic);
+  setpoint_t sp;
+  command_t cmd;
+  if (!sim)
+    return;
+  // JSON or binary payload, not necessarily NUL-terminated
+  if (setpoint_decode(msg->payload, msg->payloadlen, &sp)) {
+    wprintf("Malformed setpoint on %s\n", msg->topic);
+    return;
   }
+  // the simulation thread picks it up at its next tick
+  cmd.x = sp.x / 1000.0;
+  cmd.y = sp.y / 1000.0;
+  cmd.z = sp.z / 1000.0;
+  cmd.rapid = sp.rapid;
+  dbuf_write(&sim->cmd_seq, sim->cmd, sizeof(command_t), &cmd);
 }
 
 //   __  __    _    ___ _   _
@@ -163,30 +455,65 @@ static void on_message(struct mosquitto *m, void *obj,
 //  | |  | |/ ___ \ | || |\  |
 //  |_|  |_/_/   \_\___|_| \_|
 
-int main(int argc, char const *argv[]) {
-  sim_t *sim = sim_new(INI_FILE);
-  axis_t *ax, *ay, *az;
-  data_t x, sx, y, sy, z, sz, delta;
+int main(int argc, char *const argv[]) {
+  fleet_t *fleet = NULL;
+  sim_t *sim;
+  status_t st, s0;
+  data_t delta;
   struct mosquitto *mqtt = NULL;
   FILE *logfile = NULL;
+  binlog_t *binlog = NULL;
   char payload[BUFLEN];
-  int count = 0;
-  if (!sim) {
+  int count = 0, opt, binary = 0, refresh, cpu = -1;
+  unsigned long tick = 0;
+  size_t i, n = 1, n_workers = sysconf(_SC_NPROCESSORS_ONLN), active;
+
+  // Command line:
+  // simulate [-n machines] [-j workers] [-c first cpu] [-b] [logfile]
+  while ((opt = getopt(argc, argv, "n:j:c:b")) != -1) {
+    switch (opt) {
+    case 'b':
+      binary = 1;
+      break;
+    case 'n':
+      n = strtoul(optarg, NULL, 10);
+      break;
+    case 'j':
+      n_workers = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      cpu = atoi(optarg);
+      break;
+    default:
+      eprintf("Usage: %s [-n machines] [-j workers] [-c first cpu] [-b] "
+              "[logfile]\n",
+              argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (n < 1 || n_workers < 1) {
+    eprintf("Need at least one machine and one worker\n");
+    return EXIT_FAILURE;
+  }
+  fleet = fleet_new(INI_FILE, n, n_workers, cpu);
+  if (!fleet) {
     eprintf("Could not create simulator\n");
     return EXIT_FAILURE;
   }
-  ax = sim->ax;
-  ay = sim->ay;
-  az = sim->az;
+  // the first machine is the one shown on terminal and logged
+  sim = fleet->sims[0];
+  if (n > 1)
+    wprintf("Simulating %zu machines on %zu workers\n", fleet->n,
+            fleet->n_workers);
 
   // Setup timing facility
   {
     struct itimerval itv;
     // set the timer intervals
     itv.it_interval.tv_sec = 0;
-    itv.it_interval.tv_usec = sim->dt;
+    itv.it_interval.tv_usec = fleet->dt;
     itv.it_value.tv_sec = 0;
-    itv.it_value.tv_usec = sim->dt;
+    itv.it_value.tv_usec = fleet->dt;
 
     // install signal handler
     signal(SIGALRM, alrm_handler);
@@ -199,31 +526,36 @@ int main(int argc, char const *argv[]) {
     }
   }
 
-  // Log file
-  if (argc == 2) {
-    if (!(logfile = fopen(argv[1], "w"))) {
-      eprintf("Cannot open %s for writing\n", argv[1]);
+  // Log file (binary logs are converted to text by binlog2txt)
+  if (optind < argc && binary) {
+    if (!(binlog = binlog_new(argv[optind], BINLOG_SIMULATE, 15,
+                              BINLOG_RECORDS))) {
+      exit(EXIT_FAILURE);
+    }
+  } else if (optind < argc) {
+    if (!(logfile = fopen(argv[optind], "w"))) {
+      eprintf("Cannot open %s for writing\n", argv[optind]);
       exit(EXIT_FAILURE);
     }
   }
 
-  // Setup comms
+  // Setup comms: one client and one network loop for the whole fleet
   mosquitto_lib_init();
-  mqtt = mosquitto_new(NULL, 1, sim);
-  sim->mqtt = mqtt;
+  mqtt = mosquitto_new(NULL, 1, fleet);
+  fleet->mqtt = mqtt;
   if (!mqtt) {
     perror(BRED "Could not create MQTT" CRESET);
     return EXIT_FAILURE;
   }
   mosquitto_connect_callback_set(mqtt, on_connect);
   mosquitto_message_callback_set(mqtt, on_message);
-  if (mosquitto_connect(mqtt, sim->broker_addr, sim->broker_port, 10) !=
+  if (mosquitto_connect(mqtt, fleet->broker_addr, fleet->broker_port, 10) !=
       MOSQ_ERR_SUCCESS) {
     perror(BRED "Invalid broker connection parameters" CRESET);
     return EXIT_FAILURE;
   }
   // wait for the connection to be established
-  while (sim->connecting) {
+  while (fleet->connecting) {
     mosquitto_loop(mqtt, -1, 1);
     if (++count >= 5) {
       eprintf("Could not connect to broker\n");
@@ -231,85 +563,93 @@ int main(int argc, char const *argv[]) {
     }
   }
 
-  // Setup axes
-  axis_set_torque(ax, 0);
-  axis_set_torque(ay, 0);
-  axis_set_torque(az, 0);
-  axis_link(ay, az);
-  axis_link(ax, ay);
-
-  axis_reset(ax, 0);
-  axis_reset(ay, 0);
-  axis_reset(az, 0);
-  axis_set_setpoint(ax, 0);
-  axis_set_setpoint(ay, 0);
-  axis_set_setpoint(az, 0);
-
 #define LOG_HEADER                                                             \
   "        t        qx        sx        x         vx        qy        sy     " \
   "   y         vy        qz        sz        z         vz        d  r\n"
-  printf(LOG_HEADER);
+  if (n == 1)
+    printf(LOG_HEADER);
   if (logfile) {
     fprintf(logfile, LOG_HEADER);
   }
 
-  axis_run(ax);
-  axis_run(ay);
-  axis_run(az);
-
-  // Timing loop
+  // Simulation threads, then the communication loop
+  if (fleet_start(fleet)) {
+    fleet_free(fleet);
+    return EXIT_FAILURE;
+  }
   while (_running) {
-    axis_pid(ax);
-    axis_pid(ay);
-    axis_pid(az);
-    sx = axis_setpoint(ax) * 1000;
-    sy = axis_setpoint(ay) * 1000;
-    sz = axis_setpoint(az) * 1000;
-    x = axis_position(ax) * 1000;
-    y = axis_position(ay) * 1000;
-    z = axis_position(az) * 1000;
-    delta = sqrt(pow(x - sx, 2) + pow(y - sy, 2) + pow(z - sz, 2));
-    printf("\r");
-    printf("%9.4f " RED "%9.3f %9.3f %9.3f %9.3f " GRN
-           "%9.3f %9.3f %9.3f %9.3f " BLU "%9.3f %9.3f %9.3f %9.3f" YEL
-           " %9.3f" CRESET " %c",
-           axis_time(ax), axis_torque(ax), sx, x, axis_speed(ax),
-           axis_torque(ay), sy, y, axis_speed(ay), axis_torque(az), sz, z,
-           axis_speed(az), delta, sim->rapid ? 'R' : 'I');
-    if (logfile && sim->program_run) {
+    // one consistent snapshot of the first machine, for terminal and logs
+    dbuf_read(&sim->status_seq, sim->status, sizeof(status_t), &s0);
+    // in binary mode, the terminal is only refreshed every few ticks
+    refresh = !binlog || tick++ % BINLOG_REFRESH == 0;
+    if (refresh)
+      printf("\r");
+    if (n == 1 && refresh) {
+      printf("%9.4f " RED "%9.3f %9.3f %9.3f %9.3f " GRN
+             "%9.3f %9.3f %9.3f %9.3f " BLU "%9.3f %9.3f %9.3f %9.3f" YEL
+             " %9.3f" CRESET " %c",
+             s0.t, s0.torque[0], s0.setpoint[0], s0.position[0], s0.speed[0],
+             s0.torque[1], s0.setpoint[1], s0.position[1], s0.speed[1],
+             s0.torque[2], s0.setpoint[2], s0.position[2], s0.speed[2],
+             s0.delta, s0.rapid ? 'R' : 'I');
+    }
+    if (logfile && s0.program_run) {
       fprintf(logfile,
               "%f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f "
               "%9.3f %9.3f %9.3f %c\n",
-              axis_time(ax), axis_torque(ax), sx, x, axis_speed(ax),
-              axis_torque(ay), sy, y, axis_speed(ay), axis_torque(az), sz, z,
-              axis_speed(az), delta, sim->rapid ? 'R' : 'I');
+              s0.t, s0.torque[0], s0.setpoint[0], s0.position[0], s0.speed[0],
+              s0.torque[1], s0.setpoint[1], s0.position[1], s0.speed[1],
+              s0.torque[2], s0.setpoint[2], s0.position[2], s0.speed[2],
+              s0.delta, s0.rapid ? 'R' : 'I');
+    }
+    if (binlog && s0.program_run) {
+      data_t record[] = {
+          s0.t,           s0.torque[0],   s0.setpoint[0], s0.position[0],
+          s0.speed[0],    s0.torque[1],   s0.setpoint[1], s0.position[1],
+          s0.speed[1],    s0.torque[2],   s0.setpoint[2], s0.position[2],
+          s0.speed[2],    s0.delta,       s0.rapid};
+      binlog_write(binlog, record);
     }
-    fflush(stdout);
-    if (sim->program_run) {
-      sprintf(payload, "%f", delta);
-      mosquitto_publish(sim->mqtt, NULL, sim->pub_topic_err, strlen(payload),
+    // publish the status of every running machine
+    delta = 0;
+    active = 0;
+    for (i = 0; i < fleet->n; i++) {
+      sim_t *s = fleet->sims[i];
+      dbuf_read(&s->status_seq, s->status, sizeof(status_t), &st);
+      if (!st.program_run)
+        continue;
+      active++;
+      delta = fmax(delta, st.delta);
+      snprintf(payload, BUFLEN, "%f", st.delta);
+      mosquitto_publish(mqtt, NULL, s->pub_topic_err, strlen(payload),
                         payload, 0, 0);
-      sprintf(payload, "%f,%f,%f", x, y, z);
-      mosquitto_publish(sim->mqtt, NULL, sim->pub_topic_pos, strlen(payload),
+      snprintf(payload, BUFLEN, "%f,%f,%f", st.position[0], st.position[1],
+               st.position[2]);
+      mosquitto_publish(mqtt, NULL, s->pub_topic_pos, strlen(payload),
                         payload, 0, 0);
     }
-    mosquitto_loop(mqtt, -1, 1);
-    usleep(sim->dt * 10);
+    if (n > 1 && refresh) {
+      printf("%9.4f active: %4zu/%zu max d: " YEL "%9.3f" CRESET, s0.t,
+             active, fleet->n, delta);
+    }
+    if (refresh)
+      fflush(stdout);
+    mosquitto_loop(mqtt, 0, (int)fleet->n * 2);
+    usleep(fleet->dt * 10);
   }
 
   printf("\n\nExiting...\n");
   // Finalize
-  if (logfile) fclose(logfile);
-  axis_stop(ax);
-  axis_stop(ay);
-  axis_stop(az);
-  usleep(500000);
-  axis_free(ax);
-  axis_free(ay);
-  axis_free(az);
-  mosquitto_destroy(sim->mqtt);
+  for (i = 0; i < fleet->n_workers; i++)
+    simloop_stop(fleet->workers[i].loop);
+  fleet_report(fleet);
+  if (logfile)
+    fclose(logfile);
+  if (binlog)
+    binlog_free(binlog);
+  mosquitto_destroy(mqtt);
+  fleet_free(fleet);
   mosquitto_lib_cleanup();
-  free(sim);
   printf("done.\n");
   return 0;
 }
@@ -37,6 +37,14 @@ void point_free(point_t *p) {
   free(p);
 }
 
+point_t *point_new_at(void *mem) {
+  assert(mem);
+  memset(mem, 0, sizeof(point_t));
+  return (point_t *)mem;
+}
+
+size_t point_size(void) { return sizeof(point_t); }
+
 #define FIELD_SIZE 8
 #define FORMAT "[" RED "%s " GRN "%s " BLU "%s" CRESET "]"
 void point_inspect(point_t const *p, char **desc) {
@@ -34,6 +34,10 @@ typedef struct point point_t;
 // LIFECYCLE (instance creation/destruction) ===================================
 point_t *point_new();
 void point_free(point_t *p);
+// Same as point_new(), in the memory at mem (point_size() bytes, aligned as
+// a data_t) owned by the caller: the point is not to be freed on its own
+point_t *point_new_at(void *mem);
+size_t point_size(void);
 void point_inspect(point_t const *p, char **desc);
 
 // ACCESSORS (getting/setting object fields) ===================================
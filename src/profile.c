@@ -0,0 +1,753 @@
+//   ____             __ _ _
+//  |  _ \ _ __ ___  / _(_) | ___
+//  | |_) | '__/ _ \| |_| | |/ _ \
+//  |  __/| | | (_) |  _| | |  __/
+//  |_|   |_|  \___/|_| |_|_|\___|
+
+#include "profile.h"
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+//   ____            _                 _   _
+//  |  _ \  ___  ___| | __ _ _ __ __ _| |_(_) ___  _ __  ___
+//  | | | |/ _ \/ __| |/ _` | '__/ _` | __| |/ _ \| '_ \/ __|
+//  | |_| |  __/ (__| | (_| | | | (_| | |_| | (_) | | | \__ \
+//  |____/ \___|\___|_|\__,_|_|  \__,_|\__|_|\___/|_| |_|___/
+
+// Iterations of the bisection searches (the interval shrinks by 2^-60)
+#define BISECT_ITER 60
+
+// Universal time-optimal ramp on a circle: with a_t^2 + (v^2/R)^2 = A^2,
+// u = v / sqrt(A R) and tau = t sqrt(A / R), the speed obeys
+// du/dtau = sqrt(1 - u^4) (u is the lemniscate sine of tau) regardless of R
+// and A, and the distance is R S(tau) with dS/dtau = u. u and S are
+// tabulated once, on a uniform tau grid up to u = 1
+#define ARC_TAB_N 1024
+#define ARC_TAB_SUB 16                  // RK4 steps per table interval
+#define ARC_TAU_MAX 1.31102877714605990 // half the lemniscate constant
+
+// A speed ramp from v0 to v1: jerk phase (tj), constant acceleration phase
+// (ta), jerk phase (tj) with opposite jerk. With J = 0, tj is 0.
+// On a curve (R > 0), the ramp follows the tabulated curve instead, and the
+// scales of the curve take the place of the phases
+typedef struct {
+  data_t v0, v1; // initial and final feed
+  data_t dt, l;  // ramp duration and length
+  data_t R;      // radius of curvature (0: straight path)
+  union {
+    struct {
+      data_t j, a;   // signed jerk and signed peak acceleration
+      data_t tj, ta; // durations of a jerk phase and of the constant acc phase
+    };
+    struct {
+      data_t st, sv; // time and speed scales: sqrt(R / A) and sqrt(A R)
+      data_t tau0;   // normalized time of v0 on the tabulated curve
+      data_t S0;     // normalized distance at tau0
+    };
+  };
+} ramp_t;
+
+typedef struct profile {
+  data_t fs, f, fe; // initial, cruise and final feed
+  data_t l;         // length
+  ramp_t r1, r2;    // ramps fs -> f and f -> fe
+  data_t dt_m;      // cruise duration
+  data_t dt;        // total duration (possibly quantized)
+  unsigned refs;    // owners of the profile (see profile_share())
+} profile_t;
+
+static data_t arc_u[ARC_TAB_N + 1], arc_S[ARC_TAB_N + 1];
+static pthread_once_t arc_once = PTHREAD_ONCE_INIT;
+
+static void ramp_plan(ramp_t *r, data_t v0, data_t v1, data_t A, data_t J,
+                      data_t R);
+static data_t ramp_eval(ramp_t const *r, data_t t, data_t *v);
+static void arc_table_init(void);
+static data_t arc_eval(data_t tau, data_t *u);
+static data_t arc_tau(data_t u);
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+profile_t *profile_new(void) {
+  profile_t *p = malloc(sizeof(*p));
+  if (!p) {
+    eprintf("Could not allocate memory for profile\n");
+    return NULL;
+  }
+  memset(p, 0, sizeof(*p));
+  p->refs = 1;
+  return p;
+}
+
+void profile_free(profile_t *p) {
+  assert(p && p->refs > 0);
+  if (--p->refs == 0)
+    free(p);
+}
+
+profile_t *profile_share(profile_t *p) {
+  assert(p);
+  p->refs++;
+  return p;
+}
+
+profile_t *profile_copy(profile_t const *p) {
+  assert(p);
+  profile_t *q = profile_new();
+  if (!q)
+    return NULL;
+  memcpy(q, p, sizeof(*q));
+  q->refs = 1;
+  return q;
+}
+
+// Accessors ===================================================================
+#define profile_getter(typ, par)                                               \
+  typ profile_##par(profile_t const *p) {                                      \
+    assert(p);                                                                 \
+    return p->par;                                                             \
+  }
+
+profile_getter(data_t, dt);
+profile_getter(data_t, l);
+profile_getter(data_t, fs);
+profile_getter(data_t, f);
+profile_getter(data_t, fe);
+profile_getter(data_t, dt_m);
+
+int profile_shared(profile_t const *p) {
+  assert(p);
+  return p->refs > 1;
+}
+
+// Methods =====================================================================
+
+// Length of the two ramps when cruising at f (also plans them)
+static data_t shape(profile_t *p, data_t f, data_t A, data_t J, data_t R) {
+  ramp_plan(&p->r1, p->fs, f, A, J, R);
+  ramp_plan(&p->r2, f, p->fe, A, J, R);
+  return p->r1.l + p->r2.l;
+}
+
+// Total duration when cruising at f (infinite if f is 0)
+static data_t duration(profile_t *p, data_t f, data_t A, data_t J,
+                       data_t R) {
+  data_t s = shape(p, f, A, J, R);
+  return p->r1.dt + p->r2.dt + (p->l - s) / f;
+}
+
+static data_t quantize(data_t t, data_t tq) {
+  return ((size_t)(t / tq) + 1) * tq;
+}
+
+int profile_compute(profile_t *p, data_t l, data_t fs, data_t f, data_t fe,
+                    data_t A, data_t J, data_t R, data_t tq) {
+  assert(p);
+  data_t lo, hi, mid, tgt = 0;
+  ramp_t r;
+  size_t k;
+  unsigned refs;
+  int rv = 0;
+  if (f <= 0 || A <= 0) {
+    eprintf("Invalid profile: feedrate %f, acceleration %f\n", f, A);
+    return -1;
+  }
+  // on a curve, the centripetal acceleration alone caps the feed
+  if (R > 0) {
+    pthread_once(&arc_once, arc_table_init);
+    f = fmin(f, sqrt(A * R));
+    fs = fmin(fs, sqrt(A * R));
+    fe = fmin(fe, sqrt(A * R));
+  }
+  refs = p->refs;
+  memset(p, 0, sizeof(*p));
+  p->refs = refs;
+  p->l = l;
+  p->fs = fs;
+  p->fe = fe;
+
+  // 1. the direct ramp fs -> fe must fit within l, otherwise fe is moved
+  //    toward fs until it does
+  ramp_plan(&r, fs, fe, A, J, R);
+  if (r.l > l) {
+    lo = fs;
+    hi = fe;
+    for (k = 0; k < BISECT_ITER; k++) {
+      mid = (lo + hi) / 2.0;
+      ramp_plan(&r, fs, mid, A, J, R);
+      if (r.l > l)
+        hi = mid;
+      else
+        lo = mid;
+    }
+    p->fe = fe = lo;
+    rv = 1;
+  }
+
+  // 2. highest cruise feed not exceeding f whose ramps fit within l; any
+  //    cruise feed down to min(fs, fe) fits, after step 1
+  if (shape(p, f, A, J, R) > l) {
+    lo = fmin(fs, fe);
+    hi = f;
+    for (k = 0; k < BISECT_ITER; k++) {
+      mid = (lo + hi) / 2.0;
+      if (shape(p, mid, A, J, R) > l)
+        hi = mid;
+      else
+        lo = mid;
+    }
+    f = lo;
+  }
+
+  // 3. quantization: the duration decreases with the cruise feed, so the
+  //    feed giving a duration equal to the rounded up one is found by
+  //    bisection between the lowest feasible cruise feed and f. When fs or
+  //    fe are not null, the lowest feasible cruise feed is not 0 and the
+  //    rounded up duration may not be reachable: the profile is then left
+  //    unquantized
+  if (tq > 0 && l > 0) {
+    tgt = quantize(duration(p, f, A, J, R), tq);
+    lo = 0;
+    hi = fmin(fs, fe);
+    if (hi > 0 && shape(p, 0, A, J, R) > l) { // lowest feasible cruise feed
+      for (k = 0; k < BISECT_ITER; k++) {
+        mid = (lo + hi) / 2.0;
+        if (shape(p, mid, A, J, R) > l)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      lo = hi;
+    }
+    if (duration(p, lo > 0 ? lo : f * 1E-9, A, J, R) >= tgt) {
+      hi = f;
+      for (k = 0; k < BISECT_ITER; k++) {
+        mid = (lo + hi) / 2.0;
+        if (duration(p, mid, A, J, R) > tgt)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      f = hi;
+    } else {
+      tgt = 0;
+    }
+  }
+
+  // 4. final shape
+  p->f = f;
+  if (l > 0) {
+    p->dt_m = fmax(0, (l - shape(p, f, A, J, R)) / f);
+    p->dt = p->r1.dt + p->dt_m + p->r2.dt;
+    if (tgt > 0)
+      p->dt = tgt;
+  } else {
+    p->dt = tq > 0 ? quantize(0, tq) : 0;
+  }
+  return rv;
+}
+
+data_t profile_eval(profile_t const *p, data_t t, data_t *v) {
+  assert(p && v);
+  data_t s;
+  if (t <= 0) {
+    *v = p->fs;
+    return 0;
+  }
+  if (t < p->r1.dt)
+    return ramp_eval(&p->r1, t, v);
+  t -= p->r1.dt;
+  if (t < p->dt_m) {
+    *v = p->f;
+    return p->r1.l + p->f * t;
+  }
+  t -= p->dt_m;
+  if (t < p->r2.dt) {
+    s = ramp_eval(&p->r2, t, v);
+    return p->l - p->r2.l + s;
+  }
+  *v = p->fe;
+  return p->l;
+}
+
+// Ramps are symmetric in v0 and v1, so the same search serves accelerating
+// and decelerating ramps
+data_t profile_reach(data_t l, data_t v0, data_t f, data_t A, data_t J,
+                     data_t R) {
+  data_t lo, hi, mid;
+  ramp_t r;
+  size_t k;
+  if (R > 0) {
+    pthread_once(&arc_once, arc_table_init);
+    f = fmin(f, sqrt(A * R));
+    v0 = fmin(v0, sqrt(A * R));
+  }
+  if (f <= v0)
+    return f;
+  ramp_plan(&r, v0, f, A, J, R);
+  if (r.l <= l)
+    return f;
+  lo = v0;
+  hi = f;
+  for (k = 0; k < BISECT_ITER; k++) {
+    mid = (lo + hi) / 2.0;
+    ramp_plan(&r, v0, mid, A, J, R);
+    if (r.l > l)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  return lo;
+}
+
+data_t profile_stop(data_t v0, data_t A, data_t J, data_t R) {
+  ramp_t r;
+  if (R > 0) {
+    pthread_once(&arc_once, arc_table_init);
+    v0 = fmin(v0, sqrt(A * R));
+  }
+  ramp_plan(&r, v0, 0, A, J, R);
+  return r.l;
+}
+
+// Branch-free helpers: unlike fmin(), fmax() and floor(), these map to
+// single vector instructions (no NaN handling; x in [0, 2^52) for
+// floor_pos())
+static inline data_t min_d(data_t a, data_t b) { return a < b ? a : b; }
+static inline data_t max_d(data_t a, data_t b) { return a > b ? a : b; }
+static inline data_t floor_pos(data_t x) {
+  data_t r = (x + 0x1p52) - 0x1p52; // rounded to nearest
+  return r > x ? r - 1 : r;
+}
+
+// Closed forms of profile_compute() with J = 0 and R = 0, branch-free so
+// that the loop vectorizes (sqrt() too, with -fno-math-errno). With the
+// final feed e reachable, the peak feed of a triangle is
+// sqrt(A l + (fs^2 + e^2) / 2). For quantization, the cruise feed v giving
+// a duration T is one of three candidates, depending on where v falls with
+// respect to fs and e (the duration decreases with v, so at most one is
+// consistent):
+// - above both: lower root of v^2 - (A T + fs + e) v + A l + (fs^2+e^2)/2
+// - between: (l - |fs^2 - e^2| / 2A) / (T - |fs - e| / A)
+// - below both: upper root of v^2 + (A T - fs - e) v - A l + (fs^2+e^2)/2
+void profile_trapezoids(size_t n, data_t const *restrict l,
+                        data_t const *restrict fs, data_t *restrict f,
+                        data_t *restrict fe, data_t *restrict dt, data_t A,
+                        data_t tq) {
+  int quantized = tq > 0;
+  data_t h = quantized ? tq : 1.0, ih = 1 / h, ia = 1 / A;
+  size_t i;
+  for (i = 0; i < n; i++) {
+    data_t s2 = fs[i] * fs[i], al = A * l[i];
+    data_t e = min_d(max_d(fe[i], sqrt(max_d(0, s2 - 2 * al))),
+                     sqrt(s2 + 2 * al));
+    data_t e2 = e * e, hi = max_d(fs[i], e), lo = min_d(fs[i], e);
+    data_t v = min_d(f[i], sqrt(al + (s2 + e2) / 2));
+    data_t dm = max_d(0, (l[i] - (v * v - (s2 + e2) / 2) * ia) / v);
+    data_t t = (2 * v - fs[i] - e) * ia + dm;
+    data_t T = (floor_pos(t * ih) + 1) * h;
+    data_t b1 = A * T + fs[i] + e, d1 = b1 * b1 - 4 * (al + (s2 + e2) / 2);
+    data_t v1 = (b1 - sqrt(max_d(0, d1))) / 2;
+    data_t v2 = (l[i] - (hi * hi - lo * lo) * ia / 2) / (T - (hi - lo) * ia);
+    data_t b3 = A * T - fs[i] - e, d3 = b3 * b3 + 4 * (al - (s2 + e2) / 2);
+    data_t v3 = (-b3 + sqrt(max_d(0, d3))) / 2;
+    int q1 = (d1 >= 0) & (v1 >= hi);
+    int q2 = (v2 >= lo) & (v2 < hi);
+    int q3 = (d3 >= 0) & (v3 > 0) & (v3 < lo);
+    data_t vq = q1 ? v1 : (q2 ? v2 : v3);
+    int q = quantized & (q1 | q2 | q3);
+    f[i] = q ? vq : v;
+    fe[i] = e;
+    dt[i] = q ? T : t;
+  }
+}
+
+void profile_set_trapezoid(profile_t *p, data_t l, data_t fs, data_t f,
+                           data_t fe, data_t A, data_t dt) {
+  assert(p);
+  unsigned refs = p->refs;
+  memset(p, 0, sizeof(*p));
+  p->refs = refs;
+  p->l = l;
+  p->fs = fs;
+  p->f = f;
+  p->fe = fe;
+  ramp_plan(&p->r1, fs, f, A, 0, 0);
+  ramp_plan(&p->r2, f, fe, A, 0, 0);
+  p->dt_m = fmax(0, (l - p->r1.l - p->r2.l) / f);
+  p->dt = dt;
+}
+
+//   ____  _        _   _         __                  _   _
+//  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
+//  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//   ___) | || (_| | |_| | (__  |  _| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// If the speed change is too small for reaching A, the acceleration peaks
+// at J * tj with no constant acceleration phase
+static void ramp_plan(ramp_t *r, data_t v0, data_t v1, data_t A, data_t J,
+                      data_t R) {
+  data_t dv = fabs(v1 - v0);
+  data_t sgn = v1 >= v0 ? 1.0 : -1.0;
+  data_t tau1, u;
+  r->v0 = v0;
+  r->v1 = v1;
+  r->R = R;
+  if (R > 0) { // a decelerating ramp runs the tabulated curve backward
+    r->st = sqrt(R / A);
+    r->sv = sqrt(A * R);
+    r->tau0 = arc_tau(v0 / r->sv);
+    r->S0 = arc_eval(r->tau0, &u);
+    tau1 = arc_tau(v1 / r->sv);
+    r->dt = fabs(tau1 - r->tau0) * r->st;
+    r->l = R * fabs(arc_eval(tau1, &u) - r->S0);
+    return;
+  }
+  if (J <= 0) {
+    r->tj = 0;
+    r->ta = dv / A;
+    r->j = 0;
+    r->a = sgn * A;
+  } else if (dv > A * A / J) {
+    r->tj = A / J;
+    r->ta = dv / A - r->tj;
+    r->j = sgn * J;
+    r->a = sgn * A;
+  } else {
+    r->tj = sqrt(dv / J);
+    r->ta = 0;
+    r->j = sgn * J;
+    r->a = sgn * J * r->tj;
+  }
+  r->dt = 2 * r->tj + r->ta;
+  // the ramp is symmetric: the mean feed is the mean of the end feeds
+  r->l = (v0 + v1) / 2.0 * r->dt;
+}
+
+// Closed form; the last jerk phase is evaluated backward from the ramp end
+static data_t ramp_eval(ramp_t const *r, data_t t, data_t *v) {
+  data_t u, v1, s1, sgn;
+  if (r->R > 0) {
+    if (t >= r->dt) {
+      *v = r->v1;
+      return r->l;
+    }
+    sgn = r->v1 >= r->v0 ? 1.0 : -1.0;
+    s1 = arc_eval(r->tau0 + sgn * t / r->st, &u);
+    *v = u * r->sv;
+    return sgn * r->R * (s1 - r->S0);
+  }
+  if (t < r->tj) {
+    *v = r->v0 + r->j * t * t / 2.0;
+    return r->v0 * t + r->j * t * t * t / 6.0;
+  } else if (t < r->tj + r->ta) {
+    v1 = r->v0 + r->j * r->tj * r->tj / 2.0;
+    s1 = r->v0 * r->tj + r->j * r->tj * r->tj * r->tj / 6.0;
+    u = t - r->tj;
+    *v = v1 + r->a * u;
+    return s1 + v1 * u + r->a * u * u / 2.0;
+  } else if (t < r->dt) {
+    u = r->dt - t;
+    *v = r->v1 - r->j * u * u / 2.0;
+    return r->l - (r->v1 * u - r->j * u * u * u / 6.0);
+  }
+  *v = r->v1;
+  return r->l;
+}
+
+static void arc_deriv(data_t u, data_t *du, data_t *dS) {
+  *du = sqrt(fmax(0, 1 - u * u * u * u));
+  *dS = u;
+}
+
+// RK4 integration of (u, S) from rest
+static void arc_table_init(void) {
+  data_t h = ARC_TAU_MAX / ARC_TAB_N / ARC_TAB_SUB;
+  data_t u = 0, S = 0, ku[4], kS[4];
+  size_t i, k;
+  arc_u[0] = arc_S[0] = 0;
+  for (i = 1; i <= ARC_TAB_N; i++) {
+    for (k = 0; k < ARC_TAB_SUB; k++) {
+      arc_deriv(u, &ku[0], &kS[0]);
+      arc_deriv(fmin(1, u + h / 2 * ku[0]), &ku[1], &kS[1]);
+      arc_deriv(fmin(1, u + h / 2 * ku[1]), &ku[2], &kS[2]);
+      arc_deriv(fmin(1, u + h * ku[2]), &ku[3], &kS[3]);
+      u = fmin(1, u + h / 6 * (ku[0] + 2 * ku[1] + 2 * ku[2] + ku[3]));
+      S += h / 6 * (kS[0] + 2 * kS[1] + 2 * kS[2] + kS[3]);
+    }
+    arc_u[i] = u;
+    arc_S[i] = S;
+  }
+  arc_u[ARC_TAB_N] = 1;
+}
+
+// Cubic Hermite interpolation of the table (the derivatives are known);
+// beyond ARC_TAU_MAX the speed stays at u = 1
+static data_t arc_eval(data_t tau, data_t *u) {
+  data_t h = ARC_TAU_MAX / ARC_TAB_N, x, x2, x3, h00, h10, h01, h11, d0, d1;
+  size_t k;
+  if (tau >= ARC_TAU_MAX) {
+    *u = 1;
+    return arc_S[ARC_TAB_N] + (tau - ARC_TAU_MAX);
+  }
+  if (tau <= 0) {
+    *u = 0;
+    return 0;
+  }
+  k = (size_t)(tau / h);
+  x = tau / h - k;
+  x2 = x * x;
+  x3 = x2 * x;
+  h00 = 2 * x3 - 3 * x2 + 1;
+  h10 = x3 - 2 * x2 + x;
+  h01 = -2 * x3 + 3 * x2;
+  h11 = x3 - x2;
+  arc_deriv(arc_u[k], &d0, &x);
+  arc_deriv(arc_u[k + 1], &d1, &x);
+  *u = h00 * arc_u[k] + h10 * h * d0 + h01 * arc_u[k + 1] + h11 * h * d1;
+  return h00 * arc_S[k] + h10 * h * arc_u[k] + h01 * arc_S[k + 1] +
+         h11 * h * arc_u[k + 1];
+}
+
+// Inverse: normalized time at which the speed is u (bisection on the table,
+// then Newton steps on the interpolant)
+static data_t arc_tau(data_t u) {
+  data_t h = ARC_TAU_MAX / ARC_TAB_N, tau, ut, du, dS;
+  size_t lo = 0, hi = ARC_TAB_N, mid, k;
+  if (u <= 0)
+    return 0;
+  if (u >= 1)
+    return ARC_TAU_MAX;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (arc_u[mid] > u)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  tau = h * (lo + (u - arc_u[lo]) / (arc_u[hi] - arc_u[lo]));
+  for (k = 0; k < 3; k++) {
+    arc_eval(tau, &ut);
+    arc_deriv(ut, &du, &dS);
+    if (du < 1E-6)
+      break;
+    tau = fmin(fmax(tau - (ut - u) / du, h * lo), h * hi);
+  }
+  return tau;
+}
+
+//   _____         _
+//  |_   _|__  ___| |_
+//    | |/ _ \/ __| __|
+//    | |  __/\__ \ |_
+//    |_|\___||___/\__|
+
+#ifdef PROFILE_MAIN
+#include <time.h>
+
+// Sample the profile and check continuity and limits by finite differences:
+// speed must be the derivative of distance, acceleration within A (total
+// acceleration, on a curve), jerk within J (when J > 0 on a straight path),
+// and the end must be reached at dt
+static int check(char const *name, data_t l, data_t fs, data_t f, data_t fe,
+                 data_t A, data_t J, data_t R, data_t tq) {
+  profile_t *p = profile_new();
+  data_t h = 1E-4, t, s, s_p, v, v_p, a, a_p = 0, j, max_a = 0, max_j = 0;
+  data_t max_dv = 0;
+  int rv = profile_compute(p, l, fs, f, fe, A, J, R, tq), err = 0;
+  if (rv < 0) {
+    profile_free(p);
+    return 1;
+  }
+  s_p = profile_eval(p, 0, &v_p);
+  for (t = h; t < p->dt + h / 2.0; t += h) {
+    s = profile_eval(p, t, &v);
+    a = (v - v_p) / h;
+    j = (a - a_p) / h;
+    max_dv = fmax(max_dv, fabs((s - s_p) / h - (v + v_p) / 2.0));
+    if (R > 0)
+      max_a = fmax(max_a, hypot(a, pow((v + v_p) / 2.0, 2) / R));
+    else
+      max_a = fmax(max_a, fabs(a));
+    if (t > 2 * h)
+      max_j = fmax(max_j, fabs(j));
+    s_p = s;
+    v_p = v;
+    a_p = a;
+  }
+  if (name)
+    printf("%-12s dt %8.4f f %8.3f fe %7.3f max |a| %8.3f max |j| %10.1f\n",
+           name, p->dt, p->f, p->fe, max_a, max_j);
+  else
+    name = "arc";
+  if (fabs(profile_eval(p, p->dt, &v) - l) > 1E-9 || fabs(v - p->fe) > 1E-9) {
+    eprintf("%s: end not reached\n", name);
+    err = 1;
+  }
+  if (max_dv > 1E-3 * f) {
+    eprintf("%s: speed is not the derivative of distance\n", name);
+    err = 1;
+  }
+  if (max_a > A * 1.001) {
+    eprintf("%s: acceleration exceeds A (%f)\n", name, max_a);
+    err = 1;
+  }
+  // jerk is a finite difference of a finite difference: generous margin
+  if (J > 0 && R == 0 && max_j > J * 1.05) {
+    eprintf("%s: jerk exceeds J\n", name);
+    err = 1;
+  }
+  if (tq > 0 && fabs(p->dt / tq - round(p->dt / tq)) > 1E-9) {
+    eprintf("%s: duration is not a multiple of tq\n", name);
+    err = 1;
+  }
+  if (tq > 0 && fabs(p->r1.dt + p->dt_m + p->r2.dt - p->dt) > 1E-9) {
+    eprintf("%s: quantization mismatch\n", name);
+    err = 1;
+  }
+  profile_free(p);
+  return err || rv;
+}
+
+// Batch kernel against profile_compute() on random trapezoids, then its
+// throughput on a million items
+static int batch_suite(data_t A, data_t tq) {
+  size_t n = 1000000, i, bad = 0;
+  data_t *l = malloc(n * sizeof(data_t)), *fs = malloc(n * sizeof(data_t));
+  data_t *f0 = malloc(n * sizeof(data_t)), *fe0 = malloc(n * sizeof(data_t));
+  data_t *f = malloc(n * sizeof(data_t)), *fe = malloc(n * sizeof(data_t));
+  data_t *dt = malloc(n * sizeof(data_t)), worst = 0, el, el_ref = 0, r, v;
+  struct timespec t0, t1;
+  profile_t *p = profile_new(), *q = profile_new();
+  int err = 0;
+  if (!l || !fs || !f0 || !fe0 || !f || !fe || !dt) {
+    err = 1;
+    goto end;
+  }
+  srand(1);
+  for (i = 0; i < n; i++) {
+    l[i] = 0.01 + 50.0 * rand() / RAND_MAX;
+    f[i] = f0[i] = 1 + 100.0 * rand() / RAND_MAX;
+    fs[i] = (i % 3) ? f0[i] * rand() / RAND_MAX : 0;
+    fe[i] = fe0[i] = (i % 5) ? f0[i] * rand() / RAND_MAX : 0;
+    dt[i] = 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  profile_trapezoids(n, l, fs, f, fe, dt, A, tq);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  el = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1E9;
+  // when the whole block is a ramp, the cruise feed is immaterial: compare
+  // the motion instead (duration, final feed, distance at half time)
+  for (i = 0; i < n; i += 100) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    profile_compute(p, l[i], fs[i], f0[i], fe0[i], A, 0, 0, tq);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    el_ref += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1E9;
+    profile_set_trapezoid(q, l[i], fs[i], f[i], fe[i], A, dt[i]);
+    r = fmax(fabs(p->dt - q->dt), fabs(p->fe - q->fe) / f0[i]);
+    r = fmax(r, fabs(profile_eval(p, p->dt / 2, &v) -
+                     profile_eval(q, p->dt / 2, &v)) / l[i]);
+    worst = fmax(worst, r);
+    bad += r > 1E-6;
+  }
+  printf("\nbatch: %zu trapezoids in %.3f ms (tq %g), %.1f times faster than "
+         "profile_compute(), worst mismatch %g on %zu samples\n",
+         n, el * 1E3, tq, el_ref * 100 / el, worst, n / 100);
+  if (bad) {
+    eprintf("batch kernel differs from profile_compute in %zu cases\n", bad);
+    err = 1;
+  }
+end:
+  free(l);
+  free(fs);
+  free(f0);
+  free(fe0);
+  free(f);
+  free(fe);
+  free(dt);
+  profile_free(p);
+  profile_free(q);
+  return err;
+}
+
+// Time-optimal arc profiles against the former heuristic: trapezoid with
+// A/2 and the feed capped at (3/4 A^2 r^2)^(1/4). Both are rest-to-rest
+static int arc_suite(data_t A, data_t tq) {
+  data_t radii[] = {1, 5, 20, 100, 500};
+  data_t feeds[] = {1000, 5000, 10000}; // mm/min
+  data_t angles[] = {M_PI / 2, 2 * M_PI};
+  data_t r, F, l, t_old, t_new, f_old, sum_old = 0, sum_new = 0;
+  size_t i, j, k;
+  int err = 0;
+  profile_t *p = profile_new();
+  printf("\n     r      F    angle    t_old    t_new  t_new/t_old\n");
+  for (i = 0; i < sizeof(radii) / sizeof(*radii); i++) {
+    for (j = 0; j < sizeof(feeds) / sizeof(*feeds); j++) {
+      for (k = 0; k < sizeof(angles) / sizeof(*angles); k++) {
+        r = radii[i];
+        F = feeds[j] / 60.0;
+        l = r * angles[k];
+        f_old = fmin(F, pow(3.0 / 4.0 * A * A * r * r, 0.25));
+        profile_compute(p, l, 0, f_old, 0, A / 2, 0, 0, tq);
+        t_old = p->dt;
+        err += check(NULL, l, 0, F, 0, A, 0, r, tq);
+        profile_compute(p, l, 0, F, 0, A, 0, r, tq);
+        t_new = p->dt;
+        printf("%6.1f %6.0f %8.3f %8.3f %8.3f %12.3f\n", r, F * 60,
+               angles[k], t_old, t_new, t_new / t_old);
+        // rounding to tq may cost one tick at most
+        if (t_new > t_old + tq * 1.001) {
+          eprintf("time-optimal arc slower than the heuristic\n");
+          err++;
+        }
+        sum_old += t_old;
+        sum_new += t_new;
+      }
+    }
+  }
+  printf("total: %.3f s -> %.3f s (%.1f%% shorter)\n", sum_old, sum_new,
+         100 * (1 - sum_new / sum_old));
+  profile_free(p);
+  return err;
+}
+
+int main() {
+  int err = 0;
+  // name, l, fs, f, fe, A, J, R, tq
+  err += check("trapezoid", 100, 0, 50, 0, 100, 0, 0, 0.005);
+  err += check("triangle", 5, 0, 50, 0, 100, 0, 0, 0.005);
+  err += check("s-curve", 100, 0, 50, 0, 100, 1000, 0, 0.005);
+  err += check("s-short", 5, 0, 50, 0, 100, 1000, 0, 0.005);
+  err += check("s-tiny", 0.01, 0, 50, 0, 100, 1000, 0, 0.005);
+  err += check("s-low-J", 100, 0, 50, 0, 100, 50, 0, 0.005);
+  err += check("fs-fe", 50, 20, 60, 10, 100, 1000, 0, 0.005);
+  err += check("no-quant", 50, 0, 60, 0, 100, 1000, 0, 0);
+  err += check("arc", 100, 0, 50, 0, 100, 0, 20, 0.005);
+  err += check("arc-fs-fe", 100, 30, 50, 10, 100, 0, 20, 0.005);
+  err += check("arc-short", 2, 0, 50, 0, 100, 0, 20, 0.005);
+  // fe unreachable: it must be lowered and reported
+  {
+    profile_t *p = profile_new();
+    data_t v;
+    if (profile_compute(p, 1, 0, 50, 50, 100, 1000, 0, 0.005) != 1 ||
+        fabs(profile_eval(p, p->dt, &v) - 1) > 1E-9 || p->fe >= 50) {
+      eprintf("unreachable fe: not handled\n");
+      err++;
+    }
+    printf("%-12s dt %8.4f f %8.3f fe %7.3f\n", "unreachable", p->dt, p->f,
+           p->fe);
+    profile_free(p);
+  }
+  err += arc_suite(100, 0.005);
+  err += batch_suite(100, 0.005);
+  err += batch_suite(100, 0);
+  return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,90 @@
+//   ____             __ _ _
+//  |  _ \ _ __ ___  / _(_) | ___
+//  | |_) | '__/ _ \| |_| | |/ _ \
+//  |  __/| | | (_) |  _| | |  __/
+//  |_|   |_|  \___/|_| |_|_|\___|
+// Feedrate profile along a path of given length
+// Up to seven phases: a speed ramp from the initial feed fs to the cruise
+// feed f, a cruise at constant f, a ramp from f to the final feed fe.
+// Each ramp is jerk-limited (jerk, constant acceleration, jerk) when J > 0,
+// or a plain constant acceleration ramp (trapezoidal profile) when J = 0.
+// On a curved path of radius R, ramps are time-optimal under a total
+// acceleration limit: a_t^2 + (v^2/R)^2 <= A^2
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "defines.h"
+
+//   _____
+//  |_   _|   _ _ __   ___  ___
+//    | || | | | '_ \ / _ \/ __|
+//    | || |_| | |_) |  __/\__ \
+//    |_| \__, | .__/ \___||___/
+//        |___/|_|
+
+// Opaque struct
+typedef struct profile profile_t;
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+profile_t *profile_new(void);
+// Profiles are reference counted: the memory is released by the last owner
+void profile_free(profile_t *p);
+// One more owner of p, which is returned
+profile_t *profile_share(profile_t *p);
+// A new profile equal to p, with a single owner
+profile_t *profile_copy(profile_t const *p);
+
+// Accessors ===================================================================
+data_t profile_dt(profile_t const *p); // total duration (s)
+data_t profile_l(profile_t const *p);  // length (mm)
+data_t profile_fs(profile_t const *p); // initial feed (mm/s)
+data_t profile_f(profile_t const *p);  // cruise feed (mm/s)
+data_t profile_fe(profile_t const *p); // final feed (mm/s)
+data_t profile_dt_m(profile_t const *p); // cruise duration (s)
+int profile_shared(profile_t const *p);  // 1 if it has more than one owner
+
+// Methods =====================================================================
+// Plan a profile of length l from feed fs to feed fe, with a cruise feed of
+// at most f (mm/s), acceleration A (mm/s^2) and jerk J (mm/s^3, 0 for a
+// trapezoidal profile). R is the radius of curvature (mm) of the path, 0 if
+// straight: when R > 0 all feeds are capped at sqrt(A R) and J is not used.
+// If tq > 0, the duration is rounded up to the next multiple of tq by
+// lowering the cruise feed.
+// Returns 0 on success, 1 if fe is not reachable within l: in that case fe
+// is moved to the nearest reachable value
+int profile_compute(profile_t *p, data_t l, data_t fs, data_t f, data_t fe,
+                    data_t A, data_t J, data_t R, data_t tq);
+
+// Highest feed, not exceeding f, reachable within length l when starting
+// from feed v0 (or, equivalently, from which v0 is reachable)
+data_t profile_reach(data_t l, data_t v0, data_t f, data_t A, data_t J,
+                     data_t R);
+
+// Batch of n straight trapezoidal profiles (J = 0, R = 0) sharing A and
+// tq, as a struct of arrays: same results as profile_compute() for each
+// item, without a profile object. Requires l[i] > 0 and f[i] > 0, not
+// below fs[i] nor fe[i]. On return, f holds the cruise feeds, fe the final feeds
+// (lowered where not reachable) and dt the durations
+void profile_trapezoids(size_t n, data_t const *restrict l,
+                        data_t const *restrict fs, data_t *restrict f,
+                        data_t *restrict fe, data_t *restrict dt, data_t A,
+                        data_t tq);
+
+// Store a trapezoidal profile computed by profile_trapezoids()
+void profile_set_trapezoid(profile_t *p, data_t l, data_t fs, data_t f,
+                           data_t fe, data_t A, data_t dt);
+
+// Shortest distance (mm) for stopping from feed v0
+data_t profile_stop(data_t v0, data_t A, data_t J, data_t R);
+
+// Distance (mm) and feed (*v, mm/s) at time t from the start
+data_t profile_eval(profile_t const *p, data_t t, data_t *v);
+
+#endif // PROFILE_H
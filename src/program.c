@@ -7,9 +7,40 @@
 
 #include "program.h"
 #include <assert.h>
+#include <ctype.h>
+#include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/param.h> // MIN()
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Changes are first looked for in chunks of this many bytes, then line by
+// line from the first changed chunk
+#define PROGRAM_CHUNK (1 << 16)
+
+// Statistics: programs shorter than twice this many blocks are processed
+// by the calling thread only
+#define STATS_CHUNK 65536
+#define STATS_MAX_THREADS 64
+
+// Deepest nesting of subprogram calls
+#define SUB_MAX_DEPTH 8
+
+// Box hierarchy: blocks per leaf, and tolerance (mm) on the limits
+#define TREE_LEAF 16
+#define TREE_TOL 1E-6
+// Offending blocks listed by program_validate()
+#define VALIDATE_MAX 16
 
 //   _____
 //  |_   _|   _ _ __   ___  ___
@@ -21,11 +52,70 @@
 // Object structure:
 typedef struct program {
   char *filename;                  // path to the G-code program file
-  FILE *file;                      // file pointer
+  machine_t const *machine;        // machine the blocks are parsed for
   block_t *first, *current, *last; // relevant blocks in the linked list
   size_t n;                        // total number of blocks inthe program
+  block_t **index;                 // blocks in program order
+  data_t *bk;                      // junction feeds of the backward pass
+  size_t *map;                     // hash of N words: position in index + 1
+  size_t map_size;                 // slots in map (power of 2, 0 if none)
+  int map_dirty;                   // map to be rebuilt before the next seek
+  uint64_t *hash;                  // hash of each line of the file
+  block_t **line_block;            // block parsed from each line
+  size_t n_lines, lines_size;      // lines in the file, allocated slots
+  uint64_t *chunk;                 // hash of each whole chunk of the file
+  size_t *chunk_line;              // line at the start of each chunk
+  size_t n_chunks;                 // whole chunks in the file
+  int watch;                       // inotify descriptor (-1: not watching)
+  uint64_t sub_hash;               // hash of the subprogram definitions
+  int comp;                        // some block has cutter compensation
+  data_t *tree;                    // box hierarchy, 6 values (lo, hi) a node
+  size_t tree_leaves;              // leaves in tree (power of 2, 0 if none)
+  size_t tree_from;                // first block whose box is out of date
+                                   // (SIZE_MAX: tree up to date)
+  size_t near_hint;                // block found by program_nearest()
 } program_t;
 
+// Subprogram definition (O-word up to M99) in the mapped file
+typedef struct {
+  long o;                   // program number
+  char const *from, *to;    // whole definition, skipped by the main program
+  char const *body, *end;   // lines between the O-word and M99
+  block_t **tmpl;           // blocks of the first instance (NULL: none yet)
+  size_t n_lines;           // lines in the body
+  int active;               // being expanded (calls cannot recurse)
+} sub_t;
+
+// Subprogram definitions of a program file, while it is loaded
+typedef struct {
+  sub_t *v;
+  size_t n;
+} subs_t;
+
+// Share of the statistics pass, one per thread
+typedef struct {
+  block_t *const *v;     // first block
+  size_t n;              // number of blocks
+  data_t fmax, A;        // rapid feed (mm/s) and acceleration
+  program_stats_t stats; // partial result
+} stats_job_t;
+
+static void program_clear(program_t *p);
+static int program_load(program_t *p, machine_t *machine, size_t *pos);
+static int program_line(program_t *p, subs_t *subs, char *line, int depth);
+static int program_cut(program_t *p, size_t k, size_t *pos);
+static int program_plan_from(program_t *p, size_t i0);
+static int program_index(program_t *p, size_t i0);
+static int program_map(program_t *p);
+static size_t program_find(program_t *p, size_t n);
+static int program_tree(program_t *p);
+static size_t tree_query(program_t *p, size_t k, data_t const lo[3],
+                         data_t const hi[3], int outside, size_t *v,
+                         size_t max, size_t count);
+static void tree_nearest(program_t *p, size_t k, data_t const x[3],
+                         size_t *best, data_t *lambda, data_t *dist);
+static void *stats_run(void *arg);
+
 //   _____                 _   _
 //  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
 //  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
@@ -47,25 +137,44 @@ program_t *program_new(char const *filename) {
   }
   // initialize fields
   p->filename = strdup(filename);
+  p->machine = NULL;
   p->first = NULL;
   p->last = NULL;
   p->current = NULL;
   p->n = 0;
+  p->index = NULL;
+  p->bk = NULL;
+  p->map = NULL;
+  p->map_size = 0;
+  p->map_dirty = 0;
+  p->hash = NULL;
+  p->line_block = NULL;
+  p->n_lines = p->lines_size = 0;
+  p->chunk = NULL;
+  p->chunk_line = NULL;
+  p->n_chunks = 0;
+  p->watch = -1;
+  p->sub_hash = 0;
+  p->comp = 0;
+  p->tree = NULL;
+  p->tree_leaves = p->tree_from = 0;
+  p->near_hint = 0;
   return p;
 }
 
 void program_free(program_t *p) {
   assert(p);
-  block_t *b, *tmp;
-  // free the linked list of blocks
-  if (p->n > 0) {
-    b = p->first;
-    do {
-      tmp = b;
-      b = block_next(b);
-      block_free(tmp);
-    } while (b);
-  }
+  program_clear(p);
+  if (p->watch >= 0)
+    close(p->watch);
+  free(p->index);
+  free(p->bk);
+  free(p->map);
+  free(p->hash);
+  free(p->line_block);
+  free(p->chunk);
+  free(p->chunk_line);
+  free(p->tree);
   free(p->filename);
   free(p);
 }
@@ -92,52 +201,170 @@ program_getter(block_t *, first, first);
 program_getter(block_t *, current, current);
 program_getter(block_t *, last, last);
 program_getter(size_t, n, length);
+program_getter(int, watch, watch_fd);
 
 // Processing ==================================================================
 
 // Loop over each block and parse it
 int program_parse(program_t *p, machine_t *machine) {
   assert(p && machine);
-  char *line = NULL;
-  ssize_t line_len = 0;
-  size_t n = 0;
-  block_t *b;
-  p->n = 0;
-
-  // open the g-code file
-  p->file = fopen(p->filename, "r");
-  if (!p->file) {
-    eprintf("Cannot open the file %s\n", p->filename);
+  size_t n0, pos;
+  long comp;
+  program_clear(p);
+  p->machine = machine;
+  if (program_load(p, machine, &pos) < 0)
     return -1;
-  }
-  // make a loop: for each line in the file, create a new block with it
-  p->n = 0;
-  while ((line_len = getline(&line, &n, p->file)) >= 0) {
-    // remove trailing newline \n replacing it with a string terminator \0
-    if (line[line_len - 1] == '\n') {
-      line[line_len - 1] = '\0';
-    }
-    // create a new block
-    if (!(b = block_new(line, p->last, machine))) {
-      eprintf("Error creating a block from line %s\n", line);
-      return -1;
-    }
-    // parse the block
-    if (block_parse(b)) {
-      eprintf("Error parsing the block %s\n", line);
+  program_reset(p);
+  if (p->comp) {
+    n0 = p->n;
+    if ((comp = program_compensate(p)) < 0) {
+      eprintf("Error in the cutter compensation\n");
       return -1;
     }
-    if (p->first == NULL) {
-      p->first = b;
+    fprintf(stderr, "Compensated %ld blocks, with %zu joins\n", comp,
+            p->n - n0);
+  }
+  if (machine_chord_tol(machine) > 0 && p->n > 0) {
+    n0 = p->n;
+    program_compress(p, machine_chord_tol(machine));
+    fprintf(stderr, "Compressed %zu blocks into %zu (reduction ratio %.2f)\n",
+            n0, p->n, (double)n0 / p->n);
+  }
+  if (machine_spline(machine) && p->n > 0) {
+    n0 = p->n;
+    program_spline(p, machine_max_error(machine));
+    fprintf(stderr, "Fitted %zu blocks with %zu (reduction ratio %.2f)\n", n0,
+            p->n, (double)n0 / p->n);
+  }
+  if (program_plan(p)) {
+    eprintf("Error planning the program\n");
+    return -1;
+  }
+  return p->n;
+}
+
+// Lines are compared by hash with the last parse: the blocks before the
+// first changed line are kept, the others parsed again. Compressed and
+// fitted blocks span several lines, and compensated ones depend on the
+// following ones, so that in those cases the whole program is parsed again
+int program_reload(program_t *p, machine_t *machine) {
+  assert(p && machine);
+  size_t pos;
+  int rv;
+  if (machine_chord_tol(machine) > 0 || machine_spline(machine) || p->comp)
+    return program_parse(p, machine);
+  program_reset(p);
+  p->machine = machine;
+  if ((rv = program_load(p, machine, &pos)) <= 0)
+    return rv;
+  if (p->comp) // turned on by the changed lines
+    return program_parse(p, machine);
+  if (program_plan_from(p, pos)) {
+    eprintf("Error planning the program\n");
+    return -1;
+  }
+  return p->n - pos;
+}
+
+int program_watch(program_t *p) {
+  assert(p);
+#ifdef __linux__
+  char *dir;
+  if (p->watch >= 0)
+    return p->watch;
+  // editors often save by renaming a new file over the old one: the
+  // directory is watched, rather than the file
+  if (!(dir = strdup(p->filename)))
+    return -1;
+  p->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (p->watch < 0 || inotify_add_watch(p->watch, dirname(dir),
+                                        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    eprintf("Could not watch the file %s\n", p->filename);
+    if (p->watch >= 0)
+      close(p->watch);
+    p->watch = -1;
+  }
+  free(dir);
+  return p->watch;
+#else
+  wprintf("Watching files is not supported on this platform\n");
+  return -1;
+#endif
+}
+
+int program_changed(program_t *p) {
+  assert(p);
+  int changed = 0;
+#ifdef __linux__
+  char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event const *ev;
+  char *name, *ptr;
+  ssize_t len;
+  if (p->watch < 0 || !(name = strdup(p->filename)))
+    return 0;
+  while ((len = read(p->watch, buf, sizeof(buf))) > 0) {
+    for (ptr = buf; ptr < buf + len; ptr += sizeof(*ev) + ev->len) {
+      ev = (struct inotify_event const *)ptr;
+      if (ev->len && strcmp(ev->name, basename(name)) == 0)
+        changed = 1;
     }
+  }
+  free(name);
+#endif
+  return changed;
+}
+
+// Each line absorbs the following ones while they fit a line or an arc
+size_t program_compress(program_t *p, data_t tol) {
+  assert(p);
+  block_t *b;
+  size_t removed = 0;
+  for (b = p->first; b; b = block_next(b)) {
+    removed += block_compress(b, p->machine, tol);
     p->last = b;
-    p->n++;
   }
-  // cleanup
-  fclose(p->file);
-  free(line);
-  program_reset(p);
-  return p->n;
+  p->n -= removed;
+  return removed;
+}
+
+// A single pass over the whole program (see block_compensate())
+long program_compensate(program_t *p) {
+  assert(p);
+  size_t joins = 0;
+  long rv;
+  if (!p->first)
+    return 0;
+  if ((rv = block_compensate(p->first, p->machine, &joins)) < 0)
+    return -1;
+  p->n += joins;
+  return rv;
+}
+
+// Each line starts a spline through the following ones, where they allow
+size_t program_spline(program_t *p, data_t tol) {
+  assert(p);
+  block_t *b;
+  size_t removed = 0;
+  for (b = p->first; b; b = block_next(b)) {
+    removed += block_spline(b, p->machine, tol);
+    p->last = b;
+  }
+  p->n -= removed;
+  return removed;
+}
+
+// Look-ahead over the whole program, in three passes:
+// 1. corners between G64 lines are replaced by blend curves
+// 2. backward: each junction feed is lowered until the following block can
+//    slow down from it to its own final feed
+// 3. forward: each junction feed is lowered until the block can speed up to
+//    it from its initial feed, and the profiles are recomputed
+// Programs in G61 mode (the default) have no junction feeds and keep the
+// rest-to-rest profiles computed by block_parse()
+int program_plan(program_t *p) {
+  assert(p);
+  return program_plan_from(p, 0);
 }
 
 // load the next block
@@ -156,6 +383,883 @@ void program_reset(program_t *p) {
   p->current = NULL;
 }
 
+// Random access ===============================================================
+
+block_t *program_block(program_t const *p, size_t i) {
+  assert(p);
+  return i < p->n && p->index ? p->index[i] : NULL;
+}
+
+block_t *program_seek(program_t *p, size_t n) {
+  assert(p);
+  size_t i = program_find(p, n);
+  if (i == p->n)
+    return NULL;
+  // program_next() loads the block after the current one
+  p->current = i > 0 ? p->index[i - 1] : NULL;
+  return p->index[i];
+}
+
+int program_resume(program_t *p, size_t n, point_t const *from) {
+  assert(p && from);
+  block_t *b, *prev, *a;
+  size_t i = 0;
+  if (n == 0) // the first block
+    program_reset(p);
+  b = n ? program_seek(p, n) : p->first;
+  prev = p->current;
+  if (!b) {
+    eprintf("No block N%zu in the program\n", n);
+    return 1;
+  }
+  if (n)
+    i = program_find(p, n);
+  if (!(a = block_approach(b, p->machine, from))) {
+    eprintf("Could not plan the approach to block N%zu\n", n);
+    return 1;
+  }
+  if (b == p->first)
+    p->first = a;
+  p->n += 3;
+  // junction feeds into b are gone: plan again from the approach (the index
+  // is rebuilt from there), then skip to it
+  if (p->index)
+    p->index[i] = a;
+  if (program_plan_from(p, i))
+    return 1;
+  p->current = prev;
+  return 0;
+}
+
+// Statistics ==================================================================
+
+int program_stats(program_t const *p, machine_t const *m,
+                  program_stats_t *stats) {
+  assert(p && m && stats);
+  stats_job_t jobs[STATS_MAX_THREADS];
+  pthread_t threads[STATS_MAX_THREADS];
+  int started[STATS_MAX_THREADS] = {0};
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t i, j, n_jobs;
+  int k;
+  memset(stats, 0, sizeof(*stats));
+  if (p->n == 0)
+    return 0;
+  if (!p->index) {
+    eprintf("Program must be parsed before computing its statistics\n");
+    return 1;
+  }
+  n_jobs = MIN(p->n / STATS_CHUNK, (size_t)MAX(cores, 1));
+  n_jobs = MAX(MIN(n_jobs, STATS_MAX_THREADS), 1);
+  for (j = 0, i = 0; j < n_jobs; j++) {
+    jobs[j].v = p->index + i;
+    jobs[j].n = p->n / n_jobs + (j < p->n % n_jobs);
+    jobs[j].fmax = machine_fmax(m) / 60.0;
+    jobs[j].A = machine_A(m);
+    i += jobs[j].n;
+  }
+  // the calling thread takes the first share; should a thread not start,
+  // its share is processed here as well
+  for (j = 1; j < n_jobs; j++)
+    started[j] = !pthread_create(&threads[j], NULL, stats_run, &jobs[j]);
+  stats_run(&jobs[0]);
+  *stats = jobs[0].stats;
+  for (j = 1; j < n_jobs; j++) {
+    if (started[j])
+      pthread_join(threads[j], NULL);
+    else
+      stats_run(&jobs[j]);
+    stats->n += jobs[j].stats.n;
+    stats->time += jobs[j].stats.time;
+    stats->cut_time += jobs[j].stats.cut_time;
+    stats->feed_time += jobs[j].stats.feed_time;
+    stats->rapid_dist += jobs[j].stats.rapid_dist;
+    stats->cut_dist += jobs[j].stats.cut_dist;
+    for (k = 0; k < 3; k++) {
+      stats->min[k] = MIN(stats->min[k], jobs[j].stats.min[k]);
+      stats->max[k] = MAX(stats->max[k], jobs[j].stats.max[k]);
+    }
+  }
+  return 0;
+}
+
+void program_stats_print(program_stats_t const *s, FILE *out) {
+  assert(s && out);
+  fprintf(out, "Blocks:          %zu\n", s->n);
+  fprintf(out, "Total time:      %.3f s\n", s->time);
+  fprintf(out, "Cutting time:    %.3f s (%.1f%% at programmed feed)\n",
+          s->cut_time, s->cut_time > 0 ? s->feed_time / s->cut_time * 100 : 0);
+  fprintf(out, "Rapid travel:    %.3f mm\n", s->rapid_dist);
+  fprintf(out, "Cutting travel:  %.3f mm\n", s->cut_dist);
+  fprintf(out, "Bounding box:    [%.3f, %.3f, %.3f] - [%.3f, %.3f, %.3f]\n",
+          s->min[0], s->min[1], s->min[2], s->max[0], s->max[1], s->max[2]);
+}
+
+// Workspace ===================================================================
+
+size_t program_outside(program_t *p, data_t const lo[3], data_t const hi[3],
+                       size_t *v, size_t max) {
+  assert(p && lo && hi && (v || max == 0));
+  if (p->n == 0 || !p->index || program_tree(p))
+    return 0;
+  return tree_query(p, 1, lo, hi, 1, v, max, 0);
+}
+
+size_t program_overlap(program_t *p, data_t const lo[3], data_t const hi[3],
+                       size_t *v, size_t max) {
+  assert(p && lo && hi && (v || max == 0));
+  if (p->n == 0 || !p->index || program_tree(p))
+    return 0;
+  return tree_query(p, 1, lo, hi, 0, v, max, 0);
+}
+
+size_t program_nearest(program_t *p, data_t const x[3], data_t *lambda,
+                       data_t *dist) {
+  assert(p && x);
+  size_t best = SIZE_MAX;
+  data_t l = 0, d = INFINITY;
+  if (p->n == 0 || !p->index || program_tree(p))
+    return SIZE_MAX;
+  // the last block found bounds the search from the start
+  if (p->near_hint < p->n) {
+    best = p->near_hint;
+    d = block_nearest(p->index[best], x, &l);
+  }
+  tree_nearest(p, 1, x, &best, &l, &d);
+  p->near_hint = best;
+  if (lambda)
+    *lambda = l;
+  if (dist)
+    *dist = d;
+  return best;
+}
+
+size_t program_validate(program_t *p, machine_t const *m) {
+  assert(p && m);
+  data_t lo[3], hi[3];
+  size_t v[VALIDATE_MAX], i, n, count;
+  machine_limits(m, lo, hi);
+  count = program_outside(p, lo, hi, v, VALIDATE_MAX);
+  if (count == 0)
+    return 0;
+  eprintf("%zu blocks exceed the travel [%.3f, %.3f, %.3f] - "
+          "[%.3f, %.3f, %.3f]:\n",
+          count, lo[0], lo[1], lo[2], hi[0], hi[1], hi[2]);
+  // blends carry the N of the block they start from: list each N once
+  for (i = 0, n = 0; i < MIN(count, VALIDATE_MAX); i++) {
+    if (i > 0 && block_n(p->index[v[i]]) == n)
+      continue;
+    n = block_n(p->index[v[i]]);
+    fprintf(stderr, "  %s\n", block_line(p->index[v[i]]));
+  }
+  if (count > VALIDATE_MAX)
+    fprintf(stderr, "  ...\n");
+  return count;
+}
+
+//   ____  _        _   _         __                  _   _
+//  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
+//  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//   ___) | || (_| | |_| | (__  |  _| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Fibonacci hashing of the block number into a table of 2^k slots
+static size_t slot(size_t n, size_t size) {
+  return (size_t)((n * 11400714819323198485ull) >> 32) & (size - 1);
+}
+
+// FNV-1a hash, on 8 bytes at a time
+static uint64_t text_hash(char const *text, size_t len) {
+  uint64_t h = 14695981039346656037ull, w;
+  size_t i;
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, text + i, 8);
+    h = (h ^ w) * 1099511628211ull;
+    h ^= h >> 32;
+  }
+  for (; i < len; i++)
+    h = (h ^ (unsigned char)text[i]) * 1099511628211ull;
+  return h;
+}
+
+// First non blank character of the line
+static char line_head(char const *s, char const *end) {
+  while (s < end && (*s == ' ' || *s == '\t'))
+    s++;
+  return s < end ? toupper(*s) : '\0';
+}
+
+// Number of the first word c in the line (case insensitive), -1 if missing
+static long line_word(char const *s, char const *end, char c) {
+  char const *w;
+  long v = 0;
+  for (w = s; w < end; w++) {
+    if (toupper(*w) == c && (w == s || w[-1] == ' ') && w + 1 < end &&
+        isdigit(w[1])) {
+      for (w++; w < end && isdigit(*w); w++)
+        v = v * 10 + (*w - '0');
+      return v;
+    }
+  }
+  return -1;
+}
+
+// End of the line starting at s (the newline, or end)
+static char const *line_end(char const *s, char const *end) {
+  char const *nl = memchr(s, '\n', end - s);
+  return nl ? nl : end;
+}
+
+// Subprograms are defined by an O-word line, and end with the first M99
+// line. An O-word line followed by M30 or M02 before any M99 is the header
+// of the main program instead. The hash of all the definitions is returned
+// in h
+static int program_subs(char const *data, size_t size, subs_t *subs,
+                        uint64_t *h) {
+  char const *s, *e, *t, *end = data + size;
+  sub_t *sub;
+  long m;
+  void *tmp;
+  size_t cap = 0;
+  *h = 0;
+  for (s = data; s < end; s = e + 1) {
+    e = line_end(s, end);
+    if (line_head(s, e) != 'O')
+      continue;
+    for (t = e + 1, m = -1; t < end; t = line_end(t, end) + 1) {
+      if (line_head(t, line_end(t, end)) == 'O')
+        break;
+      m = line_word(t, line_end(t, end), 'M');
+      if (m == 99 || m == 30 || m == 2)
+        break;
+    }
+    if (m != 99)
+      continue;
+    if (subs->n == cap) {
+      cap = MAX(2 * cap, 16);
+      if (!(tmp = realloc(subs->v, cap * sizeof(*subs->v)))) {
+        eprintf("Could not allocate memory for the subprograms\n");
+        return -1;
+      }
+      subs->v = tmp;
+    }
+    sub = subs->v + subs->n++;
+    memset(sub, 0, sizeof(*sub));
+    sub->o = line_word(s, e, 'O');
+    sub->from = s;
+    sub->body = MIN(e + 1, end);
+    sub->end = t;
+    sub->to = MIN(line_end(t, end) + 1, end);
+    for (t = sub->body; t < sub->end; t = line_end(t, end) + 1)
+      sub->n_lines++;
+    *h = (*h ^ text_hash(sub->from, sub->to - sub->from)) * 1099511628211ull;
+    e = sub->to - 1;
+  }
+  return 0;
+}
+
+// Expand reps instances of the subprogram o at the end of the program. The
+// blocks of the first instance are parsed; the following ones are built
+// from them (see block_instance())
+static int program_call(program_t *p, subs_t *subs, long o, long reps,
+                        int depth) {
+  sub_t *sub = NULL;
+  char *line = NULL;
+  char const *s, *e;
+  size_t i, j, n0;
+  long r;
+  int rv = -1;
+  block_t *b;
+  for (i = 0; i < subs->n && !sub; i++)
+    sub = subs->v[i].o == o ? subs->v + i : NULL;
+  if (!sub) {
+    eprintf("No subprogram O%ld\n", o);
+    return -1;
+  }
+  if (sub->active || depth >= SUB_MAX_DEPTH) {
+    eprintf("Subprogram O%ld calls itself or is nested too deep\n", o);
+    return -1;
+  }
+  if (!sub->tmpl && sub->n_lines > 0 &&
+      !(sub->tmpl = calloc(sub->n_lines, sizeof(*sub->tmpl))))
+    goto nomem;
+  if (!(line = malloc(sub->end - sub->body + 1)))
+    goto nomem;
+  sub->active = 1;
+  for (r = 0; r < reps; r++) {
+    for (s = sub->body, j = 0; s < sub->end; s = e + 1, j++) {
+      e = line_end(s, sub->end);
+      if (sub->tmpl[j]) {
+        if (!(b = block_instance(sub->tmpl[j], p->last, p->machine)))
+          goto end;
+        if (!p->first)
+          p->first = b;
+        p->last = b;
+        p->n++;
+        p->comp |= block_comp(b) != 0;
+        continue;
+      }
+      memcpy(line, s, e - s);
+      line[e - s] = '\0';
+      n0 = p->n;
+      if (program_line(p, subs, line, depth + 1))
+        goto end;
+      // plain lines, parsed once: later instances start from these blocks
+      if (p->n == n0 + 1 && line_word(s, e, 'M') != 98)
+        sub->tmpl[j] = p->last;
+    }
+  }
+  rv = 0;
+  goto end;
+nomem:
+  eprintf("Could not allocate memory for the subprogram O%ld\n", o);
+end:
+  sub->active = 0;
+  free(line);
+  return rv;
+}
+
+// Append the blocks of a line: subprogram calls (M98 Pn Lk: k times the
+// subprogram On) are expanded, and O-word, M99, M30 and M02 lines have no
+// block
+static int program_line(program_t *p, subs_t *subs, char *line, int depth) {
+  char *end = line + strlen(line);
+  long m = line_word(line, end, 'M'), reps;
+  block_t *b;
+  if (line_head(line, end) == 'O' || m == 99 || m == 30 || m == 2)
+    return 0;
+  if (m == 98) {
+    reps = line_word(line, end, 'L');
+    return program_call(p, subs, line_word(line, end, 'P'),
+                        reps < 0 ? 1 : reps, depth);
+  }
+  // create a new block
+  if (!(b = block_new(line, p->last, p->machine))) {
+    eprintf("Error creating a block from line %s\n", line);
+    return -1;
+  }
+  if (!p->first)
+    p->first = b;
+  p->last = b;
+  p->n++;
+  // parse the block
+  if (block_parse(b, p->machine)) {
+    eprintf("Error parsing the block %s\n", line);
+    return -1;
+  }
+  p->comp |= block_comp(b) != 0;
+  return 0;
+}
+
+// Free all the blocks and forget the lines
+static void program_clear(program_t *p) {
+  if (p->first) {
+    block_truncate(p->first);
+    block_free(p->first);
+  }
+  p->first = p->last = p->current = NULL;
+  p->n = p->n_lines = p->n_chunks = 0;
+  p->comp = 0;
+}
+
+// Read the file, skipping the lines equal to those of the last parse, and
+// parse the lines from the first changed one on. Whole chunks are compared
+// first, so that only the lines from the first changed chunk are hashed.
+// On return, pos is the position of the first block to be planned again.
+// Returns 1 if anything changed, 0 if not, -1 on error
+static int program_load(program_t *p, machine_t *machine, size_t *pos) {
+  char *data = NULL, *line = NULL, *nl, *end;
+  size_t size, c, n_chunks, i, d, len, line_size = 0;
+  struct stat st;
+  uint64_t h;
+  void *tmp;
+  subs_t subs = {.v = NULL, .n = 0};
+  int fd, rv = -1, changed = 0;
+
+  // map the g-code file
+  fd = open(p->filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) {
+    eprintf("Cannot open the file %s\n", p->filename);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  size = st.st_size;
+  if (size > 0 &&
+      (data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    eprintf("Cannot map the file %s\n", p->filename);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  *pos = p->n;
+
+  // 0. subprogram definitions: when they change, the calls are expanded
+  //    again from the start
+  if (program_subs(data, size, &subs, &h))
+    goto end;
+  if (h != p->sub_hash) {
+    if (program_cut(p, 0, pos))
+      goto end;
+    p->sub_hash = h;
+    changed = 1;
+  }
+
+  // 1. first changed chunk, and the line where it starts
+  n_chunks = size / PROGRAM_CHUNK;
+  for (c = 0; c < MIN(n_chunks, p->n_chunks); c++) {
+    if (text_hash(data + c * PROGRAM_CHUNK, PROGRAM_CHUNK) != p->chunk[c])
+      break;
+  }
+  if (c > 0 && c == p->n_chunks) // the line at the start of c is not known
+    c--;
+  i = c > 0 ? MIN(p->chunk_line[c], p->n_lines) : 0;
+  for (end = data + c * PROGRAM_CHUNK; end > data && end[-1] != '\n'; end--)
+    ;
+  if (!(tmp = realloc(p->chunk, MAX(n_chunks, 1) * sizeof(*p->chunk))))
+    goto nomem;
+  p->chunk = tmp;
+  if (!(tmp = realloc(p->chunk_line,
+                      MAX(n_chunks, 1) * sizeof(*p->chunk_line))))
+    goto nomem;
+  p->chunk_line = tmp;
+
+  // 2. for each line from there, create new blocks with it unless it is
+  //    equal to the last parse, up to the first changed line; definitions
+  //    of subprograms are skipped
+  for (d = 0; d < subs.n && subs.v[d].to <= end; d++)
+    ;
+  for (; end < data + size; end = nl + 1) {
+    nl = memchr(end, '\n', data + size - end);
+    if (!nl)
+      nl = data + size;
+    len = nl - end;
+    // the first line of each chunk
+    for (; c < n_chunks && (size_t)(nl - data) >= c * PROGRAM_CHUNK; c++) {
+      p->chunk[c] = text_hash(data + c * PROGRAM_CHUNK, PROGRAM_CHUNK);
+      p->chunk_line[c] = i;
+    }
+    h = text_hash(end, len);
+    if (!changed) {
+      if (i < p->n_lines && p->hash[i] == h) {
+        i++;
+        continue;
+      }
+      if (program_cut(p, i, pos))
+        goto end;
+      changed = 1;
+    }
+    if (i == p->lines_size) {
+      p->lines_size = MAX(2 * p->lines_size, 1024);
+      if (!(tmp = realloc(p->hash, p->lines_size * sizeof(*p->hash))))
+        goto nomem;
+      p->hash = tmp;
+      if (!(tmp = realloc(p->line_block,
+                          p->lines_size * sizeof(*p->line_block))))
+        goto nomem;
+      p->line_block = tmp;
+    }
+    if (len + 1 > line_size) {
+      line_size = len + 1;
+      if (!(tmp = realloc(line, line_size)))
+        goto nomem;
+      line = tmp;
+    }
+    memcpy(line, end, len);
+    line[len] = '\0';
+    for (; d < subs.n && subs.v[d].to <= end; d++)
+      ;
+    if ((d == subs.n || end < subs.v[d].from) &&
+        program_line(p, &subs, line, 0))
+      goto end;
+    p->hash[i] = h;
+    p->line_block[i++] = p->last;
+  }
+  // lines removed at the end
+  if (!changed && i < p->n_lines) {
+    if (program_cut(p, i, pos))
+      goto end;
+    changed = 1;
+  }
+  p->n_lines = i;
+  p->n_chunks = n_chunks;
+  rv = changed;
+  goto end;
+nomem:
+  eprintf("Could not allocate memory for the program lines\n");
+end:
+  // cleanup
+  if (rv < 0)
+    p->n_chunks = 0;
+  if (data)
+    munmap(data, size);
+  for (d = 0; d < subs.n; d++)
+    free(subs.v[d].tmpl);
+  free(subs.v);
+  free(line);
+  return rv;
+}
+
+// Drop the blocks parsed from line k on, and the blend ending the block of
+// line k - 1, whose end goes back to the corner. pos is the position of
+// that block, which must be planned again
+static int program_cut(program_t *p, size_t k, size_t *pos) {
+  block_t *b = k > 0 ? p->line_block[k - 1] : NULL;
+  size_t i = p->n;
+  p->n_lines = k;
+  if (!b) {
+    program_clear(p);
+    *pos = 0;
+    return 0;
+  }
+  // usually near the end
+  while (i > 0 && p->index[i - 1] != b)
+    i--;
+  if (i == 0 || block_unblend(b, p->machine) < 0) {
+    eprintf("Could not find the block of line %zu\n", k);
+    return 1;
+  }
+  block_truncate(b);
+  p->last = b;
+  p->n = i;
+  *pos = i - 1;
+  return 0;
+}
+
+// Look-ahead from block i0 on (the blocks before are planned already).
+// The backward pass goes beyond i0 as long as it changes the junction
+// feeds, and the profiles are recomputed from there
+static int program_plan_from(program_t *p, size_t i0) {
+  block_t *b, **v;
+  data_t *fj = NULL, fs, fe;
+  size_t i, k, lo, n_blends = 0;
+  int rv, smooth = 0;
+  if (p->n == 0)
+    return program_index(p, 0);
+
+  // 1. blends
+  b = i0 > 0 ? p->index[i0] : p->first;
+  for (; b; b = block_next(b)) {
+    if ((rv = block_blend(b, p->machine)) < 0)
+      return -1;
+    if (rv) {
+      b = block_next(b); // skip over the blend
+      if (!block_next(b))
+        p->last = b;
+      n_blends++;
+    }
+  }
+  p->n += n_blends;
+  if (program_index(p, i0))
+    return -1;
+  v = p->index;
+
+  // 2. backward pass; the last block always ends at rest
+  p->bk[p->n - 1] = 0;
+  for (k = p->n - 1; k > 0; k--) {
+    fe = block_junction(v[k - 1]);
+    smooth |= fe > 0;
+    fe = MIN(fe, block_reach(v[k], p->machine, p->bk[k]));
+    if (k - 1 < i0 && fe == p->bk[k - 1])
+      break;
+    p->bk[k - 1] = fe;
+  }
+  lo = k;
+  fs = lo > 0 ? block_fs(v[lo]) : 0;
+  if (!smooth && fs == 0) { // all rest-to-rest
+    for (i = lo, rv = 0; i < p->n; i++) {
+      if (block_fs(v[i]) > 0 || block_fe(v[i]) > 0)
+        rv |= block_plan(v[i], p->machine, 0, 0);
+    }
+    return rv ? -1 : 0;
+  }
+
+  // 3. forward pass, then all profiles at once
+  fj = malloc((p->n - lo) * sizeof(*fj));
+  if (!fj) {
+    eprintf("Could not allocate memory for planning\n");
+    return -1;
+  }
+  for (i = lo; i < p->n; i++)
+    fs = fj[i - lo] = MIN(p->bk[i], block_reach(v[i], p->machine, fs));
+  rv = block_plan_batch(v + lo, p->machine, fj, p->n - lo,
+                        lo > 0 ? block_fs(v[lo]) : 0);
+  free(fj);
+  return rv ? -1 : 0;
+}
+
+// Array of the blocks in program order, from position i0 on (the blocks
+// before are unchanged)
+static int program_index(program_t *p, size_t i0) {
+  block_t *b;
+  size_t i, size = MAX(p->n, 1);
+  void *tmp;
+  if (!(tmp = realloc(p->index, size * sizeof(*p->index))))
+    goto fail;
+  p->index = tmp;
+  if (!(tmp = realloc(p->bk, size * sizeof(*p->bk))))
+    goto fail;
+  p->bk = tmp;
+  b = i0 > 0 ? p->index[i0] : p->first;
+  for (i = i0; b && i < p->n; i++, b = block_next(b))
+    p->index[i] = b;
+  p->map_dirty = 1;
+  p->tree_from = MIN(p->tree_from, i0);
+  return 0;
+fail:
+  eprintf("Could not allocate memory for the block index\n");
+  return 1;
+}
+
+// Open addressing hash table (linear probing, at most half full) from N
+// word to position in the index. Blocks without an N word inherit the
+// number of the previous one, and blends that of the block they start
+// from: the first block with a given N wins
+static int program_map(program_t *p) {
+  size_t i, k, size = 16;
+  while (size < 2 * p->n)
+    size <<= 1;
+  free(p->map);
+  p->map = calloc(size, sizeof(*p->map));
+  if (!p->map) {
+    eprintf("Could not allocate memory for the block index\n");
+    p->map_size = 0;
+    return 1;
+  }
+  p->map_size = size;
+  for (i = 0; i < p->n; i++) {
+    for (k = slot(block_n(p->index[i]), size); p->map[k];
+         k = (k + 1) & (size - 1)) {
+      if (block_n(p->index[p->map[k] - 1]) == block_n(p->index[i]))
+        break;
+    }
+    if (!p->map[k])
+      p->map[k] = i + 1;
+  }
+  p->map_dirty = 0;
+  return 0;
+}
+
+// Rest-to-rest straight move of length l at feed f (mm/s), acceleration A
+static data_t rapid_dt(data_t l, data_t f, data_t A) {
+  if (l <= 0)
+    return 0;
+  if (l < f * f / A)
+    return 2 * sqrt(l / A);
+  return l / f + f / A;
+}
+
+static void *stats_run(void *arg) {
+  stats_job_t *job = (stats_job_t *)arg;
+  program_stats_t *s = &job->stats;
+  data_t lo[3], hi[3], dt;
+  size_t i;
+  int k;
+  block_t *b;
+  memset(s, 0, sizeof(*s));
+  for (k = 0; k < 3; k++) {
+    s->min[k] = INFINITY;
+    s->max[k] = -INFINITY;
+  }
+  for (i = 0; i < job->n; i++) {
+    b = job->v[i];
+    switch (block_type(b)) {
+    case RAPID:
+      s->rapid_dist += block_length(b);
+      s->time += rapid_dt(block_length(b), job->fmax, job->A);
+      break;
+    case NO_MOTION:
+      break;
+    default:
+      dt = block_dt(b);
+      s->cut_dist += block_length(b);
+      s->cut_time += dt;
+      s->time += dt;
+      s->feed_time += block_cruise(b);
+    }
+    block_extents(b, lo, hi);
+    for (k = 0; k < 3; k++) {
+      s->min[k] = MIN(s->min[k], lo[k]);
+      s->max[k] = MAX(s->max[k], hi[k]);
+    }
+  }
+  s->n = job->n;
+  return NULL;
+}
+
+static void box_empty(data_t *box) {
+  box[0] = box[1] = box[2] = INFINITY;
+  box[3] = box[4] = box[5] = -INFINITY;
+}
+
+static void box_merge(data_t *box, data_t const *lo, data_t const *hi) {
+  int k;
+  for (k = 0; k < 3; k++) {
+    box[k] = MIN(box[k], lo[k]);
+    box[k + 3] = MAX(box[k + 3], hi[k]);
+  }
+}
+
+// Complete binary tree of bounding boxes over the index, stored as an
+// array (node k has children 2k and 2k + 1, the root is 1): each leaf
+// encloses TREE_LEAF consecutive blocks, which are spatially close in a
+// tool path. Only the leaves from the first changed block to the last one
+// (the program may have become shorter) are computed again, together with
+// their ancestors
+static int program_tree(program_t *p) {
+  size_t leaves = 1, l0, l, i, k, k1;
+  data_t lo[3], hi[3], *box, *child;
+  void *tmp;
+  while (leaves * TREE_LEAF < p->n)
+    leaves <<= 1;
+  if (leaves != p->tree_leaves) {
+    if (!(tmp = realloc(p->tree, 2 * leaves * 6 * sizeof(*p->tree)))) {
+      eprintf("Could not allocate memory for the box hierarchy\n");
+      return 1;
+    }
+    p->tree = tmp;
+    p->tree_leaves = leaves;
+    p->tree_from = 0;
+  }
+  if (p->tree_from == SIZE_MAX)
+    return 0;
+  l0 = p->tree_from / TREE_LEAF;
+  for (l = l0; l < leaves; l++) {
+    box = p->tree + 6 * (leaves + l);
+    box_empty(box);
+    for (i = l * TREE_LEAF; i < MIN((l + 1) * TREE_LEAF, p->n); i++) {
+      block_extents(p->index[i], lo, hi);
+      box_merge(box, lo, hi);
+    }
+  }
+  for (k = (leaves + l0) / 2, k1 = leaves - 1; k >= 1; k /= 2, k1 /= 2) {
+    for (i = k; i <= k1; i++) {
+      box = p->tree + 6 * i;
+      child = p->tree + 12 * i;
+      box_empty(box);
+      box_merge(box, child, child + 3);
+      box_merge(box, child + 6, child + 9);
+    }
+  }
+  p->tree_from = SIZE_MAX;
+  return 0;
+}
+
+// 1 if the box lies within lo-hi (outside mode), or does not overlap it
+// (overlap mode): none of the blocks it encloses is a match
+static int box_skip(data_t const *box, data_t const lo[3], data_t const hi[3],
+                    int outside) {
+  int k, in = 1, apart = 0;
+  if (box[0] > box[3])
+    return 1;
+  for (k = 0; k < 3; k++) {
+    in = in && box[k] >= lo[k] - TREE_TOL && box[k + 3] <= hi[k] + TREE_TOL;
+    apart = apart || box[k] > hi[k] || box[k + 3] < lo[k];
+  }
+  return outside ? in : apart;
+}
+
+// Distance from the point x to the box (0 inside), INFINITY if empty
+static data_t box_dist(data_t const *box, data_t const x[3]) {
+  data_t d, sum = 0;
+  int k;
+  if (box[0] > box[3])
+    return INFINITY;
+  for (k = 0; k < 3; k++) {
+    d = MAX(box[k] - x[k], x[k] - box[k + 3]);
+    if (d > 0)
+      sum += d * d;
+  }
+  return sqrt(sum);
+}
+
+// Depth first visit of the subtree of node k, in program order; matches
+// beyond max are counted but not stored
+static size_t tree_query(program_t *p, size_t k, data_t const lo[3],
+                         data_t const hi[3], int outside, size_t *v,
+                         size_t max, size_t count) {
+  data_t box[6];
+  size_t i;
+  if (box_skip(p->tree + 6 * k, lo, hi, outside))
+    return count;
+  if (k < p->tree_leaves) {
+    count = tree_query(p, 2 * k, lo, hi, outside, v, max, count);
+    return tree_query(p, 2 * k + 1, lo, hi, outside, v, max, count);
+  }
+  for (i = (k - p->tree_leaves) * TREE_LEAF;
+       i < MIN((k - p->tree_leaves + 1) * TREE_LEAF, p->n); i++) {
+    block_extents(p->index[i], box, box + 3);
+    if (box_skip(box, lo, hi, outside))
+      continue;
+    if (count < max)
+      v[count] = i;
+    count++;
+  }
+  return count;
+}
+
+// Lower bound of the distance from x to block i, from its ends: no point
+// of the path is farther than half the length from the nearer end, nor
+// farther than the length from either end
+static data_t block_bound(program_t *p, size_t i, data_t const x[3]) {
+  point_t *e;
+  data_t d0, d1, l = block_length(p->index[i]) + TREE_TOL;
+  if (i == 0)
+    return 0;
+  e = block_target(p->index[i - 1]);
+  d0 = hypot(hypot(point_x(e) - x[0], point_y(e) - x[1]), point_z(e) - x[2]);
+  e = block_target(p->index[i]);
+  d1 = hypot(hypot(point_x(e) - x[0], point_y(e) - x[1]), point_z(e) - x[2]);
+  return MAX(MIN(d0, d1) - l / 2, MAX(d0, d1) - l);
+}
+
+// Branch and bound: the nearer child is visited first, and subtrees and
+// blocks that cannot be nearer than the best distance so far are pruned
+static void tree_nearest(program_t *p, size_t k, data_t const x[3],
+                         size_t *best, data_t *lambda, data_t *dist) {
+  data_t d0, d1, l, d;
+  size_t i;
+  if (k < p->tree_leaves) {
+    d0 = box_dist(p->tree + 12 * k, x);
+    d1 = box_dist(p->tree + 12 * k + 6, x);
+    if (d0 <= d1) {
+      if (d0 < *dist)
+        tree_nearest(p, 2 * k, x, best, lambda, dist);
+      if (d1 < *dist)
+        tree_nearest(p, 2 * k + 1, x, best, lambda, dist);
+    } else {
+      if (d1 < *dist)
+        tree_nearest(p, 2 * k + 1, x, best, lambda, dist);
+      if (d0 < *dist)
+        tree_nearest(p, 2 * k, x, best, lambda, dist);
+    }
+    return;
+  }
+  for (i = (k - p->tree_leaves) * TREE_LEAF;
+       i < MIN((k - p->tree_leaves + 1) * TREE_LEAF, p->n); i++) {
+    if (i == *best || block_bound(p, i, x) >= *dist)
+      continue;
+    d = block_nearest(p->index[i], x, &l);
+    if (d < *dist) {
+      *best = i;
+      *lambda = l;
+      *dist = d;
+    }
+  }
+}
+
+// Position of block N in the index, p->n if missing
+static size_t program_find(program_t *p, size_t n) {
+  size_t k;
+  if ((p->map_dirty || !p->map) && (!p->index || program_map(p)))
+    return p->n;
+  for (k = slot(n, p->map_size); p->map[k]; k = (k + 1) & (p->map_size - 1)) {
+    if (block_n(p->index[p->map[k] - 1]) == n)
+      return p->map[k] - 1;
+  }
+  return p->n;
+}
+
 //   _____         _
 //  |_   _|__  ___| |_
 //    | |/ _ \/ __| __|
@@ -163,15 +1267,496 @@ void program_reset(program_t *p) {
 //    |_|\___||___/\__|
 
 #ifdef PROGRAM_MAIN
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+// Heap per block of a parsed program (B): block, target point, words and
+// line, profile, and the program tables. Arcs add their geometry record
+#define MEMORY_LINES 20000
+#define MEMORY_MAX 448
+
+// Every block is found by its N word, then the program resumes from N n
+// with the tool at the machine zero: three approach blocks must lead to the
+// start of block n, and the run continues from there
+static int resume_test(program_t *p, machine_t *m, size_t n) {
+  block_t *b, *a[3];
+  point_t *s = NULL;
+  size_t i, len = program_length(p);
+  int k;
+  for (i = 0; i < len; i++) {
+    b = program_seek(p, block_n(program_block(p, i)));
+    if (!b || block_n(b) != block_n(program_block(p, i)) ||
+        program_next(p) != b) {
+      eprintf("Seek of block %zu failed\n", i);
+      return 1;
+    }
+  }
+  if (!(b = program_seek(p, n)))
+    return 1;
+  i = 0;
+  while (program_block(p, i) != b)
+    i++;
+  s = i > 0 ? block_target(program_block(p, i - 1)) : machine_zero(m);
+  if (program_resume(p, n, machine_zero(m)))
+    return 1;
+  for (k = 0; k < 3; k++)
+    a[k] = program_next(p);
+  if (program_length(p) != len + 3 || program_next(p) != b ||
+      program_seek(p, n) != b || program_block(p, i) != a[0] ||
+      program_block(p, i + 3) != b || program_block(p, len + 2) == NULL) {
+    eprintf("Resume does not lead to block N%zu\n", n);
+    return 1;
+  }
+  if (block_type(a[0]) != RAPID || block_type(a[1]) != RAPID ||
+      point_dist(block_target(a[2]), s) > 1E-6 ||
+      point_z(block_target(a[1])) < point_z(s)) {
+    eprintf("Wrong approach to block N%zu\n", n);
+    return 1;
+  }
+  fprintf(stderr, "Resuming from N%zu:\n", n);
+  for (b = a[0]; b; b = block_next(b))
+    block_print(b, stderr);
+  // the run starts from the first approach block
+  p->current = i > 0 ? program_block(p, i - 1) : NULL;
+  return 0;
+}
+
+// Statistics of test.gcode: the bounding box is known, and the arc N110
+// bulges to X15, past both its ends
+static int stats_test(program_t *p, machine_t *m) {
+  program_stats_t s;
+  data_t lo[3], hi[3], t = 0, box[6] = {-10, -10, 0, 60, 50, 500};
+  block_t *b;
+  int k, rv = 0;
+  if (program_stats(p, m, &s))
+    return 1;
+  program_stats_print(&s, stderr);
+  for (b = program_first(p); b; b = block_next(b))
+    t += block_type(b) == RAPID ? 0 : block_dt(b);
+  for (k = 0; k < 3; k++) {
+    if (fabs(s.min[k] - box[k]) > 1E-9 || fabs(s.max[k] - box[k + 3]) > 1E-9)
+      rv = 1;
+  }
+  if (rv)
+    eprintf("Wrong bounding box\n");
+  if (s.n != program_length(p) || fabs(s.cut_time - t) > 1E-9 ||
+      s.time <= s.cut_time || s.feed_time > s.cut_time || s.rapid_dist <= 0) {
+    eprintf("Inconsistent times or distances\n");
+    rv = 1;
+  }
+  block_extents(program_seek(p, 110), lo, hi);
+  if (fabs(hi[0] - 15) > 1E-9 || fabs(lo[1] - 10) > 1E-9) {
+    eprintf("Wrong extents of an arc: X up to %f\n", hi[0]);
+    rv = 1;
+  }
+  return rv;
+}
+
+// The box hierarchy must find the same blocks as a linear scan, in both
+// modes
+static int limits_check(program_t *p, data_t const lo[3], data_t const hi[3]) {
+  size_t len = program_length(p), *v = malloc((len + 1) * sizeof(*v));
+  size_t i, j, count;
+  data_t box[6];
+  int outside, rv = 0;
+  for (outside = 0; outside < 2 && !rv; outside++) {
+    count = outside ? program_outside(p, lo, hi, v, len)
+                    : program_overlap(p, lo, hi, v, len);
+    for (i = 0, j = 0; i < len; i++) {
+      block_extents(program_block(p, i), box, box + 3);
+      if (box_skip(box, lo, hi, outside))
+        continue;
+      if (j >= count || v[j] != i) {
+        eprintf("Block %zu missed by the box hierarchy\n", i);
+        rv = 1;
+        break;
+      }
+      j++;
+    }
+    if (!rv && j != count) {
+      eprintf("%zu blocks found instead of %zu\n", count, j);
+      rv = 1;
+    }
+  }
+  free(v);
+  return rv;
+}
+
+// test.gcode is within the machine travel; random boxes are searched both
+// through the hierarchy and by a linear scan
+static int limits_test(program_t *p, machine_t *m) {
+  data_t lo[3], hi[3], c;
+  size_t v[4];
+  int i, k;
+  if (program_validate(p, m) != 0)
+    return 1;
+  // a keepout on the right of the arc N110, which reaches X15
+  lo[0] = 12;
+  hi[0] = 20;
+  lo[1] = 20;
+  hi[1] = 30;
+  lo[2] = -1;
+  hi[2] = 1;
+  if (program_overlap(p, lo, hi, v, 4) != 1 ||
+      block_n(program_block(p, v[0])) != 110) {
+    eprintf("Arc N110 not found in the keepout\n");
+    return 1;
+  }
+  srand(1);
+  for (i = 0; i < 1000; i++) {
+    for (k = 0; k < 3; k++) {
+      c = k < 2 ? rand() % 90 - 20 : rand() % 520 - 10;
+      lo[k] = c - rand() % (k < 2 ? 40 : 300);
+      hi[k] = c + rand() % (k < 2 ? 40 : 300);
+    }
+    if (limits_check(p, lo, hi))
+      return 1;
+  }
+  return 0;
+}
+
+// Lines of the reload test program: a G64 contour with corners, tangent
+// junctions and an arc, where the line edit is changed
+static void reload_write(char const *path, size_t n, size_t edit) {
+  FILE *f = fopen(path, "w");
+  size_t i;
+  int y, y0 = 0;
+  fprintf(f, "N1 G00 X0 Y0 Z5\nN2 G01 G64 Z0 F2000\n");
+  for (i = 0; i < n; i++) {
+    y = (int)(i % 3) * (i == edit ? 2 : 1);
+    if (i == 200) // half circle from the previous point
+      fprintf(f, "N%zu G02 X%zu Y%d I2 J0\n", i + 3, 2 * i + 2, y0);
+    else
+      fprintf(f, "N%zu G01 X%zu Y%d%s\n", i + 3, 2 * i, y,
+              i % 50 == 0 ? " F1500" : "");
+    y0 = y;
+  }
+  fprintf(f, "N%zu G00 Z50\n", n + 3);
+  fclose(f);
+}
+
+// A reloaded program must equal the same file parsed from scratch
+static int reload_same(program_t *a, program_t *b) {
+  block_t *x, *y;
+  size_t i;
+  if (program_length(a) != program_length(b))
+    return 0;
+  for (i = 0, x = program_first(a), y = program_first(b); x && y;
+       i++, x = block_next(x), y = block_next(y)) {
+    if (block_type(x) != block_type(y) || program_block(a, i) != x ||
+        point_dist(block_target(x), block_target(y)) > 1E-9 ||
+        fabs(block_dt(x) - block_dt(y)) > 1E-9 ||
+        fabs(block_fs(x) - block_fs(y)) > 1E-6 ||
+        fabs(block_fe(x) - block_fe(y)) > 1E-6) {
+      eprintf("Block %zu differs after reload\n", i);
+      return 0;
+    }
+  }
+  return !x && !y;
+}
+
+// Subprogram test programs: the calls in main, or the same lines written
+// out in full; the first line sets the path mode
+static char const *sub_main[] = {
+    "O1", "N1 G00 X0 Y0 Z5", "N2 G01 Z0 F1000", "N3 M98 P100 L3",
+    "N4 G01 X50 Y0", "N5 M98 P200 L2", "N6 G00 Z50", "M30", NULL};
+static char const *sub_defs[] = {
+    "O100", "N100 G01 X10 Y0", "N110 G01 X10 Y10", "N120 G02 X0 Y10 I-5 J0",
+    "N130 G01 Y0", "M99", "O200", "N200 G01 Y5", "N210 M98 P100",
+    "N220 G01 X50 Y5", "M99", NULL};
+
+static void sub_write(char const *path, char const *mode, int expand,
+                      char const *x) {
+  FILE *f = fopen(path, "w");
+  char const **l;
+  int r, k;
+  fprintf(f, "N0 G00 %s\n", mode);
+  for (l = sub_main; *l; l++) {
+    if (!expand || !strstr(*l, "M98")) {
+      fprintf(f, "%s\n", *l);
+      continue;
+    }
+    // N3: 3 x O100; N5: 2 x (N200, O100, N220)
+    for (r = 0; r < (strstr(*l, "P100") ? 3 : 2); r++) {
+      if (strstr(*l, "P200"))
+        fprintf(f, "%s\n", sub_defs[7]);
+      for (k = 1; k < 5; k++)
+        fprintf(f, k == 1 ? "N100 G01 X%s Y0\n" : "%s\n",
+                k == 1 ? x : sub_defs[k]);
+      if (strstr(*l, "P200"))
+        fprintf(f, "%s\n", sub_defs[9]);
+    }
+  }
+  if (!expand) {
+    for (l = sub_defs; *l; l++) {
+      if (l == sub_defs + 1)
+        fprintf(f, "N100 G01 X%s Y0\n", x);
+      else
+        fprintf(f, "%s\n", *l);
+    }
+  }
+  fclose(f);
+}
+
+// Calls expand into the same blocks as the lines written out, the repeated
+// instances sharing their profiles in both path modes (in G64, those
+// planned with the same junction feeds), also after a change of the
+// subprogram; recursive calls are an error
+static int sub_test(machine_t *m) {
+  char path[] = "/tmp/ccnc_subXXXXXX", full[] = "/tmp/ccnc_fullXXXXXX";
+  char const *modes[] = {"G61", "G64"};
+  program_t *p = NULL, *q = NULL;
+  size_t i, shared;
+  int k, rv = 1, fd = mkstemp(path), fd2 = mkstemp(full);
+  if (fd < 0 || fd2 < 0)
+    return 1;
+  close(fd);
+  close(fd2);
+  for (k = 0; k < 2; k++) {
+    sub_write(path, modes[k], 0, "10");
+    sub_write(full, modes[k], 1, "10");
+    p = program_new(path);
+    q = program_new(full);
+    if (program_parse(p, m) < 0 || program_parse(q, m) < 0 ||
+        !reload_same(p, q))
+      goto end;
+    for (i = 0, shared = 0; i < program_length(p); i++)
+      shared += block_shared(program_block(p, i));
+    fprintf(stderr, "%s: %zu blocks, %zu sharing their profile\n", modes[k],
+            program_length(p), shared);
+    if (shared < 20)
+      goto end;
+    // a change in a definition reloads all the calls
+    sub_write(path, modes[k], 0, "12");
+    sub_write(full, modes[k], 1, "12");
+    program_free(q);
+    q = program_new(full);
+    if (program_reload(p, m) <= 0 || program_parse(q, m) < 0 ||
+        !reload_same(p, q))
+      goto end;
+    program_free(p);
+    program_free(q);
+    p = q = NULL;
+  }
+  // O100 calling itself
+  fd = open(path, O_WRONLY | O_TRUNC);
+  dprintf(fd, "N1 G00 X0 Y0 Z0\nN2 M98 P100\nM30\nO100\nN3 G01 X1 F100\n"
+              "N4 M98 P100\nM99\n");
+  close(fd);
+  p = program_new(path);
+  rv = program_parse(p, m) >= 0;
+end:
+  if (rv)
+    eprintf("Subprogram test failed in mode %s\n", modes[MIN(k, 1)]);
+  if (p)
+    program_free(p);
+  if (q)
+    program_free(q);
+  remove(path);
+  remove(full);
+  return rv;
+}
+
+// A long program of short lines, with an arc every tenth line, must take
+// at most MEMORY_MAX bytes of heap per block once parsed
+static int memory_test(machine_t *m) {
+#ifdef __GLIBC__
+  char path[] = "/tmp/ccnc_memoryXXXXXX";
+  program_t *p = NULL;
+  struct mallinfo2 h0, h1;
+  size_t i, per_block = 0;
+  int rv = 1, fd = mkstemp(path);
+  FILE *f;
+  if (fd < 0 || !(f = fdopen(fd, "w")))
+    return 1;
+  fprintf(f, "N0 G00 X0 Y0 Z0\nN1 G01 F2000\n");
+  for (i = 2; i < MEMORY_LINES; i++) {
+    if (i % 10 == 0)
+      fprintf(f, "N%zu G02 X%zu Y1 I0.5 J0\n", i, i);
+    else
+      fprintf(f, "N%zu G01 X%zu Y%d\n", i, i, (int)(i % 2));
+  }
+  fclose(f);
+  h0 = mallinfo2();
+  p = program_new(path);
+  if (!p || program_parse(p, m) != MEMORY_LINES)
+    goto end;
+  h1 = mallinfo2();
+  per_block = (h1.uordblks - h0.uordblks) / program_length(p);
+  fprintf(stderr, "%zu blocks, %zu B of heap per block\n",
+          program_length(p), per_block);
+  rv = per_block > MEMORY_MAX;
+end:
+  if (rv)
+    eprintf("Memory test failed: %zu B per block (at most %d)\n", per_block,
+            MEMORY_MAX);
+  if (p)
+    program_free(p);
+  remove(path);
+  return rv;
+#else
+  (void)m;
+  wprintf("Heap statistics are not available, memory test skipped\n");
+  return 0;
+#endif
+}
+
+static int reload_test(machine_t *m) {
+  char path[] = "/tmp/ccnc_reloadXXXXXX";
+  size_t n[] = {400, 400, 400, 380, 420, 420};
+  size_t edit[] = {400, 391, 4, 400, 400, 400};
+  data_t box[6] = {100, 0.5, -1, 790, 10, 10}; // box hierarchy check
+  program_t *p = NULL, *q = NULL;
+  struct timespec t0, t1;
+  int k, rv = 1, fd = mkstemp(path), changed, watched;
+  if (fd < 0)
+    return 1;
+  close(fd);
+  reload_write(path, n[0], edit[0]);
+  p = program_new(path);
+  if (program_parse(p, m) < 0 || program_reload(p, m) != 0 ||
+      limits_check(p, box, box + 3))
+    goto end;
+  watched = program_watch(p) >= 0;
+  // edits near the end, near the start, removed and appended lines
+  for (k = 1; k < 6; k++) {
+    reload_write(path, n[k], edit[k]);
+    if (watched && !program_changed(p)) {
+      eprintf("File change not notified\n");
+      goto end;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    changed = program_reload(p, m);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    q = program_new(path);
+    if (changed < 0 || program_parse(q, m) < 0 || !reload_same(p, q) ||
+        limits_check(p, box, box + 3))
+      goto end;
+    fprintf(stderr, "Reload %d: %d of %zu blocks in %.3f ms\n", k, changed,
+            program_length(p),
+            ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1E9) * 1E3);
+    if (k == 5 && changed != 0)
+      goto end;
+    program_free(q);
+    q = NULL;
+  }
+  rv = 0;
+end:
+  if (p)
+    program_free(p);
+  if (q)
+    program_free(q);
+  remove(path);
+  return rv;
+}
+
+// The nearest block found through the hierarchy must be as near as the
+// nearest one of a linear scan, and its lambda must lead back to a point
+// at the distance found
+static int nearest_check(program_t *p, data_t const x[3]) {
+  size_t i, k, len = program_length(p);
+  data_t l, d, dmin = INFINITY;
+  point_t *pt;
+  for (k = 0; k < len; k++)
+    dmin = MIN(dmin, block_nearest(program_block(p, k), x, NULL));
+  i = program_nearest(p, x, &l, &d);
+  if (i >= len || fabs(d - dmin) > 1E-12) {
+    eprintf("Nearest block at %f instead of %f from [%f, %f, %f]\n", d, dmin,
+            x[0], x[1], x[2]);
+    return 1;
+  }
+  if (block_type(program_block(p, i)) == RAPID)
+    return 0;
+  pt = block_interpolate(program_block(p, i), p->machine, l);
+  if (!pt || fabs(hypot(hypot(point_x(pt) - x[0], point_y(pt) - x[1]),
+                        point_z(pt) - x[2]) - d) > 1E-5) {
+    eprintf("Wrong lambda %f of block %zu\n", l, i);
+    return 1;
+  }
+  return 0;
+}
+
+// Points along the path must be at distance 0 from it, and random points
+// around it are checked against a linear scan; both for test.gcode and for
+// a long G64 contour with blends and a half circle. The time per query is
+// measured along the contour, as for a stream of feedback positions
+static int nearest_test(program_t *p, machine_t *m) {
+  char path[] = "/tmp/ccnc_nearestXXXXXX";
+  program_t *q = NULL;
+  block_t *b;
+  point_t *pt;
+  data_t x[3], lo[3], hi[3], box[6], d, l;
+  struct timespec t0, t1;
+  size_t i, n;
+  int j, k, rv = 1, fd = mkstemp(path);
+  if (fd < 0)
+    return 1;
+  close(fd);
+  reload_write(path, 400, 400);
+  q = program_new(path);
+  if (program_parse(q, m) < 0)
+    goto end;
+  srand(1);
+  for (k = 0; k < 2; k++, p = q) {
+    lo[0] = lo[1] = lo[2] = INFINITY;
+    hi[0] = hi[1] = hi[2] = -INFINITY;
+    for (i = 0; i < program_length(p); i++) {
+      block_extents(program_block(p, i), box, box + 3);
+      for (j = 0; j < 3; j++) {
+        lo[j] = MIN(lo[j], box[j]);
+        hi[j] = MAX(hi[j], box[j + 3]);
+      }
+    }
+    for (i = 0; i < 2000; i++) {
+      for (j = 0; j < 3; j++)
+        x[j] = lo[j] - 10 + (hi[j] - lo[j] + 20) * rand() / RAND_MAX;
+      if (nearest_check(p, x))
+        goto end;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0, n = 0; i < program_length(p); i++) {
+      b = program_block(p, i);
+      if (block_type(b) == RAPID)
+        continue;
+      for (l = 0; l <= 1; l += 0.125, n++) {
+        if (!(pt = block_interpolate(b, m, l)))
+          break;
+        x[0] = point_x(pt);
+        x[1] = point_y(pt);
+        x[2] = point_z(pt);
+        if (program_nearest(p, x, NULL, &d) == SIZE_MAX || d > 1E-6) {
+          eprintf("Point of block %zu at %f from the path\n", i, d);
+          goto end;
+        }
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fprintf(stderr, "%zu blocks: %zu points along the path, %.2f us each\n",
+            program_length(p), n,
+            ((t1.tv_sec - t0.tv_sec) * 1E9 + (t1.tv_nsec - t0.tv_nsec)) /
+                1E3 / n);
+  }
+  rv = 0;
+end:
+  if (q)
+    program_free(q);
+  remove(path);
+  return rv;
+}
+
 int main(int argc, char const *argv[]) {
   machine_t *m = NULL;
   program_t *p = NULL;
   block_t *curr_b = NULL;
-  data_t t, tt = 0, tq, lambda, v, dt;
+  data_t t, tt = 0, tq, lambda, v, dt, t0 = 0;
   point_t *pos = NULL;
 
-  if (argc != 3) {
-    eprintf("I need exactly two arguments: g-code filename and INI filename\n");
+  if (argc != 3 && argc != 4) {
+    eprintf("Usage: %s program.gcode machine.ini "
+            "[N | stats | reload | limits | sub | nearest | memory]\n",
+            argv[0]);
     exit(EXIT_FAILURE);
   }
   m = machine_new(argv[2]);
@@ -189,22 +1774,86 @@ int main(int argc, char const *argv[]) {
     exit(EXIT_FAILURE);
   }
   program_print(p, stderr);
+  if (argc == 4 && strcmp(argv[3], "reload") == 0) {
+    if (reload_test(m)) {
+      eprintf("Reload test failed\n");
+      exit(EXIT_FAILURE);
+    }
+    program_free(p);
+    machine_free(m);
+    return 0;
+  }
+  if (argc == 4 && strcmp(argv[3], "sub") == 0) {
+    if (sub_test(m)) {
+      eprintf("Subprogram test failed\n");
+      exit(EXIT_FAILURE);
+    }
+    program_free(p);
+    machine_free(m);
+    return 0;
+  }
+  if (argc == 4 && strcmp(argv[3], "memory") == 0) {
+    if (memory_test(m)) {
+      eprintf("Memory test failed\n");
+      exit(EXIT_FAILURE);
+    }
+    program_free(p);
+    machine_free(m);
+    return 0;
+  }
+  if (argc == 4 && strcmp(argv[3], "nearest") == 0) {
+    if (nearest_test(p, m)) {
+      eprintf("Nearest block test failed\n");
+      exit(EXIT_FAILURE);
+    }
+    program_free(p);
+    machine_free(m);
+    return 0;
+  }
+  if (argc == 4 && strcmp(argv[3], "limits") == 0) {
+    if (limits_test(p, m)) {
+      eprintf("Limits test failed\n");
+      exit(EXIT_FAILURE);
+    }
+    program_free(p);
+    machine_free(m);
+    return 0;
+  }
+  if (argc == 4 && strcmp(argv[3], "stats") == 0) {
+    if (stats_test(p, m)) {
+      eprintf("Statistics test failed\n");
+      exit(EXIT_FAILURE);
+    }
+    program_free(p);
+    machine_free(m);
+    return 0;
+  }
+  if (argc == 4 && resume_test(p, m, strtoul(argv[3], NULL, 10))) {
+    eprintf("Resume test failed\n");
+    exit(EXIT_FAILURE);
+  }
   
   tq = machine_tq(m);
   // ------ Run program ------ //
-  program_reset(p);
+  if (argc == 3)
+    program_reset(p);
   printf("# N t tt lambda s v X Y Z\n");
   while ((curr_b = program_next(p))) {
-    if (block_type(curr_b) == RAPID)
+    if (block_type(curr_b) == RAPID) {
+      t0 = 0;
       continue;
+    }
     dt = block_dt(curr_b);
-    for (t = 0; t <= dt + tq/10.0; t += tq, tt += tq) {
+    // continuous time: each block starts where the last tick of the
+    // previous one went past its end
+    for (t = t0; t <= dt + (machine_quantize(m) ? tq/10.0 : 0); t += tq, tt += tq) {
       lambda = block_lambda(curr_b, t, &v);
-      pos = block_interpolate(curr_b, lambda);
+      pos = block_interpolate(curr_b, m, lambda);
       if (!pos) 
         continue;
       printf("%lu %.3f %.3f %.6f %.3f %.3f %.3f %.3f %.3f\n", block_n(curr_b), t, tt, lambda, lambda * block_length(curr_b), v, point_x(pos), point_y(pos), point_z(pos));
     }
+    t0 = machine_quantize(m) ? 0 : t - dt;
   }
   // ------------------------- //
 
@@ -24,6 +24,17 @@
 // Opaque structure:
 typedef struct program program_t;
 
+// Dry-run statistics of a parsed program (see program_stats())
+typedef struct {
+  size_t n;              // number of blocks
+  data_t time;           // total duration (s), rapids included
+  data_t cut_time;       // duration of the interpolated motions (s)
+  data_t feed_time;      // time cruising at the programmed feed (s)
+  data_t rapid_dist;     // rapid travel (mm)
+  data_t cut_dist;       // interpolated travel (mm)
+  data_t min[3], max[3]; // bounding box of the tool path (mm)
+} program_stats_t;
+
 
 
 //   _____                 _   _                 
@@ -44,14 +55,88 @@ block_t *program_current(program_t const *p);
 block_t *program_first(program_t const *p);
 block_t *program_last(program_t const *p);
 char *program_filename(program_t const *p);
+int program_watch_fd(program_t const *p); // see program_watch()
 
 
 // Processing ==================================================================
 int program_parse(program_t *program, machine_t *machine);
+// Parse the file again after a change: blocks are kept up to the first
+// changed line, the rest is parsed and planned again. Returns the number of
+// blocks parsed or planned again (0 if the file did not change), -1 on
+// error
+int program_reload(program_t *program, machine_t *machine);
+// Start watching the file for changes; returns a descriptor that becomes
+// readable when the file is written (for poll()), -1 on error
+int program_watch(program_t *program);
+// 1 if the file was written since the last call, without blocking
+int program_changed(program_t *program);
+// Offset the G41/G42 parts of the path by the tool radius (see
+// block_compensate()); returns the number of compensated blocks, -1 on
+// error (called by program_parse() when some block is compensated)
+long program_compensate(program_t *program);
+// Merge runs of short lines into single lines or arcs, within tol (mm);
+// returns the number of blocks removed (called by program_parse() when
+// chord_tol is set)
+size_t program_compress(program_t *program, data_t tol);
+// Fit runs of short lines with splines, within tol (mm); returns the number
+// of blocks removed (called by program_parse() when spline is set)
+size_t program_spline(program_t *program, data_t tol);
+// Blend the G64 corners and plan the feeds across the junctions (called by
+// program_parse())
+int program_plan(program_t *program);
 block_t *program_next(program_t *program);
 void program_reset(program_t *program);
 
 
+// Random access ===============================================================
+// The i-th block in program order (NULL if out of range), constant time
+block_t *program_block(program_t const *program, size_t i);
+// Block with the N word n (the first one, if repeated), in constant time;
+// the following program_next() returns it. NULL if there is no such block
+block_t *program_seek(program_t *program, size_t n);
+// Prepare to run the program from block N n, with the tool at the point
+// from: approach blocks are inserted before it, carrying its feed, spindle
+// and tool, and the following program_next() returns the first of them.
+// With n = 0, from the first block. Returns 0 on success
+int program_resume(program_t *program, size_t n, point_t const *from);
+
+
+// Statistics ==================================================================
+// Machining time, travel and extents of a parsed program, from the planned
+// profiles and without running it. Rapids are timed as straight moves at
+// fmax with acceleration A. Large programs are split among the available
+// cores. Returns 0 on success
+int program_stats(program_t const *program, machine_t const *machine,
+                  program_stats_t *stats);
+void program_stats_print(program_stats_t const *stats, FILE *output);
+
+
+// Workspace ===================================================================
+// Blocks whose path leaves the box lo-hi (mm, workpiece frame): their
+// positions in program order are stored in v, at most max of them, and
+// their total number is returned. The blocks are searched through a
+// hierarchy of bounding boxes, so that the parts of the program well within
+// the box are skipped at once
+size_t program_outside(program_t *program, data_t const lo[3],
+                       data_t const hi[3], size_t *v, size_t max);
+// Same, for the blocks whose bounding box overlaps the box lo-hi, e.g. a
+// fixture or clamp keepout: candidates for a closer check
+size_t program_overlap(program_t *program, data_t const lo[3],
+                       data_t const hi[3], size_t *v, size_t max);
+// Check the program against the travel limits of the machine, listing the
+// offending blocks on stderr; returns their number (0: all within)
+size_t program_validate(program_t *program, machine_t const *machine);
+// Block nearest to the point x (mm, workpiece frame), e.g. the measured
+// position for the contour error: returns its position in program order
+// (SIZE_MAX if the program is empty), with the lambda of the nearest point
+// and the distance (mm) in lambda and dist when not NULL. The hierarchy of
+// bounding boxes is searched nearest first, starting from the block found
+// by the last call, so that successive positions along the path cost about
+// as much as a few blocks
+size_t program_nearest(program_t *program, data_t const x[3], data_t *lambda,
+                       data_t *dist);
+
+
 
 #endif // PROGRAM_H
 
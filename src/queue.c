@@ -0,0 +1,354 @@
+//    ___
+//   / _ \ _   _  ___ _   _  ___
+//  | | | | | | |/ _ \ | | |/ _ \
+//  | |_| | |_| |  __/ |_| |  __/
+//   \__\_\\__,_|\___|\__,_|\___|
+//
+
+#include "queue.h"
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+//   ____            _                 _   _
+//  |  _ \  ___  ___| | __ _ _ __ __ _| |_(_) ___  _ __  ___
+//  | | | |/ _ \/ __| |/ _` | '__/ _` | __| |/ _ \| '_ \/ __|
+//  | |_| |  __/ (__| | (_| | | | (_| | |_| | (_) | | | \__ \
+//  |____/ \___|\___|_|\__,_|_|  \__,_|\__|_|\___/|_| |_|___/
+
+// A job starting closer than this (mm) to where the last one ended needs
+// no approach
+#define QUEUE_TOL 1E-6
+
+// Only one job is prepared ahead, so that at most two programs are in
+// memory at once (plus the finished ones not yet freed); the files waiting
+// are a FIFO of names
+typedef struct queue {
+  machine_t *machine;    // machine the jobs are planned for
+  char **files;          // files waiting, from head on (circular)
+  size_t head, n, size;  // first file, files waiting, allocated slots
+  program_t *ready;      // next job, prepared (NULL: none)
+  program_t **done;      // finished jobs, to be freed
+  size_t n_done, done_size; // finished jobs, allocated slots
+  int busy;              // a job is being prepared
+  int stop;              // stop request for the thread
+  point_t *from;         // where the next job to be prepared starts
+  pthread_mutex_t lock;  // protects all of the above
+  pthread_cond_t cond;   // broadcast at every change
+  pthread_t thread;      // preparing thread
+} queue_t;
+
+static void *queue_run(void *ud);
+static program_t *queue_prepare(queue_t *q, char const *file);
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+queue_t *queue_new(machine_t *m, point_t const *from) {
+  assert(m && from);
+  queue_t *q = malloc(sizeof(*q));
+  sigset_t mask, old_mask;
+  pthread_attr_t attr;
+  struct sched_param param = {.sched_priority = 0};
+  int rc;
+  if (!q) {
+    eprintf("Could not allocate memory for the job queue\n");
+    return NULL;
+  }
+  memset(q, 0, sizeof(*q));
+  q->machine = m;
+  if (!(q->from = point_new())) {
+    free(q);
+    return NULL;
+  }
+  point_set_xyz(q->from, point_x(from), point_y(from), point_z(from));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  // the thread must neither steal the timer signals of the real-time loop
+  // nor inherit its SCHED_FIFO priority: parsing and planning a job must
+  // never preempt the interpolation
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &param);
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  rc = pthread_create(&q->thread, &attr, queue_run, q);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  pthread_attr_destroy(&attr);
+  if (rc) {
+    eprintf("Could not start the job queue\n");
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+    point_free(q->from);
+    free(q);
+    return NULL;
+  }
+  return q;
+}
+
+void queue_free(queue_t *q) {
+  assert(q);
+  size_t i;
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  pthread_join(q->thread, NULL);
+  for (i = 0; i < q->n; i++)
+    free(q->files[(q->head + i) % q->size]);
+  free(q->files);
+  if (q->ready)
+    program_free(q->ready);
+  for (i = 0; i < q->n_done; i++)
+    program_free(q->done[i]);
+  free(q->done);
+  point_free(q->from);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->cond);
+  free(q);
+}
+
+// Accessors ===================================================================
+size_t queue_length(queue_t *q) {
+  assert(q);
+  size_t n;
+  pthread_mutex_lock(&q->lock);
+  n = q->n + q->busy + (q->ready != NULL);
+  pthread_mutex_unlock(&q->lock);
+  return n;
+}
+
+// Methods =====================================================================
+int queue_push(queue_t *q, char const *file) {
+  assert(q && file);
+  char *name = strdup(file), **files;
+  size_t i, size;
+  if (!name) {
+    eprintf("Could not allocate memory for job %s\n", file);
+    return 1;
+  }
+  pthread_mutex_lock(&q->lock);
+  if (q->n == q->size) { // grow, unrolling the circular buffer
+    size = q->size ? q->size * 2 : 8;
+    if (!(files = malloc(size * sizeof(*files)))) {
+      pthread_mutex_unlock(&q->lock);
+      eprintf("Could not allocate memory for job %s\n", file);
+      free(name);
+      return 1;
+    }
+    for (i = 0; i < q->n; i++)
+      files[i] = q->files[(q->head + i) % q->size];
+    free(q->files);
+    q->files = files;
+    q->head = 0;
+    q->size = size;
+  }
+  q->files[(q->head + q->n) % q->size] = name;
+  q->n++;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+void queue_on_job(char const *file, void *q) {
+  if (queue_push((queue_t *)q, file) == 0)
+    fprintf(stderr, "Queued job %s\n", file);
+}
+
+program_t *queue_next(queue_t *q) {
+  assert(q);
+  program_t *p;
+  pthread_mutex_lock(&q->lock);
+  while (!q->ready && (q->n > 0 || q->busy))
+    pthread_cond_wait(&q->cond, &q->lock);
+  p = q->ready;
+  q->ready = NULL;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return p;
+}
+
+program_t *queue_try_next(queue_t *q) {
+  assert(q);
+  program_t *p;
+  pthread_mutex_lock(&q->lock);
+  p = q->ready;
+  q->ready = NULL;
+  if (p)
+    pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return p;
+}
+
+void queue_discard(queue_t *q, program_t *p) {
+  assert(q && p);
+  program_t **done;
+  size_t size;
+  pthread_mutex_lock(&q->lock);
+  if (q->n_done == q->done_size) {
+    size = q->done_size ? q->done_size * 2 : 4;
+    if (!(done = realloc(q->done, size * sizeof(*done)))) {
+      pthread_mutex_unlock(&q->lock);
+      program_free(p);
+      return;
+    }
+    q->done = done;
+    q->done_size = size;
+  }
+  q->done[q->n_done++] = p;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+//   ____  _        _   _         __                  _   _
+//  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
+//  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//   ___) | || (_| | |_| | (__  |  _| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Preparing thread: frees the finished jobs, and prepares the next one as
+// soon as the slot is free. The lock is released while working
+static void *queue_run(void *ud) {
+  queue_t *q = (queue_t *)ud;
+  program_t *p;
+  char *file;
+  pthread_mutex_lock(&q->lock);
+  while (!q->stop) {
+    if (q->n_done > 0) {
+      p = q->done[--q->n_done];
+      pthread_mutex_unlock(&q->lock);
+      program_free(p);
+      pthread_mutex_lock(&q->lock);
+    } else if (!q->ready && q->n > 0) {
+      file = q->files[q->head];
+      q->head = (q->head + 1) % q->size;
+      q->n--;
+      q->busy = 1;
+      pthread_mutex_unlock(&q->lock);
+      p = queue_prepare(q, file);
+      free(file);
+      pthread_mutex_lock(&q->lock);
+      q->ready = p;
+      q->busy = 0;
+      pthread_cond_broadcast(&q->cond);
+    } else {
+      pthread_cond_wait(&q->cond, &q->lock);
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+// Parse, plan and validate the file, approaching it from q->from; q->from
+// becomes the end of the job. NULL if the job is to be skipped
+static program_t *queue_prepare(queue_t *q, char const *file) {
+  program_t *p = program_new(file);
+  point_t *end;
+  if (!p)
+    return NULL;
+  if (program_parse(p, q->machine) <= 0) {
+    eprintf("Could not parse the job %s, skipped\n", file);
+    goto fail;
+  }
+  if (program_validate(p, q->machine) > 0) {
+    eprintf("Job %s exceeds the machine travel, skipped\n", file);
+    goto fail;
+  }
+  // the first block is planned from the machine zero
+  if (point_dist(q->from, machine_zero(q->machine)) > QUEUE_TOL &&
+      program_resume(p, 0, q->from)) {
+    eprintf("Could not plan the approach to the job %s, skipped\n", file);
+    goto fail;
+  }
+  end = block_target(program_last(p));
+  point_set_xyz(q->from, point_x(end), point_y(end), point_z(end));
+  fprintf(stderr, "Job %s ready\n", file);
+  return p;
+fail:
+  program_free(p);
+  return NULL;
+}
+
+//   _____         _
+//  |_   _|__  ___| |_
+//    | |/ _ \/ __| __|
+//    | |  __/\__ \ |_
+//    |_|\___||___/\__|
+
+#ifdef QUEUE_MAIN
+#include <unistd.h>
+// The same program queued twice around a missing file, then once more
+// through the job handler: the first one starts from the machine zero as
+// is, the others are approached from the end of the one before. The
+// later jobs are polled without waiting, as the real-time loop does
+int main(int argc, char const *argv[]) {
+  machine_t *m = NULL;
+  program_t *ref = NULL, *p = NULL;
+  queue_t *q = NULL;
+  block_t *b;
+  point_t *end;
+  size_t n;
+  int k, rv = EXIT_FAILURE;
+  if (argc < 3) {
+    eprintf("Usage: %s machine.ini program.gcode\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (!(m = machine_new(argv[1])))
+    exit(EXIT_FAILURE);
+  if (!(ref = program_new(argv[2])) || program_parse(ref, m) <= 0)
+    goto end;
+  n = program_length(ref);
+  end = block_target(program_last(ref));
+  if (!(q = queue_new(m, machine_zero(m))))
+    goto end;
+  if (queue_push(q, argv[2]) || queue_push(q, "missing.gcode") ||
+      queue_push(q, argv[2]))
+    goto end;
+  for (k = 0; k < 3; k++) {
+    if (k == 2)
+      queue_on_job(argv[2], q);
+    if (p)
+      queue_discard(q, p);
+    if (k == 0)
+      p = queue_next(q);
+    else
+      while (!(p = queue_try_next(q)) && queue_length(q) > 0)
+        usleep(1000);
+    if (!p || program_length(p) != n + (k ? 3 : 0)) {
+      eprintf("Job %d: %zu blocks, expected %zu\n", k,
+              p ? program_length(p) : 0, n + (k ? 3 : 0));
+      goto end;
+    }
+    b = program_next(p);
+    if (k > 0 && (point_x(block_target(b)) != point_x(end) ||
+                  point_y(block_target(b)) != point_y(end))) {
+      eprintf("Job %d is not approached from the end of the last one\n", k);
+      goto end;
+    }
+  }
+  queue_discard(q, p);
+  if ((p = queue_next(q)) || queue_length(q) != 0) {
+    eprintf("Jobs left in the queue\n");
+    goto end;
+  }
+  // a job left prepared is freed with the queue
+  queue_push(q, argv[2]);
+  printf("Ran 3 jobs of %zu blocks\n", n);
+  rv = EXIT_SUCCESS;
+end:
+  if (p)
+    program_free(p);
+  if (q)
+    queue_free(q);
+  if (ref)
+    program_free(ref);
+  machine_free(m);
+  return rv;
+}
+#endif
@@ -0,0 +1,62 @@
+//    ___
+//   / _ \ _   _  ___ _   _  ___
+//  | | | | | | |/ _ \ | | |/ _ \
+//  | |_| | |_| |  __/ |_| |  __/
+//   \__\_\\__,_|\___|\__,_|\___|
+//
+// Job queue
+// Program files are queued for execution, and the next one is parsed,
+// planned and validated by a background thread while the current one runs
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "defines.h"
+#include "machine.h"
+#include "program.h"
+
+//   _____
+//  |_   _|   _ _ __   ___  ___
+//    | || | | | '_ \ / _ \/ __|
+//    | || |_| | |_) |  __/\__ \
+//    |_| \__, | .__/ \___||___/
+//        |___/|_|
+
+// Opaque struct
+typedef struct queue queue_t;
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+// Jobs are prepared for the machine m, each one starting from the end of
+// the one before it, and the first one from the point from
+queue_t *queue_new(machine_t *m, point_t const *from);
+// stops the preparing thread and frees the jobs not yet taken
+void queue_free(queue_t *q);
+
+// Accessors ===================================================================
+// Jobs waiting, being prepared or ready
+size_t queue_length(queue_t *q);
+
+// Methods =====================================================================
+// Append the program file to the queue; safe from any thread (e.g. the
+// MQTT one). Returns 0 on success
+int queue_push(queue_t *q, char const *file);
+// Same, with the signature of a machine job handler (see machine.h)
+void queue_on_job(char const *file, void *q);
+// Next job, parsed and planned, with the approach from the end of the job
+// before it when they do not meet. Waits while it is being prepared; NULL
+// when no job is left (files that cannot be parsed or exceed the machine
+// travel are reported and skipped)
+program_t *queue_next(queue_t *q);
+// Same, but never waits: NULL also while the next job is being prepared
+// (see queue_length()), for the real-time loop
+program_t *queue_try_next(queue_t *q);
+// Free the finished program p in the background; never waits
+void queue_discard(queue_t *q, program_t *p);
+
+#endif // QUEUE_H
@@ -0,0 +1,341 @@
+//   ____       _               _       _
+//  / ___|  ___| |_ _ __   ___ (_)_ __ | |_
+//  \___ \ / _ \ __| '_ \ / _ \| | '_ \| __|
+//   ___) |  __/ |_| |_) | (_) | | | | | |_
+//  |____/ \___|\__| .__/ \___/|_|_| |_|\__|
+//                 |_|
+
+#include "setpoint.h"
+#include <math.h>
+#include <string.h>
+
+//   ____            _                 _   _
+//  |  _ \  ___  ___| | __ _ _ __ __ _| |_(_) ___  _ __  ___
+//  | | | |/ _ \/ __| |/ _` | '__/ _` | __| |/ _ \| '_ \/ __|
+//  | |_| |  __/ (__| | (_| | | | (_| | |_| | (_) | | | \__ \
+//  |____/ \___|\___|_|\__,_|_|  \__,_|\__|_|\___/|_| |_|___/
+
+// Bitmask of decoded fields
+#define SP_X 1
+#define SP_Y 2
+#define SP_Z 4
+#define SP_XYZ 7
+
+// Exact powers of ten (as doubles) for fast number conversion
+static const double pow10_table[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+
+static int parse_number(char const **p, char const *end, data_t *val);
+static int skip_value(char const **p, char const *end);
+static uint64_t read_le64(uint8_t const *b);
+static void write_le64(uint8_t *b, uint64_t v);
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+int setpoint_decode(void const *payload, size_t len, setpoint_t *sp) {
+  char const *p = (char const *)payload, *end = p + len, *key;
+  size_t key_len;
+  data_t x = 0, y = 0, z = 0, v;
+  int rapid = 0, found = 0;
+  assert(sp);
+  if (!payload || len == 0)
+    return 1;
+
+  // binary format
+  if (p[0] == 'S') {
+    uint8_t const *b = (uint8_t const *)payload;
+    uint64_t u;
+    if (len != SETPOINT_BIN_LEN || b[1] != 'P' ||
+        b[2] != SETPOINT_BIN_VERSION)
+      return 1;
+    u = read_le64(b + 4);
+    memcpy(&x, &u, sizeof(x));
+    u = read_le64(b + 12);
+    memcpy(&y, &u, sizeof(y));
+    u = read_le64(b + 20);
+    memcpy(&z, &u, sizeof(z));
+    sp->x = x;
+    sp->y = y;
+    sp->z = z;
+    sp->rapid = b[3] & 1;
+    return 0;
+  }
+
+  // JSON format: one pass over the buffer, in any key order and spacing
+  while (p < end && IS_SPACE(*p))
+    p++;
+  if (p >= end || *p++ != '{')
+    return 1;
+  while (1) {
+    while (p < end && IS_SPACE(*p))
+      p++;
+    if (p >= end)
+      return 1;
+    if (*p == '}')
+      break;
+    // key
+    if (*p++ != '"')
+      return 1;
+    key = p;
+    while (p < end && *p != '"')
+      p++;
+    if (p >= end)
+      return 1;
+    key_len = p++ - key;
+    while (p < end && IS_SPACE(*p))
+      p++;
+    if (p >= end || *p++ != ':')
+      return 1;
+    while (p < end && IS_SPACE(*p))
+      p++;
+    // value
+    if (key_len == 1 && (*key == 'x' || *key == 'y' || *key == 'z')) {
+      if (parse_number(&p, end, &v))
+        return 1;
+      switch (*key) {
+      case 'x':
+        x = v;
+        found |= SP_X;
+        break;
+      case 'y':
+        y = v;
+        found |= SP_Y;
+        break;
+      default:
+        z = v;
+        found |= SP_Z;
+      }
+    } else if (key_len == 5 && strncmp(key, "rapid", 5) == 0) {
+      if (end - p >= 4 && strncmp(p, "true", 4) == 0) {
+        rapid = 1;
+        p += 4;
+      } else if (end - p >= 5 && strncmp(p, "false", 5) == 0) {
+        rapid = 0;
+        p += 5;
+      } else if (parse_number(&p, end, &v) == 0) {
+        rapid = v != 0;
+      } else {
+        return 1;
+      }
+    } else if (skip_value(&p, end)) { // unknown keys are ignored
+      return 1;
+    }
+    // separator
+    while (p < end && IS_SPACE(*p))
+      p++;
+    if (p >= end)
+      return 1;
+    if (*p == ',')
+      p++;
+    else if (*p != '}')
+      return 1;
+  }
+  if (found != SP_XYZ)
+    return 1;
+  sp->x = x;
+  sp->y = y;
+  sp->z = z;
+  sp->rapid = rapid;
+  return 0;
+}
+
+size_t setpoint_encode_json(setpoint_t const *sp, char *buf, size_t len) {
+  assert(sp && buf);
+  int n = snprintf(buf, len, "{\"x\":%f, \"y\":%f, \"z\":%f, \"rapid\":%d}",
+                   sp->x, sp->y, sp->z, sp->rapid ? 1 : 0);
+  return (n < 0 || (size_t)n >= len) ? 0 : (size_t)n;
+}
+
+size_t setpoint_encode_bin(setpoint_t const *sp, void *buf, size_t len) {
+  uint8_t *b = (uint8_t *)buf;
+  uint64_t u;
+  assert(sp && buf);
+  if (len < SETPOINT_BIN_LEN)
+    return 0;
+  b[0] = 'S';
+  b[1] = 'P';
+  b[2] = SETPOINT_BIN_VERSION;
+  b[3] = sp->rapid ? 1 : 0;
+  memcpy(&u, &sp->x, sizeof(u));
+  write_le64(b + 4, u);
+  memcpy(&u, &sp->y, sizeof(u));
+  write_le64(b + 12, u);
+  memcpy(&u, &sp->z, sizeof(u));
+  write_le64(b + 20, u);
+  return SETPOINT_BIN_LEN;
+}
+
+//   ____  _        _   _         __                  _   _
+//  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
+//  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//   ___) | || (_| | |_| | (__  |  _| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Decimal number in the form [-+]digits[.digits][(e|E)[-+]digits], never
+// reading past end. The mantissa is accumulated as an integer and scaled once
+// by an exact power of ten, which is correctly rounded for up to 15 digits.
+static int parse_number(char const **p, char const *end, data_t *val) {
+  char const *s = *p;
+  uint64_t mant = 0;
+  int exp10 = 0, neg = 0, digits = 0, e = 0, eneg = 0;
+  double r;
+  if (s < end && (*s == '-' || *s == '+'))
+    neg = (*s++ == '-');
+  for (; s < end && IS_DIGIT(*s); s++, digits++) {
+    if (mant < 100000000000000000ULL)
+      mant = mant * 10 + (*s - '0');
+    else
+      exp10++;
+  }
+  if (s < end && *s == '.') {
+    for (s++; s < end && IS_DIGIT(*s); s++, digits++) {
+      if (mant < 100000000000000000ULL) {
+        mant = mant * 10 + (*s - '0');
+        exp10--;
+      }
+    }
+  }
+  if (digits == 0)
+    return 1;
+  if (s < end && (*s == 'e' || *s == 'E')) {
+    s++;
+    if (s < end && (*s == '-' || *s == '+'))
+      eneg = (*s++ == '-');
+    if (s >= end || !IS_DIGIT(*s))
+      return 1;
+    for (; s < end && IS_DIGIT(*s); s++)
+      if (e < 10000)
+        e = e * 10 + (*s - '0');
+    exp10 += eneg ? -e : e;
+  }
+  r = (double)mant;
+  if (exp10 < 0 && exp10 >= -22)
+    r /= pow10_table[-exp10];
+  else if (exp10 > 0 && exp10 <= 22)
+    r *= pow10_table[exp10];
+  else if (exp10 != 0)
+    r *= pow(10, exp10);
+  *val = neg ? -r : r;
+  *p = s;
+  return 0;
+}
+
+// Skip a JSON scalar value (string, number or literal)
+static int skip_value(char const **p, char const *end) {
+  char const *s = *p;
+  if (s >= end)
+    return 1;
+  if (*s == '"') {
+    for (s++; s < end && *s != '"'; s++)
+      if (*s == '\\')
+        s++;
+    if (s >= end)
+      return 1;
+    s++;
+  } else {
+    while (s < end && *s != ',' && *s != '}' && !IS_SPACE(*s))
+      s++;
+  }
+  *p = s;
+  return 0;
+}
+
+static uint64_t read_le64(uint8_t const *b) {
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+    v = (v << 8) | b[i];
+  return v;
+}
+
+static void write_le64(uint8_t *b, uint64_t v) {
+  int i;
+  for (i = 0; i < 8; i++, v >>= 8)
+    b[i] = v & 0xFF;
+}
+
+//   _____         _
+//  |_   _|__  ___| |_
+//    | |/ _ \/ __| __|
+//    | |  __/\__ \ |_
+//    |_|\___||___/\__|
+
+#ifdef SETPOINT_MAIN
+#include <time.h>
+
+#define CHECK(cond, msg)                                                       \
+  if (!(cond)) {                                                               \
+    eprintf("%s\n", msg);                                                      \
+    exit(EXIT_FAILURE);                                                        \
+  }
+
+int main(int argc, char const *argv[]) {
+  setpoint_t sp, sp2 = {.x = 400.125, .y = -12.5, .z = 1e-3, .rapid = 1};
+  char buf[128];
+  uint8_t bin[SETPOINT_BIN_LEN];
+  size_t i, n = 1000000, len;
+  struct timespec t0, t1;
+  data_t dt;
+
+  // current controller format
+  char const *msg = "{\"x\":100.200000, \"y\":123.000000, \"z\":0.000000, "
+                    "\"rapid\":1}";
+  CHECK(setpoint_decode(msg, strlen(msg), &sp) == 0, "JSON decode failed");
+  CHECK(sp.x == 100.2 && sp.y == 123 && sp.z == 0 && sp.rapid == 1,
+        "Wrong JSON values");
+  // different spacing, order, extra keys, booleans, exponents
+  msg = " { \"rapid\" : false,\"z\":-1.5e2,\n\"y\" :7, \"tag\":\"a,}\","
+        "\"x\":+.5 } ";
+  CHECK(setpoint_decode(msg, strlen(msg), &sp) == 0, "Tolerant decode failed");
+  CHECK(sp.x == 0.5 && sp.y == 7 && sp.z == -150 && sp.rapid == 0,
+        "Wrong tolerant values");
+  // not NUL terminated: the payload ends before the closing brace
+  msg = "{\"x\":1, \"y\":2, \"z\":3}";
+  CHECK(setpoint_decode(msg, strlen(msg) - 1, &sp) == 1,
+        "Truncated payload accepted");
+  CHECK(setpoint_decode(msg, 8, &sp) == 1, "Truncated number accepted");
+  msg = "{\"x\":1, \"y\":2}";
+  CHECK(setpoint_decode(msg, strlen(msg), &sp) == 1, "Missing z accepted");
+  msg = "{\"x\":1, \"y\":-, \"z\":3}";
+  CHECK(setpoint_decode(msg, strlen(msg), &sp) == 1, "Bad number accepted");
+  // round trips
+  len = setpoint_encode_json(&sp2, buf, sizeof(buf));
+  CHECK(len > 0 && setpoint_decode(buf, len, &sp) == 0, "JSON round trip");
+  CHECK(sp.x == sp2.x && sp.y == sp2.y && sp.z == sp2.z && sp.rapid,
+        "Wrong JSON round trip values");
+  len = setpoint_encode_bin(&sp2, bin, sizeof(bin));
+  CHECK(len == SETPOINT_BIN_LEN && setpoint_decode(bin, len, &sp) == 0,
+        "Binary round trip");
+  CHECK(sp.x == sp2.x && sp.y == sp2.y && sp.z == sp2.z && sp.rapid,
+        "Wrong binary round trip values");
+  CHECK(setpoint_decode(bin, len - 1, &sp) == 1, "Short binary accepted");
+
+  // throughput
+  len = setpoint_encode_json(&sp2, buf, sizeof(buf));
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < n; i++) {
+    buf[6] = '0' + i % 10;
+    setpoint_decode(buf, len, &sp);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  dt = (t1.tv_sec - t0.tv_sec) * 1E3 + (t1.tv_nsec - t0.tv_nsec) / 1E6;
+  printf("JSON:   %.0f messages/ms\n", n / dt);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < n; i++) {
+    bin[4] = i & 0xFF;
+    setpoint_decode(bin, SETPOINT_BIN_LEN, &sp);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  dt = (t1.tv_sec - t0.tv_sec) * 1E3 + (t1.tv_nsec - t0.tv_nsec) / 1E6;
+  printf("binary: %.0f messages/ms\n", n / dt);
+  return 0;
+}
+#endif
@@ -0,0 +1,49 @@
+//   ____       _               _       _
+//  / ___|  ___| |_ _ __   ___ (_)_ __ | |_
+//  \___ \ / _ \ __| '_ \ / _ \| | '_ \| __|
+//   ___) |  __/ |_| |_) | (_) | | | | | |_
+//  |____/ \___|\__| .__/ \___/|_|_| |_|\__|
+//                 |_|
+// Set point payloads exchanged between controller and simulator
+// Two formats are supported:
+// - JSON text: {"x":100.2, "y":123, "z":0.0, "rapid":1}
+// - binary: "SP", version, flags (bit 0: rapid), then x, y, z as doubles
+
+#ifndef SETPOINT_H
+#define SETPOINT_H
+
+#include "defines.h"
+
+//   _____
+//  |_   _|   _ _ __   ___  ___
+//    | || | | | '_ \ / _ \/ __|
+//    | || |_| | |_) |  __/\__ \
+//    |_| \__, | .__/ \___||___/
+//        |___/|_|
+
+// Plain data, not opaque: it is decoded on the stack at every message
+typedef struct {
+  data_t x, y, z; // coordinates (mm)
+  int rapid;      // 1 for rapid motion
+} setpoint_t;
+
+#define SETPOINT_BIN_VERSION 1
+#define SETPOINT_BIN_LEN (4 + 3 * sizeof(double))
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Decode a payload of len bytes (not necessarily NUL-terminated), in either
+// format. Single pass, bounds-checked, no allocations.
+// Returns 0 on success, 1 on malformed payload (sp is then left untouched)
+int setpoint_decode(void const *payload, size_t len, setpoint_t *sp);
+
+// Encode into buf (of size len); return the payload length, or 0 if the
+// buffer is too small
+size_t setpoint_encode_json(setpoint_t const *sp, char *buf, size_t len);
+size_t setpoint_encode_bin(setpoint_t const *sp, void *buf, size_t len);
+
+#endif // SETPOINT_H
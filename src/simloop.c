@@ -0,0 +1,301 @@
+//   ____  _           _
+//  / ___|(_)_ __ ___ | | ___   ___  _ __
+//  \___ \| | '_ ` _ \| |/ _ \ / _ \| '_ \
+//   ___) | | | | | | | | (_) | (_) | |_) |
+//  |____/|_|_| |_| |_|_|\___/ \___/| .__/
+//                                  |_|
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+#include "simloop.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+//   ____            _                 _   _
+//  |  _ \  ___  ___| | __ _ _ __ __ _| |_(_) ___  _ __  ___
+//  | | | |/ _ \/ __| |/ _` | '__/ _` | __| |/ _ \| '_ \/ __|
+//  | |_| |  __/ (__| | (_| | | | (_| | |_| | (_) | | | \__ \
+//  |____/ \___|\___|_|\__,_|_|  \__,_|\__|_|\___/|_| |_|___/
+
+// Priority used when SCHED_FIFO is granted (needs CAP_SYS_NICE or root)
+#define SIMLOOP_PRIORITY 50
+
+typedef struct simloop {
+  simloop_step step;       // step function
+  void *userdata;          // its argument
+  data_t period;           // seconds
+  int cpu;                 // core to pin the thread to (-1: none)
+  pthread_t thread;        // simulation thread
+  int running;             // thread status (only touched by the owner)
+  int fd;                  // period timer (timerfd, -1: none)
+  atomic_int stop;         // stop request
+  atomic_uint_fast64_t ticks;    // periods elapsed
+  atomic_uint_fast64_t overruns; // periods missed because a step was late
+  _Atomic data_t max_step;       // longest step duration (s)
+} simloop_t;
+
+static void *simloop_thread(void *ud);
+static int simloop_timer(simloop_t *loop);
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+simloop_t *simloop_new(data_t period, int cpu, simloop_step step,
+                       void *userdata) {
+  simloop_t *loop = NULL;
+  assert(step);
+  if (period <= 0) {
+    eprintf("Simulation period must be positive\n");
+    return NULL;
+  }
+  loop = malloc(sizeof(*loop));
+  if (!loop) {
+    eprintf("Could not allocate memory for simulation loop\n");
+    return NULL;
+  }
+  memset(loop, 0, sizeof(*loop));
+  loop->step = step;
+  loop->userdata = userdata;
+  loop->period = period;
+  loop->cpu = cpu;
+  loop->fd = -1;
+  atomic_init(&loop->stop, 0);
+  atomic_init(&loop->ticks, 0);
+  atomic_init(&loop->overruns, 0);
+  atomic_init(&loop->max_step, 0);
+  return loop;
+}
+
+void simloop_free(simloop_t *loop) {
+  if (!loop)
+    return;
+  simloop_stop(loop);
+  free(loop);
+}
+
+// Accessors ===================================================================
+uint64_t simloop_ticks(simloop_t const *loop) {
+  assert(loop);
+  return atomic_load(&((simloop_t *)loop)->ticks);
+}
+
+uint64_t simloop_overruns(simloop_t const *loop) {
+  assert(loop);
+  return atomic_load(&((simloop_t *)loop)->overruns);
+}
+
+data_t simloop_max_step(simloop_t const *loop) {
+  assert(loop);
+  return atomic_load(&((simloop_t *)loop)->max_step);
+}
+
+int simloop_running(simloop_t const *loop) {
+  assert(loop);
+  return loop->running;
+}
+
+// Methods =====================================================================
+int simloop_start(simloop_t *loop) {
+  pthread_attr_t attr;
+  struct sched_param param = {.sched_priority = SIMLOOP_PRIORITY};
+  sigset_t mask, old_mask;
+  int rc;
+  assert(loop);
+  if (loop->running)
+    return 0;
+  atomic_store(&loop->stop, 0);
+  // the timer is armed here, so that its failure reaches the caller
+  if (simloop_timer(loop))
+    return 1;
+  // the simulation thread must not steal the timer signals of the main loop
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  // scheduling attributes are ignored unless explicitly requested
+  pthread_attr_init(&attr);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &param);
+  rc = pthread_create(&loop->thread, &attr, simloop_thread, loop);
+  if (rc == EPERM) {
+    wprintf("No permission for SCHED_FIFO, using default scheduling\n");
+    rc = pthread_create(&loop->thread, NULL, simloop_thread, loop);
+  }
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (rc) {
+    eprintf("Could not start the simulation thread: %s\n", strerror(rc));
+    if (loop->fd >= 0)
+      close(loop->fd);
+    loop->fd = -1;
+    return 1;
+  }
+  loop->running = 1;
+  return 0;
+}
+
+void simloop_stop(simloop_t *loop) {
+  assert(loop);
+  if (!loop->running)
+    return;
+  atomic_store(&loop->stop, 1);
+  pthread_join(loop->thread, NULL);
+  if (loop->fd >= 0)
+    close(loop->fd);
+  loop->fd = -1;
+  loop->running = 0;
+}
+
+//   ____  _        _   _         __                  _   _
+//  / ___|| |_ __ _| |_(_) ___   / _|_   _ _ __   ___| |_(_) ___  _ __  ___
+//  \___ \| __/ _` | __| |/ __| | |_| | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//   ___) | || (_| | |_| | (__  |  _| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |____/ \__\__,_|\__|_|\___| |_|  \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Periodic timer of the loop, first expiring one period from now; nothing
+// to do where timerfd is missing. Returns 0 on success
+static int simloop_timer(simloop_t *loop) {
+#ifdef __linux__
+  long ns = (long)(loop->period * 1E9);
+  struct itimerspec its = {
+      .it_interval = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000},
+      .it_value = {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000}};
+  loop->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (loop->fd < 0 || timerfd_settime(loop->fd, 0, &its, NULL)) {
+    eprintf("Could not create the simulation timer: %s\n", strerror(errno));
+    if (loop->fd >= 0)
+      close(loop->fd);
+    loop->fd = -1;
+    return 1;
+  }
+#else
+  (void)loop;
+#endif
+  return 0;
+}
+
+static void pin(simloop_t *loop) {
+  if (loop->cpu < 0)
+    return;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(loop->cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    wprintf("Could not pin the simulation thread to CPU %d\n", loop->cpu);
+#else
+  wprintf("CPU pinning not supported on this platform\n");
+#endif
+}
+
+static data_t elapsed(struct timespec const *a, struct timespec const *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1E9;
+}
+
+// Call the step function and keep track of the worst case duration
+static void run_step(simloop_t *loop, uint64_t ticks) {
+  struct timespec t0, t1;
+  data_t d;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  loop->step(loop->userdata, ticks * loop->period);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  d = elapsed(&t0, &t1);
+  if (d > atomic_load_explicit(&loop->max_step, memory_order_relaxed))
+    atomic_store_explicit(&loop->max_step, d, memory_order_relaxed);
+}
+
+// The nominal time passed to the step function is ticks * period: when a
+// step is late, the missed periods are counted as overruns and the time
+// jumps ahead, so that the simulation never drifts from the wall clock
+static void *simloop_thread(void *ud) {
+  simloop_t *loop = (simloop_t *)ud;
+  uint64_t ticks = 0, expirations;
+  pin(loop);
+#ifdef __linux__
+  // the timer was armed by simloop_start(), and is closed by simloop_stop()
+  while (!atomic_load(&loop->stop)) {
+    // blocks until at least one period has elapsed
+    if (read(loop->fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations))
+      continue;
+    if (expirations > 1)
+      atomic_fetch_add(&loop->overruns, expirations - 1);
+    ticks += expirations;
+    atomic_store(&loop->ticks, ticks);
+    run_step(loop, ticks);
+  }
+#else
+  // no timerfd: sleep to absolute deadlines on the monotonic clock
+  struct timespec t0, now, rem;
+  data_t late;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (!atomic_load(&loop->stop)) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    late = elapsed(&t0, &now) - (ticks + 1) * loop->period;
+    if (late < 0) {
+      rem.tv_sec = (time_t)(-late);
+      rem.tv_nsec = (long)((-late - rem.tv_sec) * 1E9);
+      nanosleep(&rem, NULL);
+      expirations = 1;
+    } else {
+      expirations = 1 + (uint64_t)(late / loop->period);
+    }
+    if (expirations > 1)
+      atomic_fetch_add(&loop->overruns, expirations - 1);
+    ticks += expirations;
+    atomic_store(&loop->ticks, ticks);
+    run_step(loop, ticks);
+  }
+#endif
+  return NULL;
+}
+
+//   _____         _
+//  |_   _|__  ___| |_
+//    | |/ _ \/ __| __|
+//    | |  __/\__ \ |_
+//    |_|\___||___/\__|
+
+#ifdef SIMLOOP_MAIN
+static void count(void *ud, data_t time) {
+  data_t *last = (data_t *)ud;
+  *last = time;
+}
+
+int main(int argc, char const *argv[]) {
+  data_t period = 0.001, last = 0;
+  int cpu = argc > 1 ? atoi(argv[1]) : -1;
+  struct timespec ts = {.tv_sec = 0, .tv_nsec = 200000000};
+  uint64_t ticks, overruns;
+  simloop_t *loop = simloop_new(period, cpu, count, &last);
+  if (!loop || simloop_start(loop))
+    exit(EXIT_FAILURE);
+  nanosleep(&ts, NULL);
+  simloop_stop(loop);
+  ticks = simloop_ticks(loop);
+  overruns = simloop_overruns(loop);
+  printf("ticks: %llu, overruns: %llu, last time: %f s, max step: %f ms\n",
+         (unsigned long long)ticks, (unsigned long long)overruns, last,
+         simloop_max_step(loop) * 1E3);
+  simloop_free(loop);
+  // 200 ms at 1 kHz: allow for a very loaded test machine
+  if (ticks < 100 || ticks > 300 || last != ticks * period) {
+    eprintf("Unexpected number of ticks\n");
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
+#endif
@@ -0,0 +1,54 @@
+//   ____  _           _
+//  / ___|(_)_ __ ___ | | ___   ___  _ __
+//  \___ \| | '_ ` _ \| |/ _ \ / _ \| '_ \
+//   ___) | | | | | | | | (_) | (_) | |_) |
+//  |____/|_|_| |_| |_|_|\___/ \___/| .__/
+//                                  |_|
+// Periodic simulation thread
+// One thread, optionally pinned to a CPU core, calls a step function at a
+// fixed period (paced by a timerfd on Linux) and counts its own overruns
+
+#ifndef SIMLOOP_H
+#define SIMLOOP_H
+
+#include "defines.h"
+
+//   _____
+//  |_   _|   _ _ __   ___  ___
+//    | || | | | '_ \ / _ \/ __|
+//    | || |_| | |_) |  __/\__ \
+//    |_| \__, | .__/ \___||___/
+//        |___/|_|
+
+// Opaque struct
+typedef struct simloop simloop_t;
+
+// Step function: called once per period with the nominal simulation time
+typedef void (*simloop_step)(void *userdata, data_t time);
+
+//   _____                 _   _
+//  |  ___|   _ _ __   ___| |_(_) ___  _ __  ___
+//  | |_ | | | | '_ \ / __| __| |/ _ \| '_ \/ __|
+//  |  _|| |_| | | | | (__| |_| | (_) | | | \__ \
+//  |_|   \__,_|_| |_|\___|\__|_|\___/|_| |_|___/
+
+// Lifecycle ===================================================================
+// period in seconds; cpu < 0 means no pinning
+simloop_t *simloop_new(data_t period, int cpu, simloop_step step,
+                       void *userdata);
+void simloop_free(simloop_t *loop);
+
+// Accessors ===================================================================
+uint64_t simloop_ticks(simloop_t const *loop);    // periods elapsed
+uint64_t simloop_overruns(simloop_t const *loop); // periods missed
+data_t simloop_max_step(simloop_t const *loop);   // longest step (s)
+int simloop_running(simloop_t const *loop);
+
+// Methods =====================================================================
+// Arm the period timer and start the thread; returns 0 on success, 1 if
+// either fails (nothing is left running)
+int simloop_start(simloop_t *loop);
+// Request the stop through an atomic flag and join the thread
+void simloop_stop(simloop_t *loop);
+
+#endif // SIMLOOP_H